@@ -0,0 +1,270 @@
+#include "pch.h"
+#include <algorithm>
+#include <string>
+#include "SnapshotAnalysis.h"
+
+//////////////////////////////////////////////////////////////////////////
+// Offline analyser for the files written by CManagedHeap::Snapshot
+//
+//   HeapSnapshotTool summary <snapshot>              Counters, fragmentation and block size histograms
+//   HeapSnapshotTool holes <snapshot> [columns]      Map of free space across the heap, and the largest holes
+//   HeapSnapshotTool diff <before> <after>           What was allocated and released between two snapshots
+//////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+	const u32 k_uMapRows = 16;
+	const u32 k_uDefaultMapColumns = 64;
+	const u32 k_uMaxListed = 10;		// Blocks listed individually before the rest are only counted
+
+	//////////////////////////////////////////////////////////////////////////
+	// Prints the non empty rows of a power of two histogram
+	//////////////////////////////////////////////////////////////////////////
+	void PrintHistogram(const char* szTitle, const u32* pCounts, const unsigned long long* pBytes)
+	{
+		const u32 k_uBarWidth = 40;
+
+		u32 uMaxCount = 0;
+		for (u32 i = 0; i < k_uNumSnapshotBuckets; i++)
+		{
+			uMaxCount = std::max(uMaxCount, pCounts[i]);
+		}
+
+		std::cout << szTitle << std::endl;
+		if (uMaxCount == 0)
+		{
+			std::cout << "  (none)" << std::endl;
+			return;
+		}
+
+		for (u32 i = 0; i < k_uNumSnapshotBuckets; i++)
+		{
+			if (pCounts[i] == 0)
+			{
+				continue;
+			}
+			unsigned long long uLow = 1ull << i;
+			unsigned long long uHigh = (1ull << (i + 1)) - 1;
+			u32 uBar = (u32)((unsigned long long)pCounts[i] * k_uBarWidth / uMaxCount);
+
+			std::cout << "  " << std::setw(10) << uLow << " - " << std::setw(10) << uHigh
+				<< std::setw(10) << pCounts[i] << std::setw(14) << pBytes[i] << "  "
+				<< std::string(uBar ? uBar : 1, '*') << std::endl;
+		}
+	}
+
+	void PrintSummary(const SSnapshot& sSnapshot, const SSnapshotSummary& sSummary)
+	{
+		std::cout << "Heap size            " << sSnapshot.m_sHeader.m_uHeapSize << std::endl;
+		std::cout << "Blocks               " << sSummary.m_uNumBlocks << " (" << sSummary.m_uNumFreeBlocks << " free)" << std::endl;
+		std::cout << "Allocated bytes      " << sSummary.m_uAllocatedBytes << std::endl;
+		std::cout << "Free bytes           " << sSummary.m_uFreeBytes << std::endl;
+		std::cout << "Padding bytes        " << sSummary.m_uPaddingBytes << std::endl;
+		std::cout << "Overhead bytes       " << sSummary.m_uOverheadBytes << std::endl;
+		std::cout << "Largest free block   " << sSummary.m_uLargestFreeBlock << std::endl;
+		std::cout << "Fragmentation        " << std::fixed << std::setprecision(1) << GetFragmentation(sSummary) * 100.0 << "%" << std::endl;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// summary <snapshot>
+	//////////////////////////////////////////////////////////////////////////
+	int RunSummary(const char* szFilename)
+	{
+		SSnapshot sSnapshot;
+		if (!LoadSnapshot(szFilename, sSnapshot))
+		{
+			return 1;
+		}
+
+		SSnapshotSummary sSummary = Summarise(sSnapshot);
+		PrintSummary(sSnapshot, sSummary);
+		std::cout << std::endl;
+		PrintHistogram("Free blocks by size          count         bytes", sSummary.m_uFreeCounts, sSummary.m_uFreeBytesPerBucket);
+		std::cout << std::endl;
+		PrintHistogram("Allocated blocks by size     count         bytes", sSummary.m_uAllocatedCounts, sSummary.m_uAllocatedBytesPerBucket);
+		return 0;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// holes <snapshot> [columns]
+	// Each character covers an equal span of the heap: '.' all free, '#' no free bytes, '+' partly free
+	//////////////////////////////////////////////////////////////////////////
+	int RunHoles(const char* szFilename, u32 uColumns)
+	{
+		SSnapshot sSnapshot;
+		if (!LoadSnapshot(szFilename, sSnapshot))
+		{
+			return 1;
+		}
+
+		u32 uNumCells = uColumns * k_uMapRows;
+		double dCellSize = (double)sSnapshot.m_sHeader.m_uHeapSize / uNumCells;
+		std::vector<double> freePerCell(uNumCells, 0.0);
+
+		std::vector<const SSnapshotBlock*> holes;
+		for (const SSnapshotBlock& sBlock : sSnapshot.m_Blocks)
+		{
+			if (!IsFreeBlock(sBlock))
+			{
+				continue;
+			}
+			holes.push_back(&sBlock);
+
+			//Spread the free payload over the cells it covers
+			double dStart = sBlock.m_uOffset + sSnapshot.m_sHeader.m_uHeaderSize;
+			double dEnd = dStart + sBlock.m_uBlockSize;
+			for (u32 uCell = (u32)(dStart / dCellSize); uCell < uNumCells && uCell * dCellSize < dEnd; uCell++)
+			{
+				double dCellStart = uCell * dCellSize;
+				freePerCell[uCell] += std::min(dEnd, dCellStart + dCellSize) - std::max(dStart, dCellStart);
+			}
+		}
+
+		for (u32 uRow = 0; uRow < k_uMapRows; uRow++)
+		{
+			std::cout << std::setw(10) << (unsigned long long)(uRow * uColumns * dCellSize) << "  ";
+			for (u32 uColumn = 0; uColumn < uColumns; uColumn++)
+			{
+				double dFree = freePerCell[uRow * uColumns + uColumn];
+				std::cout << (dFree >= dCellSize * 0.999 ? '.' : (dFree <= 0.0 ? '#' : '+'));
+			}
+			std::cout << std::endl;
+		}
+
+		std::sort(holes.begin(), holes.end(), [](const SSnapshotBlock* pA, const SSnapshotBlock* pB) { return pA->m_uBlockSize > pB->m_uBlockSize; });
+
+		std::cout << std::endl << "Largest holes of " << holes.size() << std::endl;
+		std::cout << "      offset        size   alignment" << std::endl;
+		for (size_t i = 0; i < holes.size() && i < k_uMaxListed; i++)
+		{
+			std::cout << std::setw(12) << holes[i]->m_uOffset << std::setw(12) << holes[i]->m_uBlockSize << std::setw(12) << holes[i]->m_uAlignment << std::endl;
+		}
+		return 0;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// Prints the blocks allocated in one snapshot but not the other, matched by offset and size
+	//////////////////////////////////////////////////////////////////////////
+	void PrintAllocatedOnlyIn(const char* szTitle, const SSnapshot& sIn, const SSnapshot& sNotIn)
+	{
+		std::unordered_map<u32, u32> other; //Offset to size of every allocated block in sNotIn
+		for (const SSnapshotBlock& sBlock : sNotIn.m_Blocks)
+		{
+			if (!IsFreeBlock(sBlock))
+			{
+				other[sBlock.m_uOffset] = sBlock.m_uBlockSize;
+			}
+		}
+
+		u32 uCount = 0;
+		unsigned long long uBytes = 0;
+		std::vector<const SSnapshotBlock*> listed;
+		for (const SSnapshotBlock& sBlock : sIn.m_Blocks)
+		{
+			if (IsFreeBlock(sBlock))
+			{
+				continue;
+			}
+			std::unordered_map<u32, u32>::const_iterator it = other.find(sBlock.m_uOffset);
+			if (it != other.end() && it->second == sBlock.m_uBlockSize)
+			{
+				continue;
+			}
+			uCount++;
+			uBytes += sBlock.m_uBlockSize;
+			if (listed.size() < k_uMaxListed)
+			{
+				listed.push_back(&sBlock);
+			}
+		}
+
+		std::cout << szTitle << ": " << uCount << " blocks, " << uBytes << " bytes" << std::endl;
+		for (const SSnapshotBlock* pBlock : listed)
+		{
+			std::cout << std::setw(12) << pBlock->m_uOffset << std::setw(12) << pBlock->m_uBlockSize << std::endl;
+		}
+		if (uCount > listed.size())
+		{
+			std::cout << "         ... " << uCount - listed.size() << " more" << std::endl;
+		}
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// diff <before> <after>
+	//////////////////////////////////////////////////////////////////////////
+	int RunDiff(const char* szBefore, const char* szAfter)
+	{
+		SSnapshot sBefore;
+		SSnapshot sAfter;
+		if (!LoadSnapshot(szBefore, sBefore) || !LoadSnapshot(szAfter, sAfter))
+		{
+			return 1;
+		}
+		if (sBefore.m_sHeader.m_uHeapSize != sAfter.m_sHeader.m_uHeapSize)
+		{
+			std::cout << "Warning: heap sizes differ, these may not be snapshots of the same heap" << std::endl;
+		}
+
+		SSnapshotSummary sA = Summarise(sBefore);
+		SSnapshotSummary sB = Summarise(sAfter);
+
+		std::cout << "                           before         after        change" << std::endl;
+		auto PrintRow = [](const char* szName, long long iBefore, long long iAfter)
+		{
+			std::cout << szName << std::setw(14) << iBefore << std::setw(14) << iAfter << std::setw(14) << std::showpos << iAfter - iBefore << std::noshowpos << std::endl;
+		};
+		PrintRow("Blocks               ", sA.m_uNumBlocks, sB.m_uNumBlocks);
+		PrintRow("Free blocks          ", sA.m_uNumFreeBlocks, sB.m_uNumFreeBlocks);
+		PrintRow("Allocated bytes      ", sA.m_uAllocatedBytes, sB.m_uAllocatedBytes);
+		PrintRow("Free bytes           ", sA.m_uFreeBytes, sB.m_uFreeBytes);
+		PrintRow("Padding bytes        ", sA.m_uPaddingBytes, sB.m_uPaddingBytes);
+		PrintRow("Largest free block   ", sA.m_uLargestFreeBlock, sB.m_uLargestFreeBlock);
+		std::cout << "Fragmentation        " << std::fixed << std::setprecision(1) << std::setw(13) << GetFragmentation(sA) * 100.0 << "%"
+			<< std::setw(13) << GetFragmentation(sB) * 100.0 << "%" << std::endl;
+
+		std::cout << std::endl;
+		PrintAllocatedOnlyIn("Allocated since before", sAfter, sBefore);
+		std::cout << std::endl;
+		PrintAllocatedOnlyIn("Released since before", sBefore, sAfter);
+
+		std::cout << std::endl << "Free blocks by size      before         after" << std::endl;
+		for (u32 i = 0; i < k_uNumSnapshotBuckets; i++)
+		{
+			if (sA.m_uFreeCounts[i] || sB.m_uFreeCounts[i])
+			{
+				std::cout << "  " << std::setw(10) << (1ull << i) << std::setw(14) << sA.m_uFreeCounts[i] << std::setw(14) << sB.m_uFreeCounts[i] << std::endl;
+			}
+		}
+		return 0;
+	}
+
+	void PrintUsage()
+	{
+		std::cout << "Usage:" << std::endl;
+		std::cout << "  HeapSnapshotTool summary <snapshot>" << std::endl;
+		std::cout << "  HeapSnapshotTool holes <snapshot> [columns]" << std::endl;
+		std::cout << "  HeapSnapshotTool diff <before> <after>" << std::endl;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	std::string command = argc > 1 ? argv[1] : "";
+
+	if (command == "summary" && argc == 3)
+	{
+		return RunSummary(argv[2]);
+	}
+	if (command == "holes" && (argc == 3 || argc == 4))
+	{
+		u32 uColumns = argc == 4 ? (u32)strtoul(argv[3], nullptr, 10) : k_uDefaultMapColumns;
+		return RunHoles(argv[2], uColumns ? uColumns : k_uDefaultMapColumns);
+	}
+	if (command == "diff" && argc == 4)
+	{
+		return RunDiff(argv[2], argv[3]);
+	}
+
+	PrintUsage();
+	return 1;
+}
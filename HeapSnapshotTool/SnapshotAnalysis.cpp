@@ -0,0 +1,98 @@
+#include "pch.h"
+#include <algorithm>
+#include "SnapshotAnalysis.h"
+
+//////////////////////////////////////////////////////////////////////////
+// Reads a snapshot, returning false with a message if it is not one
+//////////////////////////////////////////////////////////////////////////
+bool LoadSnapshot(const char* szFilename, SSnapshot& sSnapshot)
+{
+	std::ifstream file(szFilename, std::ios::in | std::ios::binary);
+	if (!file)
+	{
+		std::cerr << "Could not open " << szFilename << std::endl;
+		return false;
+	}
+
+	file.read((char*)&sSnapshot.m_sHeader, sizeof(SSnapshotHeader));
+	if (!file || sSnapshot.m_sHeader.m_uMagic != CManagedHeap::k_uSnapshotMagic)
+	{
+		std::cerr << szFilename << " is not a heap snapshot" << std::endl;
+		return false;
+	}
+	if (sSnapshot.m_sHeader.m_uVersion != CManagedHeap::k_uSnapshotVersion)
+	{
+		std::cerr << szFilename << " is snapshot version " << sSnapshot.m_sHeader.m_uVersion << ", expected " << CManagedHeap::k_uSnapshotVersion << std::endl;
+		return false;
+	}
+
+	SSnapshotBlock sBlock;
+	while (file.read((char*)&sBlock, sizeof(sBlock)))
+	{
+		sSnapshot.m_Blocks.push_back(sBlock);
+	}
+	if (file.gcount() != 0)
+	{
+		std::cerr << szFilename << " is truncated" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Index of the power of two bucket holding a size
+//////////////////////////////////////////////////////////////////////////
+u32 GetSnapshotBucket(u32 uSize)
+{
+	u32 uBucket = 0;
+	while (uSize >>= 1)
+	{
+		uBucket++;
+	}
+	return uBucket;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Totals and histograms for one snapshot
+//////////////////////////////////////////////////////////////////////////
+SSnapshotSummary Summarise(const SSnapshot& sSnapshot)
+{
+	SSnapshotSummary sSummary = {};
+	sSummary.m_uNumBlocks = (u32)sSnapshot.m_Blocks.size();
+
+	for (const SSnapshotBlock& sBlock : sSnapshot.m_Blocks)
+	{
+		u32 uBucket = GetSnapshotBucket(sBlock.m_uBlockSize);
+		sSummary.m_uOverheadBytes += sSnapshot.m_sHeader.m_uHeaderSize + sSnapshot.m_sHeader.m_uFooterSize;
+		sSummary.m_uPaddingBytes += sBlock.m_uLeftPadding; //Right padding is the next block's left padding
+
+		if (IsFreeBlock(sBlock))
+		{
+			sSummary.m_uNumFreeBlocks++;
+			sSummary.m_uFreeBytes += sBlock.m_uBlockSize;
+			sSummary.m_uFreeCounts[uBucket]++;
+			sSummary.m_uFreeBytesPerBucket[uBucket] += sBlock.m_uBlockSize;
+			sSummary.m_uLargestFreeBlock = std::max(sSummary.m_uLargestFreeBlock, sBlock.m_uBlockSize);
+		}
+		else
+		{
+			sSummary.m_uAllocatedBytes += sBlock.m_uBlockSize;
+			sSummary.m_uAllocatedCounts[uBucket]++;
+			sSummary.m_uAllocatedBytesPerBucket[uBucket] += sBlock.m_uBlockSize;
+		}
+	}
+
+	if (!sSnapshot.m_Blocks.empty())
+	{
+		sSummary.m_uPaddingBytes += sSnapshot.m_Blocks.back().m_uRightPadding;
+	}
+	return sSummary;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Share of free bytes outside the largest free block, 0 when all free space is in one piece
+//////////////////////////////////////////////////////////////////////////
+double GetFragmentation(const SSnapshotSummary& sSummary)
+{
+	return sSummary.m_uFreeBytes ? 1.0 - (double)sSummary.m_uLargestFreeBlock / sSummary.m_uFreeBytes : 0.0;
+}
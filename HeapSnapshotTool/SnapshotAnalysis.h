@@ -0,0 +1,56 @@
+#ifndef _SNAPSHOTANALYSIS_H_
+#define _SNAPSHOTANALYSIS_H_
+
+#include "CManagedHeap.h"
+
+//////////////////////////////////////////////////////////////////////////
+// Loading and totalling the files written by CManagedHeap::Snapshot
+// Kept apart from HeapSnapshotTool's commands so the tests can build them too
+//////////////////////////////////////////////////////////////////////////
+
+typedef CManagedHeap::SSnapshotHeader SSnapshotHeader;
+typedef CManagedHeap::SSnapshotBlock SSnapshotBlock;
+
+const u32 k_uNumSnapshotBuckets = 32;		// One per power of two
+
+struct SSnapshot
+{
+	SSnapshotHeader m_sHeader;
+	std::vector<SSnapshotBlock> m_Blocks;
+};
+
+struct SSnapshotSummary
+{
+	u32 m_uNumBlocks;
+	u32 m_uNumFreeBlocks;
+	unsigned long long m_uAllocatedBytes;
+	unsigned long long m_uFreeBytes;
+	unsigned long long m_uPaddingBytes;
+	unsigned long long m_uOverheadBytes;
+	u32 m_uLargestFreeBlock;
+
+	u32 m_uFreeCounts[k_uNumSnapshotBuckets];
+	unsigned long long m_uFreeBytesPerBucket[k_uNumSnapshotBuckets];
+	u32 m_uAllocatedCounts[k_uNumSnapshotBuckets];
+	unsigned long long m_uAllocatedBytesPerBucket[k_uNumSnapshotBuckets];
+};
+
+// Blocks waiting on the maintenance thread are still allocated as far as the caller is concerned
+inline bool IsFreeBlock(const SSnapshotBlock& sBlock)
+{
+	return (sBlock.m_uFlags & CManagedHeap::ESnapshotFlag_Free) != 0;
+}
+
+// Reads a snapshot, returning false with a message if it is not one
+bool LoadSnapshot(const char* szFilename, SSnapshot& sSnapshot);
+
+// Index of the power of two bucket holding a size
+u32 GetSnapshotBucket(u32 uSize);
+
+// Totals and histograms for one snapshot
+SSnapshotSummary Summarise(const SSnapshot& sSnapshot);
+
+// Share of free bytes outside the largest free block, 0 when all free space is in one piece
+double GetFragmentation(const SSnapshotSummary& sSummary);
+
+#endif // #ifndef _SNAPSHOTANALYSIS_H_
@@ -0,0 +1,599 @@
+#include "pch.h"
+#include <new>
+#include <cerrno>
+#include <cstddef>
+#include "CManagedHeap.h"
+
+#pragma comment(lib, "psapi.lib") //EnumProcessModules, for the modules to patch
+
+//////////////////////////////////////////////////////////////////////////
+// Drop in replacement for the CRT heap, backed by CManagedHeap
+//
+// When the DLL is loaded it patches the import tables of every module in the process, so their calls
+// to malloc, calloc, realloc, free, _msize, _recalloc and _expand in the universal CRT land here.
+// operator new/delete in an MSVC module call the imported malloc/free, so they follow without being
+// replaced. LoadLibrary is hooked the same way, so modules loaded later are patched as they arrive.
+// ShimLauncher loads the DLL into a program before its first instruction runs, and the C entry points
+// are also exported under their CRT names for modules which link MallocShim.lib ahead of the CRT.
+//
+// Anything allocated before the patch, by a module which isn't patched, or while the heaps are being
+// set up comes from the real CRT, and is handed back to it. The shim's own imports are never patched,
+// so its calls to malloc and friends reach the real CRT.
+//
+// One region is reserved from the OS and split between k_uNumShimHeaps heaps. Each thread
+// is assigned the heap with the fewest threads, and frees find their heap from the address.
+//////////////////////////////////////////////////////////////////////////
+
+#define SHIM_THREAD_LOCAL __declspec(thread)
+
+#ifdef _DEBUG
+#define SHIM_CRT_MODULE "ucrtbased.dll"		// The CRT the shim imports, which foreign pointers are handed back to
+#else
+#define SHIM_CRT_MODULE "ucrtbase.dll"
+#endif
+
+extern "C" void* ShimMalloc(size_t uSize);
+extern "C" void ShimFreeC(void* pMemory);
+extern "C" void* ShimCalloc(size_t uCount, size_t uSize);
+extern "C" void* ShimRealloc(void* pMemory, size_t uSize);
+extern "C" size_t ShimMallocUsableSize(void* pMemory);
+extern "C" void* ShimRecalloc(void* pMemory, size_t uCount, size_t uSize);
+extern "C" void* ShimExpand(void* pMemory, size_t uSize);
+
+namespace
+{
+	const u32 k_uNumShimHeaps = 4;
+	const u32 k_uDefaultShimHeapMB = 256;			// Size of each heap, overridden by MEMORYMANAGER_SHIM_HEAP_MB
+	const u32 k_uShimAlign = MEMORY_ALLOCATION_ALIGNMENT;	// What the CRT guarantees, 16 on x64 and 8 on x86
+	const u32 k_uMaxHooks = 16;
+	const u32 k_uMaxModules = 1024;					// Modules beyond this are not patched
+
+	enum EShimState
+	{
+		EShimState_Uninitialised = 0,
+		EShimState_Initialising,
+		EShimState_Ready,
+		EShimState_Failed,
+	};
+
+	// An import table entry to replace, found by the address the loader bound it to
+	struct SHook
+	{
+		void* m_pTarget;
+		void* m_pReplacement;
+	};
+
+	// Everything here is constant initialised, so it is usable before any static constructors have run
+	std::atomic<u32> s_uShimState(EShimState_Uninitialised);
+	alignas(CManagedHeap) u8 s_aHeapStorage[k_uNumShimHeaps][sizeof(CManagedHeap)];
+	CManagedHeap* s_pHeaps[k_uNumShimHeaps];
+	std::atomic<u32> s_uThreadsPerHeap[k_uNumShimHeaps];
+	u8* s_pRegion = nullptr;
+	u32 s_uHeapSize = 0;
+
+	HMODULE s_hShimModule = nullptr;
+	SHook s_aHooks[k_uMaxHooks];
+	u32 s_uNumHooks = 0;
+	HMODULE s_aModules[k_uMaxModules];
+	std::mutex s_PatchLock;							// Guards the hooks, the module list and the import tables
+
+	SHIM_THREAD_LOCAL u32 t_uHeapIndex = 0;			// Heap index + 1, 0 if the thread has not been assigned one
+	SHIM_THREAD_LOCAL bool t_bInitialising = false;	// Set while this thread sets up the heaps, to catch recursion
+
+	//////////////////////////////////////////////////////////////////////////
+	// Returns the heap which owns a pointer, nullptr if it did not come from our region
+	//////////////////////////////////////////////////////////////////////////
+	inline CManagedHeap* FindOwningHeap(void* pMemory)
+	{
+		if (!s_pRegion || (u8*)pMemory < s_pRegion)
+		{
+			return nullptr;
+		}
+
+		size_t uIndex = ((u8*)pMemory - s_pRegion) / s_uHeapSize;
+		return uIndex < k_uNumShimHeaps ? s_pHeaps[uIndex] : nullptr;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// Releases a thread's place on its heap, so new threads are spread evenly
+	//////////////////////////////////////////////////////////////////////////
+	void ThreadExit(void* pHeapIndex)
+	{
+		u32 uHeapIndex = (u32)(uintptr_t)pHeapIndex;
+		if (uHeapIndex)
+		{
+			s_uThreadsPerHeap[uHeapIndex - 1].fetch_sub(1);
+		}
+		t_uHeapIndex = 0;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// Reserves the region and sets up the heaps inside it
+	// Anything in here which calls malloc is served by the real CRT
+	//////////////////////////////////////////////////////////////////////////
+	bool InitialiseHeaps()
+	{
+		u32 uHeapMB = k_uDefaultShimHeapMB;
+		char szBuffer[16];
+		const char* szHeapMB = GetEnvironmentVariableA("MEMORYMANAGER_SHIM_HEAP_MB", szBuffer, sizeof(szBuffer)) ? szBuffer : nullptr;
+		if (szHeapMB)
+		{
+			u32 uRequested = (u32)strtoul(szHeapMB, nullptr, 10);
+			if (uRequested > 0 && uRequested < 4096)
+			{
+				uHeapMB = uRequested;
+			}
+		}
+		s_uHeapSize = uHeapMB * 1024 * 1024;
+		size_t uRegionSize = (size_t)s_uHeapSize * k_uNumShimHeaps;
+
+		u8* pRegion = (u8*)VirtualAlloc(nullptr, uRegionSize, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+		if (!pRegion)
+		{
+			return false;
+		}
+
+		for (u32 i = 0; i < k_uNumShimHeaps; i++)
+		{
+			s_pHeaps[i] = new (s_aHeapStorage[i]) CManagedHeap();
+			s_pHeaps[i]->Initialise(pRegion + (size_t)i * s_uHeapSize, s_uHeapSize);
+			if (s_pHeaps[i]->GetLastError() != CManagedHeap::EHeapError_Ok)
+			{
+				return false;
+			}
+		}
+
+		s_pRegion = pRegion; //Published last, frees only look for their heap once everything is set up
+		return true;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// Sets up the heaps on first use. Returns false if they are not usable from this thread yet,
+	// either because they failed, or because this thread is the one setting them up
+	//////////////////////////////////////////////////////////////////////////
+	bool EnsureInitialised()
+	{
+		u32 uState = s_uShimState.load(std::memory_order_acquire);
+		if (uState == EShimState_Ready)
+		{
+			return true;
+		}
+		if (uState == EShimState_Failed || t_bInitialising)
+		{
+			return false;
+		}
+
+		u32 uExpected = EShimState_Uninitialised;
+		if (s_uShimState.compare_exchange_strong(uExpected, EShimState_Initialising))
+		{
+			t_bInitialising = true;
+			bool bReady = InitialiseHeaps();
+			t_bInitialising = false;
+
+			s_uShimState.store(bReady ? EShimState_Ready : EShimState_Failed, std::memory_order_release);
+			return bReady;
+		}
+
+		//Another thread is setting up, wait for it
+		while ((uState = s_uShimState.load(std::memory_order_acquire)) == EShimState_Initialising)
+		{
+			std::this_thread::yield();
+		}
+		return uState == EShimState_Ready;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// Returns the index of the heap assigned to this thread, assigning the least used heap on first call
+	//////////////////////////////////////////////////////////////////////////
+	u32 GetThreadHeapIndex()
+	{
+		if (t_uHeapIndex)
+		{
+			return t_uHeapIndex - 1;
+		}
+
+		u32 uBest = 0;
+		for (u32 i = 1; i < k_uNumShimHeaps; i++)
+		{
+			if (s_uThreadsPerHeap[i].load() < s_uThreadsPerHeap[uBest].load())
+			{
+				uBest = i;
+			}
+		}
+		s_uThreadsPerHeap[uBest].fetch_add(1);
+		t_uHeapIndex = uBest + 1;
+		return uBest;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// Allocates from this thread's heap, falling back to the others when it is full
+	// Returns nullptr with bForwarded set if the heaps can't be used yet, so the caller should use the CRT
+	//////////////////////////////////////////////////////////////////////////
+	void* ShimAllocate(size_t uSize, size_t uAlignment, bool& bForwarded)
+	{
+		bForwarded = false;
+		if (uSize == 0)
+		{
+			uSize = 1;
+		}
+		if (uAlignment < k_uShimAlign)
+		{
+			uAlignment = k_uShimAlign;
+		}
+		//Checked here as well as in the heap, so sizes above 4GB are not truncated before the heap sees them
+		if (uSize > CManagedHeap::k_uMaxAllocationSize || uAlignment > CManagedHeap::k_uMaxAllocationSize - uSize)
+		{
+			return nullptr;
+		}
+
+		if (!EnsureInitialised())
+		{
+			bForwarded = true;
+			return nullptr;
+		}
+
+		u32 uFirst = GetThreadHeapIndex();
+		for (u32 i = 0; i < k_uNumShimHeaps; i++)
+		{
+			void* pMemory = s_pHeaps[(uFirst + i) % k_uNumShimHeaps]->Allocate((u32)uSize, (u32)uAlignment);
+			if (pMemory)
+			{
+				return pMemory;
+			}
+		}
+		return nullptr;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// Replaces every import table entry in a module bound to a hooked function
+	// Entries already pointing at the shim no longer match, so patching a module twice does nothing
+	//////////////////////////////////////////////////////////////////////////
+	void PatchModule(HMODULE hModule)
+	{
+		u8* pBase = (u8*)hModule;
+		IMAGE_DOS_HEADER* pDosHeader = (IMAGE_DOS_HEADER*)pBase;
+		if (pDosHeader->e_magic != IMAGE_DOS_SIGNATURE)
+		{
+			return;
+		}
+		IMAGE_NT_HEADERS* pNtHeaders = (IMAGE_NT_HEADERS*)(pBase + pDosHeader->e_lfanew);
+		if (pNtHeaders->Signature != IMAGE_NT_SIGNATURE)
+		{
+			return;
+		}
+
+		const IMAGE_DATA_DIRECTORY& sImports = pNtHeaders->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT];
+		if (!sImports.VirtualAddress)
+		{
+			return;
+		}
+
+		for (IMAGE_IMPORT_DESCRIPTOR* pDescriptor = (IMAGE_IMPORT_DESCRIPTOR*)(pBase + sImports.VirtualAddress); pDescriptor->Name; pDescriptor++)
+		{
+			for (IMAGE_THUNK_DATA* pThunk = (IMAGE_THUNK_DATA*)(pBase + pDescriptor->FirstThunk); pThunk->u1.Function; pThunk++)
+			{
+				void** ppEntry = (void**)&pThunk->u1.Function;
+				for (u32 i = 0; i < s_uNumHooks; i++)
+				{
+					if (*ppEntry != s_aHooks[i].m_pTarget)
+					{
+						continue;
+					}
+
+					DWORD uOldProtect;
+					if (VirtualProtect(ppEntry, sizeof(void*), PAGE_READWRITE, &uOldProtect))
+					{
+						InterlockedExchangePointer(ppEntry, s_aHooks[i].m_pReplacement);
+						VirtualProtect(ppEntry, sizeof(void*), uOldProtect, &uOldProtect);
+					}
+					break;
+				}
+			}
+		}
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// Patches every module loaded in the process, apart from the shim itself
+	//////////////////////////////////////////////////////////////////////////
+	void PatchLoadedModules()
+	{
+		std::lock_guard<std::mutex> lock(s_PatchLock);
+
+		DWORD uNeeded = 0;
+		if (!EnumProcessModules(GetCurrentProcess(), s_aModules, sizeof(s_aModules), &uNeeded))
+		{
+			return;
+		}
+
+		u32 uNumModules = uNeeded / sizeof(HMODULE);
+		if (uNumModules > k_uMaxModules)
+		{
+			uNumModules = k_uMaxModules;
+		}
+		for (u32 i = 0; i < uNumModules; i++)
+		{
+			if (s_aModules[i] != s_hShimModule)
+			{
+				PatchModule(s_aModules[i]);
+			}
+		}
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// The LoadLibrary hooks, which patch whatever the call brought in
+	// The shim's own imports are untouched, so these call the real functions
+	//////////////////////////////////////////////////////////////////////////
+	HMODULE WINAPI HookLoadLibraryA(LPCSTR szFilename)
+	{
+		HMODULE hModule = LoadLibraryA(szFilename);
+		if (hModule)
+		{
+			PatchLoadedModules();
+		}
+		return hModule;
+	}
+
+	HMODULE WINAPI HookLoadLibraryW(LPCWSTR szFilename)
+	{
+		HMODULE hModule = LoadLibraryW(szFilename);
+		if (hModule)
+		{
+			PatchLoadedModules();
+		}
+		return hModule;
+	}
+
+	HMODULE WINAPI HookLoadLibraryExA(LPCSTR szFilename, HANDLE hFile, DWORD uFlags)
+	{
+		HMODULE hModule = LoadLibraryExA(szFilename, hFile, uFlags);
+		if (hModule)
+		{
+			PatchLoadedModules();
+		}
+		return hModule;
+	}
+
+	HMODULE WINAPI HookLoadLibraryExW(LPCWSTR szFilename, HANDLE hFile, DWORD uFlags)
+	{
+		HMODULE hModule = LoadLibraryExW(szFilename, hFile, uFlags);
+		if (hModule)
+		{
+			PatchLoadedModules();
+		}
+		return hModule;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// Adds a hook for an export, if the module has it
+	//////////////////////////////////////////////////////////////////////////
+	void AddHook(HMODULE hModule, const char* szExport, void* pReplacement)
+	{
+		void* pTarget = hModule ? (void*)GetProcAddress(hModule, szExport) : nullptr;
+		if (pTarget && s_uNumHooks < k_uMaxHooks)
+		{
+			s_aHooks[s_uNumHooks].m_pTarget = pTarget;
+			s_aHooks[s_uNumHooks].m_pReplacement = pReplacement;
+			s_uNumHooks++;
+		}
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// Finds the functions to hook, then patches the modules already loaded
+	// Imports are matched by the address they were bound to, which also catches
+	// modules importing the CRT through the api-ms-win-crt-* forwarders.
+	// Modules with their own static CRT, or using msvcrt.dll, bind elsewhere and keep their own heap
+	//////////////////////////////////////////////////////////////////////////
+	void InstallHooks(HMODULE hShimModule)
+	{
+		s_hShimModule = hShimModule;
+
+		HMODULE hCrt = GetModuleHandleA(SHIM_CRT_MODULE);
+		AddHook(hCrt, "malloc", (void*)&ShimMalloc);
+		AddHook(hCrt, "calloc", (void*)&ShimCalloc);
+		AddHook(hCrt, "realloc", (void*)&ShimRealloc);
+		AddHook(hCrt, "free", (void*)&ShimFreeC);
+		AddHook(hCrt, "_msize", (void*)&ShimMallocUsableSize);
+		AddHook(hCrt, "_recalloc", (void*)&ShimRecalloc);
+		AddHook(hCrt, "_expand", (void*)&ShimExpand);
+
+		//Imports of kernel32 stubs and of the kernelbase functions they forward to are bound to different addresses
+		const char* szLoaderModules[] = { "kernel32.dll", "kernelbase.dll" };
+		for (const char* szLoaderModule : szLoaderModules)
+		{
+			HMODULE hLoader = GetModuleHandleA(szLoaderModule);
+			AddHook(hLoader, "LoadLibraryA", (void*)&HookLoadLibraryA);
+			AddHook(hLoader, "LoadLibraryW", (void*)&HookLoadLibraryW);
+			AddHook(hLoader, "LoadLibraryExA", (void*)&HookLoadLibraryExA);
+			AddHook(hLoader, "LoadLibraryExW", (void*)&HookLoadLibraryExW);
+		}
+
+		PatchLoadedModules();
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+// C allocation functions
+// Pointers which are not ours, and requests made before the heaps are ready, go to the real CRT
+//////////////////////////////////////////////////////////////////////////
+extern "C" void* ShimMalloc(size_t uSize)
+{
+	bool bForwarded;
+	void* pMemory = ShimAllocate(uSize, k_uShimAlign, bForwarded);
+	if (bForwarded)
+	{
+		return malloc(uSize);
+	}
+	if (!pMemory)
+	{
+		errno = ENOMEM;
+	}
+	return pMemory;
+}
+
+extern "C" void ShimFreeC(void* pMemory)
+{
+	if (CManagedHeap* pHeap = FindOwningHeap(pMemory))
+	{
+		pHeap->Deallocate(pMemory);
+	}
+	else if (pMemory)
+	{
+		free(pMemory);
+	}
+}
+
+extern "C" void* ShimCalloc(size_t uCount, size_t uSize)
+{
+	if (uSize != 0 && uCount > (size_t)-1 / uSize) //Overflow
+	{
+		errno = ENOMEM;
+		return nullptr;
+	}
+
+	//The whole block, so _recalloc can rely on everything past the requested size being zero
+	void* pMemory = ShimMalloc(uCount * uSize);
+	if (pMemory)
+	{
+		memset(pMemory, 0, ShimMallocUsableSize(pMemory));
+	}
+	return pMemory;
+}
+
+extern "C" void* ShimRealloc(void* pMemory, size_t uSize)
+{
+	if (pMemory && !FindOwningHeap(pMemory))
+	{
+		return realloc(pMemory, uSize);
+	}
+	if (!pMemory)
+	{
+		return ShimMalloc(uSize);
+	}
+	if (uSize == 0)
+	{
+		ShimFreeC(pMemory);
+		return nullptr;
+	}
+
+	size_t uOldSize = ShimMallocUsableSize(pMemory);
+	if (uSize <= uOldSize) //Already large enough, keep it where it is
+	{
+		return pMemory;
+	}
+
+	void* pNewMemory = ShimMalloc(uSize);
+	if (pNewMemory)
+	{
+		memcpy(pNewMemory, pMemory, uOldSize);
+		ShimFreeC(pMemory);
+	}
+	return pNewMemory;
+}
+
+extern "C" int ShimPosixMemalign(void** ppMemory, size_t uAlignment, size_t uSize)
+{
+	if (uAlignment < sizeof(void*) || (uAlignment & (uAlignment - 1)) != 0)
+	{
+		return EINVAL;
+	}
+
+	//There is no aligned CRT allocation free() accepts, so this fails rather than forwarding
+	bool bForwarded;
+	void* pMemory = ShimAllocate(uSize, uAlignment, bForwarded);
+	if (!pMemory)
+	{
+		return ENOMEM;
+	}
+	*ppMemory = pMemory;
+	return 0;
+}
+
+extern "C" void* ShimAlignedAlloc(size_t uAlignment, size_t uSize)
+{
+	if (uAlignment == 0 || (uAlignment & (uAlignment - 1)) != 0)
+	{
+		errno = EINVAL;
+		return nullptr;
+	}
+
+	bool bForwarded;
+	void* pMemory = ShimAllocate(uSize, uAlignment, bForwarded);
+	if (!pMemory)
+	{
+		errno = ENOMEM;
+	}
+	return pMemory;
+}
+
+extern "C" size_t ShimMallocUsableSize(void* pMemory)
+{
+	if (CManagedHeap* pHeap = FindOwningHeap(pMemory))
+	{
+		return pHeap->GetAllocationSize(pMemory);
+	}
+	return pMemory ? _msize(pMemory) : 0;
+}
+
+extern "C" void* ShimRecalloc(void* pMemory, size_t uCount, size_t uSize)
+{
+	if (pMemory && !FindOwningHeap(pMemory))
+	{
+		return _recalloc(pMemory, uCount, uSize);
+	}
+	if (uSize != 0 && uCount > (size_t)-1 / uSize) //Overflow
+	{
+		errno = ENOMEM;
+		return nullptr;
+	}
+
+	//The block only records its usable size, so the bytes past the requested size are kept zero instead.
+	//Clearing from the smaller of the old usable size and the new size covers growing and shrinking
+	size_t uNewSize = uCount * uSize;
+	size_t uKeptSize = ShimMallocUsableSize(pMemory);
+	if (uKeptSize > uNewSize)
+	{
+		uKeptSize = uNewSize;
+	}
+	void* pNewMemory = ShimRealloc(pMemory, uNewSize);
+	if (pNewMemory)
+	{
+		memset((u8*)pNewMemory + uKeptSize, 0, ShimMallocUsableSize(pNewMemory) - uKeptSize);
+	}
+	return pNewMemory;
+}
+
+extern "C" void* ShimExpand(void* pMemory, size_t uSize)
+{
+	if (pMemory && !FindOwningHeap(pMemory))
+	{
+		return _expand(pMemory, uSize);
+	}
+
+	//Blocks never move or grow in place, so only a size which already fits succeeds
+	if (!pMemory || uSize > ShimMallocUsableSize(pMemory))
+	{
+		errno = ENOMEM;
+		return nullptr;
+	}
+	return pMemory;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Patches the process when loaded, and gives a thread's place on its heap back when it exits
+// The DLL is pinned, as patched modules and live blocks both point into it
+//////////////////////////////////////////////////////////////////////////
+BOOL WINAPI DllMain(HINSTANCE hInstance, DWORD uReason, LPVOID pReserved)
+{
+	if (uReason == DLL_PROCESS_ATTACH)
+	{
+		HMODULE hPinned;
+		GetModuleHandleExA(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_PIN, (LPCSTR)&DllMain, &hPinned);
+		EnsureInitialised();
+		InstallHooks(hInstance);
+	}
+	else if (uReason == DLL_THREAD_DETACH)
+	{
+		ThreadExit((void*)(uintptr_t)t_uHeapIndex);
+	}
+	return TRUE;
+}
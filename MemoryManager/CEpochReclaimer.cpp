@@ -0,0 +1,400 @@
+#include "pch.h"
+#include "CEpochReclaimer.h"
+#include "CPageMap.h"
+
+
+//////////////////////////////////////////////////////////////////////////
+//
+//////////////////////////////////////////////////////////////////////////
+CEpochReclaimer::CEpochReclaimer() :
+	m_pHeap(nullptr),
+	m_uGlobalEpoch(0),
+	m_pBatchPool(nullptr),
+	m_pFreeBatches(nullptr),
+	m_uNumFreeBatches(0),
+	m_pOrphanBatches(nullptr),
+	m_bHasOrphans(false),
+	m_ELastError(EEpochError_Ok)
+{
+	for (SThreadRecord& sRecord : m_sThreads)
+	{
+		sRecord.m_bInUse.store(false);
+		sRecord.m_bActive.store(false);
+		sRecord.m_uLocalEpoch.store(0);
+		for (SRetireBucket& sBucket : sRecord.m_sBuckets)
+		{
+			sBucket.m_pBatches = nullptr;
+			sBucket.m_uEpoch = 0;
+		}
+		sRecord.m_uRetiresSinceAdvance = 0;
+	}
+}
+
+
+//////////////////////////////////////////////////////////////////////////
+//
+//////////////////////////////////////////////////////////////////////////
+CEpochReclaimer::~CEpochReclaimer()
+{
+	if (m_pHeap != nullptr)
+	{
+		//DID NOT CALL SHUTDOWN FIRST
+		_ASSERT(false);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Sets up the reclaimer to free retired pointers back to the given heap
+// Reserves uNumRetireBatches batches from the OS, which caps how many pointers can wait to be freed at once
+//////////////////////////////////////////////////////////////////////////
+void CEpochReclaimer::Initialise(CManagedHeap* pHeap, u32 uNumRetireBatches)
+{
+	if (m_pHeap)
+	{
+		m_ELastError = EEpochState_Init_AlreadyInitialised;
+		return;
+	}
+
+	if (!pHeap)
+	{
+		m_ELastError = EEpochState_Init_NullHeap;
+		return;
+	}
+
+	//Batches come from the OS rather than the heap, so retiring never waits on the heap lock or fails because the heap is full
+	m_pBatchPool = uNumRetireBatches ? (SRetireBatch*)CPageMap::AllocatePages((size_t)uNumRetireBatches * sizeof(SRetireBatch)) : nullptr;
+	if (!m_pBatchPool)
+	{
+		m_ELastError = EEpochState_Init_UnableToAquireMemory;
+		return;
+	}
+
+	m_pFreeBatches = nullptr;
+	for (u32 i = uNumRetireBatches; i > 0; i--)
+	{
+		m_pBatchPool[i - 1].m_pNext = m_pFreeBatches;
+		m_pFreeBatches = &m_pBatchPool[i - 1];
+	}
+	m_uNumFreeBatches = uNumRetireBatches;
+	m_pOrphanBatches = nullptr;
+	m_bHasOrphans.store(false);
+
+	m_pHeap = pHeap;
+	m_uGlobalEpoch.store(0);
+	m_ELastError = EEpochError_Ok;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Frees everything still retired. No thread may be inside a critical section
+//////////////////////////////////////////////////////////////////////////
+void CEpochReclaimer::Shutdown()
+{
+	if (!m_pHeap)
+	{
+		m_ELastError = EEpochState_Init_NotInitialised;
+		return;
+	}
+
+	for (SThreadRecord& sRecord : m_sThreads)
+	{
+		for (SRetireBucket& sBucket : sRecord.m_sBuckets)
+		{
+			FreeBucket(sBucket);
+		}
+		sRecord.m_bInUse.store(false);
+		sRecord.m_bActive.store(false);
+	}
+	FreeBatches(m_pOrphanBatches);
+	m_pOrphanBatches = nullptr;
+	m_bHasOrphans.store(false);
+
+	CPageMap::FreePages(m_pBatchPool);
+	m_pBatchPool = nullptr;
+	m_pFreeBatches = nullptr;
+	m_uNumFreeBatches = 0;
+
+	m_pHeap = nullptr;
+	m_ELastError = EEpochError_Ok;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Claims a slot for the calling thread, returns k_uInvalidThread if there are none left
+//////////////////////////////////////////////////////////////////////////
+u32 CEpochReclaimer::RegisterThread()
+{
+	if (!m_pHeap)
+	{
+		m_ELastError = EEpochState_Init_NotInitialised;
+		return k_uInvalidThread;
+	}
+
+	for (u32 i = 0; i < k_uMaxThreads; i++)
+	{
+		bool bExpected = false;
+		if (m_sThreads[i].m_bInUse.compare_exchange_strong(bExpected, true, std::memory_order_acquire))
+		{
+			m_sThreads[i].m_uRetiresSinceAdvance = 0;
+			return i;
+		}
+	}
+
+	m_ELastError = EEpochState_Register_NoFreeSlots;
+	return k_uInvalidThread;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Releases the slot. Anything the thread retired which no reader can still hold is freed, and the rest
+// is handed on to be freed by the next Leave of any thread
+//////////////////////////////////////////////////////////////////////////
+void CEpochReclaimer::UnregisterThread(u32 uThread)
+{
+	if (!IsValidThread(uThread))
+	{
+		return;
+	}
+
+	SThreadRecord& sRecord = m_sThreads[uThread];
+	sRecord.m_bActive.store(false, std::memory_order_release);
+	ReclaimBuckets(sRecord, m_uGlobalEpoch.load(std::memory_order_seq_cst));
+
+	//Whatever is left is too recent to free, tag each batch with its epoch and hand it on
+	for (SRetireBucket& sBucket : sRecord.m_sBuckets)
+	{
+		SRetireBatch* pBatch = sBucket.m_pBatches;
+		if (!pBatch)
+		{
+			continue;
+		}
+
+		SRetireBatch* pLast = nullptr;
+		for (; pBatch; pBatch = pBatch->m_pNext)
+		{
+			pBatch->m_uEpoch = sBucket.m_uEpoch;
+			pLast = pBatch;
+		}
+
+		std::lock_guard<std::mutex> lock(m_BatchLock);
+		pLast->m_pNext = m_pOrphanBatches;
+		m_pOrphanBatches = sBucket.m_pBatches;
+		m_bHasOrphans.store(true, std::memory_order_relaxed);
+		sBucket.m_pBatches = nullptr;
+	}
+
+	sRecord.m_bInUse.store(false, std::memory_order_release);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Marks the start of a read side critical section. Critical sections do not nest
+// The fence makes our epoch visible before any shared pointer is read.
+// Never touches the heap, so it is safe wherever a reader runs, even with the heap locked
+//////////////////////////////////////////////////////////////////////////
+void CEpochReclaimer::Enter(u32 uThread)
+{
+	if (!IsValidThread(uThread))
+	{
+		return;
+	}
+
+	SThreadRecord& sRecord = m_sThreads[uThread];
+
+	sRecord.m_uLocalEpoch.store(m_uGlobalEpoch.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	sRecord.m_bActive.store(true, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Marks the end of a read side critical section
+// Then frees any of our buckets the epoch has moved two past, and any such orphans, which Deallocates into the heap
+//////////////////////////////////////////////////////////////////////////
+void CEpochReclaimer::Leave(u32 uThread)
+{
+	if (!IsValidThread(uThread))
+	{
+		return;
+	}
+
+	SThreadRecord& sRecord = m_sThreads[uThread];
+	sRecord.m_bActive.store(false, std::memory_order_release);
+
+	u32 uEpoch = m_uGlobalEpoch.load(std::memory_order_relaxed);
+	ReclaimBuckets(sRecord, uEpoch);
+	if (m_bHasOrphans.load(std::memory_order_relaxed))
+	{
+		ReclaimOrphans(uEpoch);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Hands a pointer allocated from the heap over to be deallocated once no reader can hold it
+// Must be called after the pointer has been unlinked from the shared structure
+// Never touches the heap, so it may be called with the heap locked
+//////////////////////////////////////////////////////////////////////////
+bool CEpochReclaimer::Retire(u32 uThread, void* pMemory)
+{
+	if (!pMemory || !IsValidThread(uThread))
+	{
+		return false;
+	}
+
+	SThreadRecord& sRecord = m_sThreads[uThread];
+
+	if (++sRecord.m_uRetiresSinceAdvance >= k_uAdvanceThreshold)
+	{
+		sRecord.m_uRetiresSinceAdvance = 0;
+		TryAdvanceEpoch();
+	}
+
+	//Tag with the global epoch read after the unlink. Any reader which could still see the pointer
+	//entered at or before this epoch, so the epoch can't move two past it until they have all left
+	u32 uEpoch = m_uGlobalEpoch.load(std::memory_order_seq_cst);
+
+	//The bucket is empty, holds this epoch, or holds one at least three behind which Leave hasn't freed yet
+	//Moving those up to this epoch only keeps them longer, which is always safe
+	SRetireBucket& sBucket = sRecord.m_sBuckets[uEpoch % 3];
+	sBucket.m_uEpoch = uEpoch;
+
+	SRetireBatch* pBatch = sBucket.m_pBatches;
+	if (!pBatch || pBatch->m_uCount == k_uRetireBatchSize) //Need a new batch
+	{
+		pBatch = TakeBatch();
+		if (!pBatch)
+		{
+			return false;
+		}
+		pBatch->m_pNext = sBucket.m_pBatches;
+		pBatch->m_uCount = 0;
+		sBucket.m_pBatches = pBatch;
+	}
+
+	pBatch->m_pPointers[pBatch->m_uCount++] = pMemory;
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Advances the global epoch if every active thread has observed the current one
+//////////////////////////////////////////////////////////////////////////
+void CEpochReclaimer::TryAdvanceEpoch()
+{
+	u32 uEpoch = m_uGlobalEpoch.load(std::memory_order_seq_cst);
+
+	for (SThreadRecord& sRecord : m_sThreads)
+	{
+		if (sRecord.m_bInUse.load(std::memory_order_seq_cst) &&
+			sRecord.m_bActive.load(std::memory_order_seq_cst) &&
+			sRecord.m_uLocalEpoch.load(std::memory_order_seq_cst) != uEpoch)
+		{
+			return; //Someone is still reading in an older epoch
+		}
+	}
+
+	m_uGlobalEpoch.compare_exchange_strong(uEpoch, uEpoch + 1, std::memory_order_seq_cst);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Deallocates the contents of any bucket retired two or more epochs before uEpoch
+//////////////////////////////////////////////////////////////////////////
+void CEpochReclaimer::ReclaimBuckets(SThreadRecord& sRecord, u32 uEpoch)
+{
+	for (SRetireBucket& sBucket : sRecord.m_sBuckets)
+	{
+		if (sBucket.m_pBatches && uEpoch - sBucket.m_uEpoch >= 2) //Unsigned subtraction copes with the epoch wrapping
+		{
+			FreeBucket(sBucket);
+		}
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Deallocates every pointer in a bucket, and returns the batches holding them to the pool
+//////////////////////////////////////////////////////////////////////////
+void CEpochReclaimer::FreeBucket(SRetireBucket& sBucket)
+{
+	FreeBatches(sBucket.m_pBatches);
+	sBucket.m_pBatches = nullptr;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Deallocates the pointers in a list of batches, and returns the batches to the pool
+//////////////////////////////////////////////////////////////////////////
+void CEpochReclaimer::FreeBatches(SRetireBatch* pBatches)
+{
+	if (!pBatches)
+	{
+		return;
+	}
+
+	u32 uNumBatches = 0;
+	SRetireBatch* pLast = nullptr;
+	for (SRetireBatch* pBatch = pBatches; pBatch; pBatch = pBatch->m_pNext)
+	{
+		for (u32 i = 0; i < pBatch->m_uCount; i++)
+		{
+			m_pHeap->Deallocate(pBatch->m_pPointers[i]);
+		}
+		uNumBatches++;
+		pLast = pBatch;
+	}
+
+	std::lock_guard<std::mutex> lock(m_BatchLock);
+	pLast->m_pNext = m_pFreeBatches;
+	m_pFreeBatches = pBatches;
+	m_uNumFreeBatches += uNumBatches;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Deallocates the orphaned batches retired two or more epochs before uEpoch
+// They are unlinked under the lock, but their pointers are deallocated after it is released
+//////////////////////////////////////////////////////////////////////////
+void CEpochReclaimer::ReclaimOrphans(u32 uEpoch)
+{
+	SRetireBatch* pReclaim = nullptr;
+	{
+		std::lock_guard<std::mutex> lock(m_BatchLock);
+		SRetireBatch** ppLink = &m_pOrphanBatches;
+		while (SRetireBatch* pBatch = *ppLink)
+		{
+			if (uEpoch - pBatch->m_uEpoch >= 2) //Unsigned subtraction copes with the epoch wrapping
+			{
+				*ppLink = pBatch->m_pNext;
+				pBatch->m_pNext = pReclaim;
+				pReclaim = pBatch;
+			}
+			else
+			{
+				ppLink = &pBatch->m_pNext;
+			}
+		}
+		m_bHasOrphans.store(m_pOrphanBatches != nullptr, std::memory_order_relaxed);
+	}
+
+	FreeBatches(pReclaim);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Takes a batch from the pool, nullptr if it is empty
+//////////////////////////////////////////////////////////////////////////
+CEpochReclaimer::SRetireBatch* CEpochReclaimer::TakeBatch()
+{
+	std::lock_guard<std::mutex> lock(m_BatchLock);
+	SRetireBatch* pBatch = m_pFreeBatches;
+	if (pBatch)
+	{
+		m_pFreeBatches = pBatch->m_pNext;
+		m_uNumFreeBatches--;
+	}
+	return pBatch;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Returns true if uThread is a slot index, asserting if it is not
+// Catches callers which failed to register, or use a slot after releasing it
+//////////////////////////////////////////////////////////////////////////
+bool CEpochReclaimer::IsValidThread(u32 uThread)
+{
+	if (uThread >= k_uMaxThreads || !m_sThreads[uThread].m_bInUse.load(std::memory_order_relaxed))
+	{
+		_ASSERT(false);
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,161 @@
+#ifndef _EPOCHRECLAIMER_H_
+#define _EPOCHRECLAIMER_H_
+
+#include "CManagedHeap.h"
+
+//////////////////////////////////////////////////////////////////////////
+// Epoch based deferred reclamation for lock free structures built on a CManagedHeap
+// Readers bracket their accesses with Enter and Leave. Retired pointers are held
+// per thread, and only passed to Deallocate once every active reader has moved
+// on by two epochs, so no reader can still be holding them.
+// The batches recording retired pointers come from a pool reserved in Initialise,
+// never from the heap, so retiring works with the heap locked or full.
+//////////////////////////////////////////////////////////////////////////
+class CEpochReclaimer
+{
+public:
+	CEpochReclaimer();
+	~CEpochReclaimer();
+
+	//////////////////////////////////////////////////////////////////////////
+	// enum of possible error return values from CEpochReclaimer::GetLastError()
+	//////////////////////////////////////////////////////////////////////////
+	enum EEpochState
+	{
+		EEpochError_Ok = 0,						// no error
+
+		EEpochState_Init_NotInitialised,		// Tried to use the reclaimer before it was initialised
+		EEpochState_Init_AlreadyInitialised,	// Attempted to Initialise after already being initialised successfully
+		EEpochState_Init_NullHeap,				// Initialise was passed a nullptr heap
+		EEpochState_Init_UnableToAquireMemory,	// The pool of retire batches could not be reserved
+
+		EEpochState_Register_NoFreeSlots,		// All k_uMaxThreads slots are already registered
+	};
+
+	// Maximum number of threads which can be registered at once
+	static const u32 k_uMaxThreads = 64;
+
+	// Returned by RegisterThread when no slot could be claimed
+	static const u32 k_uInvalidThread = 0xFFFFFFFF;
+
+	// Number of retired pointers stored in each batch
+	static const u32 k_uRetireBatchSize = 62;
+
+	// Number of retires a thread makes before it tries to advance the global epoch
+	static const u32 k_uAdvanceThreshold = 64;
+
+	// Default size of the pool of retire batches, each holding k_uRetireBatchSize pointers
+	static const u32 k_uDefaultNumRetireBatches = 1024;
+
+	// Sets up the reclaimer to free retired pointers back to the given heap
+	// Reserves uNumRetireBatches batches from the OS, which caps how many pointers can wait to be freed at once
+	void	Initialise(CManagedHeap* pHeap, u32 uNumRetireBatches = k_uDefaultNumRetireBatches);
+
+	// Frees everything still retired. No thread may be inside a critical section
+	void	Shutdown();
+
+	// Claims a slot for the calling thread, returns k_uInvalidThread if there are none left
+	// Safe to call from multiple threads at once
+	u32		RegisterThread();
+
+	// Releases the slot. Anything the thread retired which no reader can still hold is freed, and the rest
+	// is handed on to be freed by the next Leave of any thread. Must not be called with the heap locked
+	void	UnregisterThread(u32 uThread);
+
+	// Marks the start of a read side critical section
+	// Never touches the heap, so it may be called with the heap locked
+	void	Enter(u32 uThread);
+
+	// Marks the end of a read side critical section, then frees any of the thread's retired pointers,
+	// and those of unregistered threads, which no reader can still hold. Must not be called with the heap locked
+	void	Leave(u32 uThread);
+
+	// Hands a pointer allocated from the heap over to be deallocated once no reader can hold it
+	// Never touches the heap, so it may be called with the heap locked
+	// Returns false if the pointer could not be recorded because the pool of batches is empty,
+	// the caller keeps ownership in that case
+	bool	Retire(u32 uThread, void* pMemory);
+
+	// Number of retire batches left in the pool
+	inline u32 GetNumFreeRetireBatches() { return m_uNumFreeBatches; };
+
+	// Returns the outcome of the last Initialise, Shutdown or RegisterThread
+	inline EEpochState GetLastError() { return m_ELastError; };
+
+	// Returns the current global epoch
+	inline u32 GetEpoch() { return m_uGlobalEpoch.load(std::memory_order_relaxed); };
+
+private:
+
+	// A batch of retired pointers, taken from the pool
+	struct SRetireBatch
+	{
+		SRetireBatch* m_pNext;
+		u32 m_uCount;
+		u32 m_uEpoch;		// Epoch of the bucket it came from, once handed on by UnregisterThread
+		void* m_pPointers[k_uRetireBatchSize];
+	};
+
+	// Pointers retired during one epoch
+	struct SRetireBucket
+	{
+		SRetireBatch* m_pBatches;
+		u32 m_uEpoch;
+	};
+
+	// Per thread state, kept on its own cache line so readers do not share lines
+	struct alignas(64) SThreadRecord
+	{
+		std::atomic<bool> m_bInUse;
+		std::atomic<bool> m_bActive;
+		std::atomic<u32> m_uLocalEpoch;
+
+		// Only touched by the thread owning the slot
+		SRetireBucket m_sBuckets[3];
+		u32 m_uRetiresSinceAdvance;
+	};
+
+	CManagedHeap* m_pHeap;
+	std::atomic<u32> m_uGlobalEpoch;
+	SThreadRecord m_sThreads[k_uMaxThreads];
+
+	// Pool of batches, reserved from the OS in Initialise
+	SRetireBatch* m_pBatchPool;
+	SRetireBatch* m_pFreeBatches;
+	u32 m_uNumFreeBatches;
+
+	// Batches handed on by threads which unregistered, freed by whichever thread next leaves once they are old enough
+	SRetireBatch* m_pOrphanBatches;
+	std::atomic<bool> m_bHasOrphans;
+
+	std::mutex m_BatchLock; //Guards the free batches and the orphans
+
+	EEpochState m_ELastError;
+
+	/////////////////////////////////////////////////
+	//  PRIVATE FUNCTIONS                         //
+	/////////////////////////////////////////////////
+
+	// Advances the global epoch if every active thread has observed the current one
+	void TryAdvanceEpoch();
+
+	// Deallocates the contents of any bucket retired two or more epochs before uEpoch
+	void ReclaimBuckets(SThreadRecord& sRecord, u32 uEpoch);
+
+	// Deallocates every pointer in a bucket, and returns the batches holding them to the pool
+	void FreeBucket(SRetireBucket& sBucket);
+
+	// Deallocates the pointers in a list of batches, and returns the batches to the pool
+	void FreeBatches(SRetireBatch* pBatches);
+
+	// Deallocates the orphaned batches retired two or more epochs before uEpoch
+	void ReclaimOrphans(u32 uEpoch);
+
+	// Takes a batch from the pool, nullptr if it is empty
+	SRetireBatch* TakeBatch();
+
+	// Returns true if uThread is a slot index, asserting if it is not
+	bool IsValidThread(u32 uThread);
+};
+
+#endif // #ifndef _EPOCHRECLAIMER_H_
@@ -0,0 +1,400 @@
+#include "pch.h"
+#include "CHeapProfiler.h"
+#include "CPageMap.h"
+
+#pragma comment(lib, "psapi.lib") //EnumProcessModules and friends, for the module list
+
+
+//////////////////////////////////////////////////////////////////////////
+//
+//////////////////////////////////////////////////////////////////////////
+CHeapProfiler::CHeapProfiler() :
+	m_uSampleInterval(k_uDefaultSampleInterval),
+	m_iBytesUntilSample(k_uDefaultSampleInterval),
+	m_uRandomState(0x9E3779B97F4A7C15ull),
+	m_pTables(nullptr),
+	m_pStacks(nullptr),
+	m_uNumStacks(0),
+	m_puStackLookup(nullptr),
+	m_pLiveSamples(nullptr),
+	m_uNumLiveSamples(0),
+	m_uNumDroppedSamples(0)
+{
+}
+
+
+//////////////////////////////////////////////////////////////////////////
+//
+//////////////////////////////////////////////////////////////////////////
+CHeapProfiler::~CHeapProfiler()
+{
+	Shutdown();
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Sets up the profiler with the average number of bytes between samples
+// Every table is reserved here, so sampling never allocates while the heap is locked
+// The tables come from the OS rather than malloc, as the heap may be the one behind malloc
+//////////////////////////////////////////////////////////////////////////
+bool CHeapProfiler::Initialise(u32 uSampleIntervalBytes)
+{
+	std::lock_guard<std::mutex> lock(m_ProfileLock);
+
+	if (!m_pTables)
+	{
+		size_t uStacksSize = sizeof(SStackRecord) * k_uMaxStacks;
+		size_t uLookupSize = sizeof(u32) * k_uStackLookupSize;
+		size_t uLiveSize = sizeof(SLiveSample) * k_uLiveSampleTableSize;
+
+		u8* pTables = (u8*)CPageMap::AllocatePages(uStacksSize + uLookupSize + uLiveSize);
+		if (!pTables)
+		{
+			return false;
+		}
+
+		//Pages arrive zeroed, which is an empty lookup and an empty live sample table
+		m_pTables = pTables;
+		m_pStacks = (SStackRecord*)pTables;
+		m_puStackLookup = (u32*)(pTables + uStacksSize);
+		m_pLiveSamples = (SLiveSample*)(pTables + uStacksSize + uLookupSize);
+	}
+
+	m_uSampleInterval = uSampleIntervalBytes ? uSampleIntervalBytes : 1;
+
+	//Seed from the clock, so separate runs don't sample the same allocations
+	m_uRandomState ^= (unsigned long long)std::chrono::steady_clock::now().time_since_epoch().count();
+	if (m_uRandomState == 0)
+	{
+		m_uRandomState = 1;
+	}
+	m_iBytesUntilSample = PickNextSampleInterval();
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Drops every sample and stack, and returns the tables to the OS
+//////////////////////////////////////////////////////////////////////////
+void CHeapProfiler::Shutdown()
+{
+	std::lock_guard<std::mutex> lock(m_ProfileLock);
+	if (m_pTables)
+	{
+		CPageMap::FreePages(m_pTables);
+	}
+	m_pTables = nullptr;
+	m_pStacks = nullptr;
+	m_puStackLookup = nullptr;
+	m_pLiveSamples = nullptr;
+	m_uNumStacks = 0;
+	m_uNumLiveSamples = 0;
+	m_uNumDroppedSamples = 0;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Captures the call stack for a sampled allocation
+// Returns false if the sample was dropped because a table is full
+//////////////////////////////////////////////////////////////////////////
+bool CHeapProfiler::RecordSample(void* pMemory, u32 uNumBytes)
+{
+	void* pFrames[k_uMaxFrames];
+	ULONG uHash = 0;
+	u32 uNumFrames = CaptureStackBackTrace(2, k_uMaxFrames, pFrames, &uHash); //Skip ourself and the heap's AllocateBlock
+
+	std::lock_guard<std::mutex> lock(m_ProfileLock);
+
+	if (!m_pTables || m_uNumLiveSamples == k_uMaxLiveSamples)
+	{
+		m_uNumDroppedSamples++;
+		return false;
+	}
+
+	u32 uStack = FindOrAddStack(pFrames, uNumFrames, (u32)uHash);
+	if (uStack == k_uMaxStacks)
+	{
+		m_uNumDroppedSamples++;
+		return false;
+	}
+
+	SStackRecord& sStack = m_pStacks[uStack];
+	sStack.m_uLiveCount++;
+	sStack.m_uLiveBytes += uNumBytes;
+	sStack.m_uTotalCount++;
+	sStack.m_uTotalBytes += uNumBytes;
+
+	//The block is newly allocated, so it can't already be in the table
+	u32 uSlot = HashAddress(pMemory);
+	while (m_pLiveSamples[uSlot].m_pMemory)
+	{
+		uSlot = (uSlot + 1) & (k_uLiveSampleTableSize - 1);
+	}
+
+	SLiveSample& sSample = m_pLiveSamples[uSlot];
+	sSample.m_pMemory = pMemory;
+	sSample.m_uStack = uStack;
+	sSample.m_uNumBytes = uNumBytes;
+	m_uNumLiveSamples++;
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Drops the sample for a block being released
+// The samples after it in its probe run are shifted back, so lookups never need tombstones
+//////////////////////////////////////////////////////////////////////////
+void CHeapProfiler::RemoveSample(void* pMemory)
+{
+	std::lock_guard<std::mutex> lock(m_ProfileLock);
+	if (!m_pTables)
+	{
+		return;
+	}
+
+	const u32 uMask = k_uLiveSampleTableSize - 1;
+
+	u32 uSlot = HashAddress(pMemory);
+	while (m_pLiveSamples[uSlot].m_pMemory != pMemory)
+	{
+		if (!m_pLiveSamples[uSlot].m_pMemory)
+		{
+			return;
+		}
+		uSlot = (uSlot + 1) & uMask;
+	}
+
+	SStackRecord& sStack = m_pStacks[m_pLiveSamples[uSlot].m_uStack];
+	sStack.m_uLiveCount--;
+	sStack.m_uLiveBytes -= m_pLiveSamples[uSlot].m_uNumBytes;
+	m_uNumLiveSamples--;
+
+	u32 uHole = uSlot;
+	for (u32 uNext = (uHole + 1) & uMask; m_pLiveSamples[uNext].m_pMemory; uNext = (uNext + 1) & uMask)
+	{
+		//A sample can only fill the hole if the hole lies between its home slot and where it sits now
+		u32 uHome = HashAddress(m_pLiveSamples[uNext].m_pMemory);
+		bool bHomeAfterHole = uHole <= uNext ? (uHome > uHole && uHome <= uNext) : (uHome > uHole || uHome <= uNext);
+		if (!bHomeAfterHole)
+		{
+			m_pLiveSamples[uHole] = m_pLiveSamples[uNext];
+			uHole = uNext;
+		}
+	}
+	m_pLiveSamples[uHole].m_pMemory = nullptr;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Writes the live and cumulative samples as a legacy heap profile readable by pprof
+// The heap_v2 tag gives pprof the sampling interval, so it can scale the samples back up
+// The loaded modules are listed at the end, so pprof can resolve the addresses against them.
+// Nothing here allocates: holding the profile lock while allocating through a shimmed malloc
+// would wait on the heap lock, which RecordSample holds while waiting on the profile lock
+//////////////////////////////////////////////////////////////////////////
+bool CHeapProfiler::WriteProfile(const char* szFilename)
+{
+	SProfileWriter sWriter;
+	sWriter.m_hFile = CreateFileA(szFilename, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (sWriter.m_hFile == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+	sWriter.m_uUsed = 0;
+	sWriter.m_bFailed = false;
+
+	{
+		std::lock_guard<std::mutex> lock(m_ProfileLock);
+
+		unsigned long long uLiveCount = 0;
+		unsigned long long uLiveBytes = 0;
+		unsigned long long uTotalCount = 0;
+		unsigned long long uTotalBytes = 0;
+		for (u32 i = 0; i < m_uNumStacks; i++)
+		{
+			uLiveCount += m_pStacks[i].m_uLiveCount;
+			uLiveBytes += m_pStacks[i].m_uLiveBytes;
+			uTotalCount += m_pStacks[i].m_uTotalCount;
+			uTotalBytes += m_pStacks[i].m_uTotalBytes;
+		}
+
+		sWriter.Print("heap profile: %llu: %llu [%llu: %llu] @ heap_v2/%u\n", uLiveCount, uLiveBytes, uTotalCount, uTotalBytes, m_uSampleInterval);
+
+		for (u32 i = 0; i < m_uNumStacks; i++)
+		{
+			const SStackRecord& sStack = m_pStacks[i];
+			sWriter.Print("%llu: %llu [%llu: %llu] @", sStack.m_uLiveCount, sStack.m_uLiveBytes, sStack.m_uTotalCount, sStack.m_uTotalBytes);
+			for (u32 j = 0; j < sStack.m_uNumFrames; j++)
+			{
+				sWriter.Print(" 0x%llx", (unsigned long long)(uintptr_t)sStack.m_pFrames[j]);
+			}
+			sWriter.Print("\n");
+		}
+	}
+
+	sWriter.Print("\nMAPPED_LIBRARIES:\n");
+	WriteMappedLibraries(sWriter);
+
+	bool bWritten = sWriter.Flush();
+	return CloseHandle(sWriter.m_hFile) && bWritten;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Number of sampled blocks currently allocated
+//////////////////////////////////////////////////////////////////////////
+u32 CHeapProfiler::GetNumLiveSamples()
+{
+	std::lock_guard<std::mutex> lock(m_ProfileLock);
+	return m_uNumLiveSamples;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Number of samples dropped because a table was full
+//////////////////////////////////////////////////////////////////////////
+u32 CHeapProfiler::GetNumDroppedSamples()
+{
+	std::lock_guard<std::mutex> lock(m_ProfileLock);
+	return m_uNumDroppedSamples;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Picks the number of bytes until the next sample, exponentially distributed around the interval
+// This makes every byte equally likely to be sampled, whatever the size of the allocation holding it
+//////////////////////////////////////////////////////////////////////////
+long long CHeapProfiler::PickNextSampleInterval()
+{
+	//xorshift64*, cheap and good enough for picking samples
+	m_uRandomState ^= m_uRandomState >> 12;
+	m_uRandomState ^= m_uRandomState << 25;
+	m_uRandomState ^= m_uRandomState >> 27;
+	unsigned long long uRandom = m_uRandomState * 0x2545F4914F6CDD1Dull;
+
+	double dUniform = ((uRandom >> 11) + 1) * (1.0 / 9007199254740993.0); //In (0, 1]
+	return (long long)(-std::log(dUniform) * m_uSampleInterval) + 1;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Finds or adds the record for a captured stack, returning its index, k_uMaxStacks if the table is full
+//////////////////////////////////////////////////////////////////////////
+u32 CHeapProfiler::FindOrAddStack(void** pFrames, u32 uNumFrames, u32 uHash)
+{
+	u32 uSlot = uHash & (k_uStackLookupSize - 1);
+	for (; m_puStackLookup[uSlot]; uSlot = (uSlot + 1) & (k_uStackLookupSize - 1))
+	{
+		u32 uIndex = m_puStackLookup[uSlot] - 1;
+		SStackRecord& sStack = m_pStacks[uIndex];
+		if (sStack.m_uHash == uHash && sStack.m_uNumFrames == uNumFrames && memcmp(sStack.m_pFrames, pFrames, uNumFrames * sizeof(void*)) == 0)
+		{
+			return uIndex;
+		}
+	}
+
+	if (m_uNumStacks == k_uMaxStacks)
+	{
+		return k_uMaxStacks;
+	}
+
+	u32 uIndex = m_uNumStacks++;
+	SStackRecord& sStack = m_pStacks[uIndex];
+	memcpy(sStack.m_pFrames, pFrames, uNumFrames * sizeof(void*));
+	sStack.m_uNumFrames = uNumFrames;
+	sStack.m_uHash = uHash;
+	sStack.m_uLiveCount = 0;
+	sStack.m_uLiveBytes = 0;
+	sStack.m_uTotalCount = 0;
+	sStack.m_uTotalBytes = 0;
+
+	m_puStackLookup[uSlot] = uIndex + 1;
+	return uIndex;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Returns the slot a block address hashes to in the live sample table
+//////////////////////////////////////////////////////////////////////////
+u32 CHeapProfiler::HashAddress(void* pMemory)
+{
+	//Fibonacci hashing, the low bits of block addresses are mostly alignment
+	unsigned long long uHash = (unsigned long long)(uintptr_t)pMemory * 0x9E3779B97F4A7C15ull;
+	return (u32)(uHash >> 32) & (k_uLiveSampleTableSize - 1);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Writes the address range and path of every module loaded in the process
+// Lines follow /proc/self/maps, which is the layout pprof expects in this section
+//////////////////////////////////////////////////////////////////////////
+void CHeapProfiler::WriteMappedLibraries(SProfileWriter& sWriter)
+{
+	const u32 k_uMaxModules = 1024;
+
+	HMODULE hModules[k_uMaxModules];
+	DWORD uBytesNeeded = 0;
+	HANDLE hProcess = GetCurrentProcess();
+	if (!EnumProcessModules(hProcess, hModules, sizeof(hModules), &uBytesNeeded))
+	{
+		return;
+	}
+
+	u32 uNumModules = uBytesNeeded / sizeof(HMODULE);
+	if (uNumModules > k_uMaxModules)
+	{
+		uNumModules = k_uMaxModules;
+	}
+
+	for (u32 i = 0; i < uNumModules; i++)
+	{
+		MODULEINFO sInfo;
+		char szPath[MAX_PATH];
+		if (!GetModuleInformation(hProcess, hModules[i], &sInfo, sizeof(sInfo)) ||
+			!GetModuleFileNameA(hModules[i], szPath, MAX_PATH))
+		{
+			continue;
+		}
+
+		uintptr_t uStart = (uintptr_t)sInfo.lpBaseOfDll;
+		sWriter.Print("%llx-%llx r-xp 00000000 00:00 0 %s\n",
+			(unsigned long long)uStart, (unsigned long long)(uStart + sInfo.SizeOfImage), szPath);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Appends formatted text to the buffer, writing the buffer out first if the text won't fit
+//////////////////////////////////////////////////////////////////////////
+void CHeapProfiler::SProfileWriter::Print(const char* szFormat, ...)
+{
+	for (u32 uAttempt = 0; uAttempt < 2; uAttempt++)
+	{
+		u32 uSpace = sizeof(m_szBuffer) - m_uUsed;
+
+		va_list args;
+		va_start(args, szFormat);
+		int iLength = vsnprintf(m_szBuffer + m_uUsed, uSpace, szFormat, args);
+		va_end(args);
+
+		if (iLength < 0)
+		{
+			m_bFailed = true;
+			return;
+		}
+		if ((u32)iLength < uSpace)
+		{
+			m_uUsed += iLength;
+			return;
+		}
+		if (!Flush())
+		{
+			return;
+		}
+	}
+
+	//Longer than the whole buffer, which no line of the profile should be
+	m_bFailed = true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Writes out the buffered text, returns false if this or any earlier write failed
+//////////////////////////////////////////////////////////////////////////
+bool CHeapProfiler::SProfileWriter::Flush()
+{
+	if (m_uUsed && !m_bFailed)
+	{
+		DWORD uWritten = 0;
+		m_bFailed = !WriteFile(m_hFile, m_szBuffer, m_uUsed, &uWritten, nullptr) || uWritten != m_uUsed;
+	}
+	m_uUsed = 0;
+	return !m_bFailed;
+}
@@ -0,0 +1,141 @@
+#ifndef _HEAPPROFILER_H_
+#define _HEAPPROFILER_H_
+
+#include "CManagedHeap.h"
+
+//////////////////////////////////////////////////////////////////////////
+// Sampling profiler for a CManagedHeap
+// Allocations are picked at random by bytes, on average once every sample interval,
+// and the call stack of each sample is kept until the block is released.
+// The heap only pays for a subtraction on allocations which are not sampled.
+//////////////////////////////////////////////////////////////////////////
+class CHeapProfiler
+{
+public:
+	CHeapProfiler();
+	~CHeapProfiler();
+
+	// Default average number of bytes between samples
+	static const u32 k_uDefaultSampleInterval = 512 * 1024;
+
+	// Maximum number of frames captured for each sample
+	static const u32 k_uMaxFrames = 32;
+
+	// Maximum number of distinct call stacks kept, samples from any further stacks are dropped
+	static const u32 k_uMaxStacks = 4096;
+
+	// Maximum number of sampled blocks alive at once, further samples are dropped
+	static const u32 k_uMaxLiveSamples = 16384;
+
+	// Sets up the profiler with the average number of bytes between samples
+	// Every table is reserved here, so sampling never allocates while the heap is locked
+	// Returns false if the tables could not be reserved
+	bool	Initialise(u32 uSampleIntervalBytes = k_uDefaultSampleInterval);
+
+	// Drops every sample and stack, and returns the tables to the OS
+	void	Shutdown();
+
+	// Called by the heap for every allocation, with the heap locked
+	// Returns true if this allocation should be sampled
+	// A profiler should only be attached to one heap, as this relies on that heap's lock
+	inline bool ShouldSample(u32 uNumBytes)
+	{
+		m_iBytesUntilSample -= uNumBytes;
+		if (m_iBytesUntilSample > 0)
+		{
+			return false;
+		}
+		m_iBytesUntilSample = PickNextSampleInterval();
+		return true;
+	}
+
+	// Captures the call stack for a sampled allocation
+	// Returns false if the sample was dropped because a table is full
+	bool	RecordSample(void* pMemory, u32 uNumBytes);
+
+	// Drops the sample for a block being released
+	void	RemoveSample(void* pMemory);
+
+	// Writes the live and cumulative samples as a legacy heap profile readable by pprof
+	// Returns false if the file could not be written
+	bool	WriteProfile(const char* szFilename);
+
+	// Number of sampled blocks currently allocated
+	u32		GetNumLiveSamples();
+
+	// Number of samples dropped because a table was full
+	u32		GetNumDroppedSamples();
+
+private:
+
+	// A unique call stack and the samples taken from it
+	struct SStackRecord
+	{
+		void* m_pFrames[k_uMaxFrames];
+		u32 m_uNumFrames;
+		u32 m_uHash;
+
+		unsigned long long m_uLiveCount;
+		unsigned long long m_uLiveBytes;
+		unsigned long long m_uTotalCount;
+		unsigned long long m_uTotalBytes;
+	};
+
+	// A block which is currently sampled, nullptr memory marks an empty slot
+	struct SLiveSample
+	{
+		void* m_pMemory;
+		u32 m_uStack;
+		u32 m_uNumBytes;
+	};
+
+	// Slots in the open addressed tables, kept at most half full so probes stay short
+	static const u32 k_uStackLookupSize = k_uMaxStacks * 2;
+	static const u32 k_uLiveSampleTableSize = k_uMaxLiveSamples * 2;
+
+	// Formats the profile into a buffer on the stack and writes it out as it fills
+	struct SProfileWriter
+	{
+		HANDLE m_hFile;
+		u32 m_uUsed;
+		bool m_bFailed;
+		char m_szBuffer[4096];
+
+		void Print(const char* szFormat, ...);
+		bool Flush();
+	};
+
+	u32 m_uSampleInterval;
+	long long m_iBytesUntilSample;
+	unsigned long long m_uRandomState;
+
+	std::mutex m_ProfileLock; //Guards the tables, the heaps lock already guards the sampling counter
+
+	void* m_pTables; //One reservation from CPageMap holding every table below
+
+	SStackRecord* m_pStacks;
+	u32 m_uNumStacks;
+	u32* m_puStackLookup; //Open addressed by stack hash, holds index in m_pStacks + 1, 0 if empty
+
+	SLiveSample* m_pLiveSamples; //Open addressed by block address
+	u32 m_uNumLiveSamples;
+	u32 m_uNumDroppedSamples;
+
+	/////////////////////////////////////////////////
+	//  PRIVATE FUNCTIONS                         //
+	/////////////////////////////////////////////////
+
+	// Picks the number of bytes until the next sample, exponentially distributed around the interval
+	long long PickNextSampleInterval();
+
+	// Finds or adds the record for a captured stack, returning its index, k_uMaxStacks if the table is full
+	u32 FindOrAddStack(void** pFrames, u32 uNumFrames, u32 uHash);
+
+	// Returns the slot a block address hashes to in the live sample table
+	static u32 HashAddress(void* pMemory);
+
+	// Writes the address range and path of every module loaded in the process
+	void WriteMappedLibraries(SProfileWriter& sWriter);
+};
+
+#endif // #ifndef _HEAPPROFILER_H_
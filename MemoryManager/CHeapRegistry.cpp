@@ -0,0 +1,330 @@
+#include "pch.h"
+#include "CHeapRegistry.h"
+#include "CPageMap.h"
+
+//////////////////////////////////////////////////////////////////////////
+// Heaps are started on a page, so each page maps to a single heap in CPageMap
+//////////////////////////////////////////////////////////////////////////
+static const u32 k_uHeapStartAlign = CPageMap::k_uPageSize;
+
+
+//////////////////////////////////////////////////////////////////////////
+//
+//////////////////////////////////////////////////////////////////////////
+CHeapRegistry::CHeapRegistry() :
+	m_bSelfAllocatedMemory(false),
+	m_pMemory(nullptr),
+	m_uMemorySize(0),
+	m_uMemoryUsed(0),
+	m_uNumHeaps(0),
+	m_ELastError(ERegistryError_Ok)
+{
+}
+
+
+//////////////////////////////////////////////////////////////////////////
+//
+//////////////////////////////////////////////////////////////////////////
+CHeapRegistry::~CHeapRegistry()
+{
+	if (m_pMemory != nullptr)
+	{
+		//DID NOT CALL SHUTDOWN FIRST
+		_ASSERT(false);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Sets up the registry by requesting the backing region itself from the OS
+//////////////////////////////////////////////////////////////////////////
+void CHeapRegistry::Initialise(u32 uMemorySizeInBytes)
+{
+	if (m_pMemory)
+	{
+		m_ELastError = ERegistryState_Init_AlreadyInitialised;
+		return;
+	}
+
+	u8* pRawMemory = (u8*)malloc(uMemorySizeInBytes);
+	if (!pRawMemory)
+	{
+		m_ELastError = ERegistryState_Init_UnableToAquireMemory;
+		return;
+	}
+
+	Initialise(pRawMemory, uMemorySizeInBytes);
+	if (m_ELastError == ERegistryError_Ok)
+	{
+		m_bSelfAllocatedMemory = true;
+	}
+	else
+	{
+		free(pRawMemory);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Sets up the registry using memory already allocated to this program
+//////////////////////////////////////////////////////////////////////////
+void CHeapRegistry::Initialise(u8* pRawMemory, u32 uMemorySizeInBytes)
+{
+	if (m_pMemory)
+	{
+		m_ELastError = ERegistryState_Init_AlreadyInitialised;
+		return;
+	}
+
+	if (!pRawMemory)
+	{
+		m_ELastError = ERegistryState_Init_UnableToAquireMemory;
+		return;
+	}
+
+	m_pMemory = pRawMemory;
+	m_uMemorySize = uMemorySizeInBytes;
+	m_uMemoryUsed = 0;
+	m_uNumHeaps = 0;
+	m_bSelfAllocatedMemory = false;
+	m_ELastError = ERegistryError_Ok;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Shuts down every heap, and releases the backing region if it was claimed by this class
+//////////////////////////////////////////////////////////////////////////
+void CHeapRegistry::Shutdown()
+{
+	for (u32 i = 0; i < m_uNumHeaps; i++)
+	{
+		m_sHeaps[i].m_Heap.Shutdown();
+	}
+	m_uNumHeaps = 0;
+
+	if (m_bSelfAllocatedMemory)
+	{
+		free(m_pMemory);
+	}
+
+	m_pMemory = nullptr;
+	m_bSelfAllocatedMemory = false;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Carves a heap from the backing region. Budgets of 0 mean no budget
+// The hard budget is enforced by the heap itself, under its own lock
+//////////////////////////////////////////////////////////////////////////
+u32 CHeapRegistry::CreateHeap(const char* szName, u32 uSizeInBytes, u32 uSoftBudget, u32 uHardBudget)
+{
+	if (!m_pMemory)
+	{
+		m_ELastError = ERegistryState_Init_NotInitialised;
+		return k_uInvalidTag;
+	}
+
+	if (m_uNumHeaps == k_uMaxHeaps)
+	{
+		m_ELastError = ERegistryState_Create_TooManyHeaps;
+		return k_uInvalidTag;
+	}
+
+	if (uHardBudget > uSizeInBytes || (uHardBudget && uSoftBudget > uHardBudget))
+	{
+		m_ELastError = ERegistryState_Create_BadBudget;
+		return k_uInvalidTag;
+	}
+
+	//Start on a page, and keep the size a multiple of the minimum alignment
+	uintptr_t uStartAddress = ((uintptr_t)(m_pMemory + m_uMemoryUsed) + k_uHeapStartAlign - 1) & ~(uintptr_t)(k_uHeapStartAlign - 1);
+	u32 uStart = (u32)(uStartAddress - (uintptr_t)m_pMemory);
+	uSizeInBytes &= ~(u32)(_PLATFORM_MIN_ALIGN - 1);
+
+	if (uStart > m_uMemorySize || uSizeInBytes > m_uMemorySize - uStart)
+	{
+		m_ELastError = ERegistryState_Create_OutOfMemory;
+		return k_uInvalidTag;
+	}
+
+	SSubHeap& sHeap = m_sHeaps[m_uNumHeaps];
+	sHeap.m_Heap.Initialise(m_pMemory + uStart, uSizeInBytes);
+	if (sHeap.m_Heap.GetLastError() != CManagedHeap::EHeapError_Ok)
+	{
+		m_ELastError = ERegistryState_Create_HeapFailed;
+		return k_uInvalidTag;
+	}
+	sHeap.m_Heap.SetByteLimit(uHardBudget);
+
+	strncpy_s(sHeap.m_szName, szName ? szName : "", _TRUNCATE);
+	sHeap.m_uHeapSize = uSizeInBytes;
+	sHeap.m_uSoftBudget = uSoftBudget;
+	sHeap.m_uHardBudget = uHardBudget;
+	sHeap.m_EFailurePolicy = EFailurePolicy_ReturnNull;
+	sHeap.m_pfnFailureHandler = nullptr;
+	sHeap.m_pFailureUserData = nullptr;
+	sHeap.m_uPeakBytes.store(0);
+	sHeap.m_uNumFailures.store(0);
+	sHeap.m_uNumSoftOverruns.store(0);
+
+	m_uMemoryUsed = uStart + uSizeInBytes;
+	m_ELastError = ERegistryError_Ok;
+	return m_uNumHeaps++;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Sets what a heap does when one of its allocations fails
+//////////////////////////////////////////////////////////////////////////
+void CHeapRegistry::SetFailurePolicy(u32 uTag, EFailurePolicy eFailurePolicy, FailureHandler pfnHandler, void* pUserData)
+{
+	if (uTag >= m_uNumHeaps)
+	{
+		m_ELastError = ERegistryState_BadTag;
+		return;
+	}
+
+	SSubHeap& sHeap = m_sHeaps[uTag];
+	sHeap.m_EFailurePolicy = (eFailurePolicy == EFailurePolicy_CallHandler && !pfnHandler) ? EFailurePolicy_ReturnNull : eFailurePolicy;
+	sHeap.m_pfnFailureHandler = pfnHandler;
+	sHeap.m_pFailureUserData = pUserData;
+	m_ELastError = ERegistryError_Ok;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Returns the tag of the heap with the given name, k_uInvalidTag if there is none
+//////////////////////////////////////////////////////////////////////////
+u32 CHeapRegistry::FindHeap(const char* szName)
+{
+	for (u32 i = 0; i < m_uNumHeaps; i++)
+	{
+		if (strncmp(m_sHeaps[i].m_szName, szName, k_uMaxNameLength) == 0)
+		{
+			return i;
+		}
+	}
+	return k_uInvalidTag;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Allocates from the heap for the tag
+//////////////////////////////////////////////////////////////////////////
+void* CHeapRegistry::Allocate(u32 uTag, u32 uNumBytes, u32 uAlignment)
+{
+	if (uTag >= m_uNumHeaps)
+	{
+		m_ELastError = ERegistryState_BadTag;
+		return nullptr;
+	}
+
+	SSubHeap& sHeap = m_sHeaps[uTag];
+	void* pMemory = sHeap.m_Heap.Allocate(uNumBytes, uAlignment);
+
+	while (!pMemory)
+	{
+		sHeap.m_uNumFailures.fetch_add(1, std::memory_order_relaxed);
+
+		if (sHeap.m_EFailurePolicy == EFailurePolicy_Assert)
+		{
+			//HEAP WAS SIZED TO NEVER FAIL
+			_ASSERT(false);
+			return nullptr;
+		}
+		if (sHeap.m_EFailurePolicy != EFailurePolicy_CallHandler ||
+			!sHeap.m_pfnFailureHandler(uTag, sHeap.m_Heap.GetLastError(), uNumBytes, sHeap.m_pFailureUserData))
+		{
+			return nullptr;
+		}
+
+		pMemory = sHeap.m_Heap.Allocate(uNumBytes, uAlignment);
+	}
+
+	RecordAllocation(sHeap);
+	return pMemory;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Deallocates memory allocated from the heap for the tag
+//////////////////////////////////////////////////////////////////////////
+void CHeapRegistry::Deallocate(u32 uTag, void* pMemory)
+{
+	if (uTag >= m_uNumHeaps)
+	{
+		m_ELastError = ERegistryState_BadTag;
+		return;
+	}
+
+	m_sHeaps[uTag].m_Heap.Deallocate(pMemory);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Returns the tag of the heap an allocation came from, k_uInvalidTag if it is not from this registry
+// The page map gives the heap, and its offset into m_sHeaps gives the tag
+//////////////////////////////////////////////////////////////////////////
+u32 CHeapRegistry::FindTag(void* pMemory)
+{
+	CManagedHeap* pHeap = CPageMap::FindHeap(pMemory);
+	uintptr_t uOffset = (uintptr_t)pHeap - (uintptr_t)m_sHeaps;
+	u32 uTag = (u32)(uOffset / sizeof(SSubHeap));
+	if (!pHeap || uOffset >= m_uNumHeaps * sizeof(SSubHeap) || &m_sHeaps[uTag].m_Heap != pHeap)
+	{
+		return k_uInvalidTag;
+	}
+	return uTag;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Fills in the usage counters for a heap, returns false for a bad tag
+// The heap's own counters are read under its lock, as other threads may be allocating from it
+//////////////////////////////////////////////////////////////////////////
+bool CHeapRegistry::GetStats(u32 uTag, SHeapStats& sStats)
+{
+	if (uTag >= m_uNumHeaps)
+	{
+		m_ELastError = ERegistryState_BadTag;
+		return false;
+	}
+
+	SSubHeap& sHeap = m_sHeaps[uTag];
+	sStats.m_szName = sHeap.m_szName;
+	sStats.m_uHeapSize = sHeap.m_uHeapSize;
+	sStats.m_uSoftBudget = sHeap.m_uSoftBudget;
+	sStats.m_uHardBudget = sHeap.m_uHardBudget;
+	sStats.m_uPeakBytes = sHeap.m_uPeakBytes.load(std::memory_order_relaxed);
+	sStats.m_uNumFailures = sHeap.m_uNumFailures.load(std::memory_order_relaxed);
+	sStats.m_uNumSoftOverruns = sHeap.m_uNumSoftOverruns.load(std::memory_order_relaxed);
+
+	sHeap.m_Heap.Lock();
+	sStats.m_uAllocatedBytes = sHeap.m_Heap.GetAllocatedBytes();
+	sStats.m_uNumAllocs = sHeap.m_Heap.GetNumAllocs();
+	sHeap.m_Heap.Unlock();
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Returns the outcome of the last operation on the heap for the tag
+//////////////////////////////////////////////////////////////////////////
+CManagedHeap::EHeapState CHeapRegistry::GetLastError(u32 uTag)
+{
+	if (uTag >= m_uNumHeaps)
+	{
+		return CManagedHeap::EHeapState_Init_NotInitialised;
+	}
+	return m_sHeaps[uTag].m_Heap.GetLastError();
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Updates the peak and soft budget counters after a successful allocation
+// The byte count is read under the heap's lock, the counters here are atomic so need no lock of their own
+//////////////////////////////////////////////////////////////////////////
+void CHeapRegistry::RecordAllocation(SSubHeap& sHeap)
+{
+	sHeap.m_Heap.Lock();
+	u32 uAllocated = sHeap.m_Heap.GetAllocatedBytes();
+	sHeap.m_Heap.Unlock();
+
+	u32 uPeak = sHeap.m_uPeakBytes.load(std::memory_order_relaxed);
+	while (uAllocated > uPeak && !sHeap.m_uPeakBytes.compare_exchange_weak(uPeak, uAllocated, std::memory_order_relaxed))
+	{
+	}
+
+	if (sHeap.m_uSoftBudget && uAllocated > sHeap.m_uSoftBudget)
+	{
+		sHeap.m_uNumSoftOverruns.fetch_add(1, std::memory_order_relaxed);
+	}
+}
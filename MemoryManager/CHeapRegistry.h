@@ -0,0 +1,157 @@
+#ifndef _HEAPREGISTRY_H_
+#define _HEAPREGISTRY_H_
+
+#include "CManagedHeap.h"
+
+//////////////////////////////////////////////////////////////////////////
+// Registry of named heaps carved from one backing region
+// Each subsystem gets its own CManagedHeap, so one can't exhaust another, with a hard
+// and soft byte budget and a policy for what happens when its allocations fail.
+// Allocations are routed by tag, which is just the index of the heap.
+//////////////////////////////////////////////////////////////////////////
+class CHeapRegistry
+{
+public:
+	CHeapRegistry();
+	~CHeapRegistry();
+
+	//////////////////////////////////////////////////////////////////////////
+	// enum of possible error return values from CHeapRegistry::GetLastError()
+	// Errors from the heaps themselves are returned by GetLastError(uTag)
+	//////////////////////////////////////////////////////////////////////////
+	enum ERegistryState
+	{
+		ERegistryError_Ok = 0,					// no error
+
+		ERegistryState_Init_NotInitialised,		// Tried to use the registry before it was initialised
+		ERegistryState_Init_UnableToAquireMemory,// Could not aquire the backing region
+		ERegistryState_Init_AlreadyInitialised,	// Attempted to Initialise after already being initialised successfully
+
+		ERegistryState_Create_TooManyHeaps,		// All k_uMaxHeaps heaps have been created
+		ERegistryState_Create_OutOfMemory,		// Not enough of the backing region left for a heap of this size
+		ERegistryState_Create_BadBudget,		// Soft budget above the hard budget, or hard budget above the heap size
+		ERegistryState_Create_HeapFailed,		// The heap itself failed to initialise
+
+		ERegistryState_BadTag,					// Tag does not refer to a created heap
+	};
+
+	//////////////////////////////////////////////////////////////////////////
+	// What a heap does when one of its allocations fails
+	//////////////////////////////////////////////////////////////////////////
+	enum EFailurePolicy
+	{
+		EFailurePolicy_ReturnNull = 0,			// Return nullptr, the reason is in GetLastError(uTag)
+		EFailurePolicy_Assert,					// Assert, for heaps which are sized to never fail
+		EFailurePolicy_CallHandler,				// Call the handler, retrying for as long as it returns true
+	};
+
+	// Called when an allocation fails on a heap with EFailurePolicy_CallHandler
+	// Return true once memory has been freed to retry the allocation, false to return nullptr
+	typedef bool (*FailureHandler)(u32 uTag, CManagedHeap::EHeapState eError, u32 uNumBytes, void* pUserData);
+
+	//////////////////////////////////////////////////////////////////////////
+	// Usage counters for one heap
+	//////////////////////////////////////////////////////////////////////////
+	struct SHeapStats
+	{
+		const char* m_szName;
+		u32 m_uHeapSize;
+		u32 m_uSoftBudget;
+		u32 m_uHardBudget;
+		u32 m_uAllocatedBytes;		// Bytes currently allocated
+		u32 m_uPeakBytes;			// Highest value m_uAllocatedBytes has reached
+		u32 m_uNumAllocs;			// Allocations currently live
+		u32 m_uNumFailures;			// Allocations which returned nullptr
+		u32 m_uNumSoftOverruns;		// Allocations which left the heap over its soft budget
+	};
+
+	// Maximum number of heaps in one registry
+	static const u32 k_uMaxHeaps = 32;
+
+	// Returned by CreateHeap on failure
+	static const u32 k_uInvalidTag = 0xFFFFFFFF;
+
+	// Maximum length of a heap name, including the terminator
+	static const u32 k_uMaxNameLength = 32;
+
+	// Sets up the registry by requesting the backing region itself from the OS
+	void	Initialise(u32 uMemorySizeInBytes);
+
+	// Sets up the registry using memory already allocated to this program
+	void	Initialise(u8* pRawMemory, u32 uMemorySizeInBytes);
+
+	// Shuts down every heap, and releases the backing region if it was claimed by this class
+	void	Shutdown();
+
+	// Carves a heap from the backing region. Budgets of 0 mean no budget
+	// Returns the tag to allocate with, k_uInvalidTag on failure
+	u32		CreateHeap(const char* szName, u32 uSizeInBytes, u32 uSoftBudget = 0, u32 uHardBudget = 0);
+
+	// Sets what a heap does when one of its allocations fails
+	void	SetFailurePolicy(u32 uTag, EFailurePolicy eFailurePolicy, FailureHandler pfnHandler = nullptr, void* pUserData = nullptr);
+
+	// Returns the tag of the heap with the given name, k_uInvalidTag if there is none
+	u32		FindHeap(const char* szName);
+
+	// Allocates from the heap for the tag
+	void*	Allocate(u32 uTag, u32 uNumBytes, u32 uAlignment = _PLATFORM_MIN_ALIGN);
+
+	// Deallocates memory allocated from the heap for the tag
+	void	Deallocate(u32 uTag, void* pMemory);
+
+	// Returns the tag of the heap an allocation came from, k_uInvalidTag if it is not from this registry
+	u32		FindTag(void* pMemory);
+
+	// Returns the heap for the tag, nullptr if there is none
+	inline CManagedHeap*	GetHeap(u32 uTag) { return uTag < m_uNumHeaps ? &m_sHeaps[uTag].m_Heap : nullptr; };
+
+	// Fills in the usage counters for a heap, returns false for a bad tag
+	bool	GetStats(u32 uTag, SHeapStats& sStats);
+
+	// Returns the number of heaps created
+	inline u32		GetNumHeaps() { return m_uNumHeaps; };
+
+	// Returns the outcome of the last operation on the heap for the tag
+	CManagedHeap::EHeapState GetLastError(u32 uTag);
+
+	// Returns the outcome of the last registry operation
+	inline ERegistryState GetLastError() { return m_ELastError; };
+
+private:
+
+	struct SSubHeap
+	{
+		CManagedHeap m_Heap;
+		char m_szName[k_uMaxNameLength];
+		u32 m_uHeapSize;
+		u32 m_uSoftBudget;
+		u32 m_uHardBudget;
+
+		EFailurePolicy m_EFailurePolicy;
+		FailureHandler m_pfnFailureHandler;
+		void* m_pFailureUserData;
+
+		std::atomic<u32> m_uPeakBytes;
+		std::atomic<u32> m_uNumFailures;
+		std::atomic<u32> m_uNumSoftOverruns;
+	};
+
+	bool m_bSelfAllocatedMemory; //True if memory was allocated internally
+	u8* m_pMemory;
+	u32 m_uMemorySize;
+	u32 m_uMemoryUsed; //Bytes of the backing region already carved into heaps
+
+	SSubHeap m_sHeaps[k_uMaxHeaps];
+	u32 m_uNumHeaps;
+
+	ERegistryState m_ELastError;
+
+	/////////////////////////////////////////////////
+	//  PRIVATE FUNCTIONS                         //
+	/////////////////////////////////////////////////
+
+	// Updates the peak and soft budget counters after a successful allocation
+	void RecordAllocation(SSubHeap& sHeap);
+};
+
+#endif // #ifndef _HEAPREGISTRY_H_
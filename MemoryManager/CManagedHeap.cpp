@@ -1,14 +1,52 @@
 #include "pch.h"
 #include "CManagedHeap.h"
+#include "CHeapProfiler.h"
+#include "CPageMap.h"
 
 
+const u32 CManagedHeap::k_uMaxAllocationSize = 0xFFFFFFFF - (sizeof(SBlockHeader) + sizeof(SFooterBlock));
+
 //////////////////////////////////////////////////////////////////////////
 // 
 //////////////////////////////////////////////////////////////////////////
 CManagedHeap::CManagedHeap() :
+	m_bSelfAllocatedMemory(false),
 	m_pMemory(nullptr),
+	m_uMemorySize(0),
+	m_uFreeSpace(0),
+	m_uActualFreeSpace(0),
+	m_uNumAllocations(0),
+	m_uByteLimit(0),
 	m_ELastHeapError(EHeapError_Ok),
-	m_bSelfAllocatedMemory(false)
+	m_pPendingReleaseHead(nullptr),
+	m_pPendingReleaseTail(nullptr),
+	m_uNumPendingReleases(0),
+	m_bMaintenanceRunning(false),
+	m_bMaintenanceStarting(false),
+	m_bStopMaintenance(false),
+	m_pRemoteFreeHead(nullptr),
+	m_OwnerThread(std::thread::id()),
+	m_pPurgeableHead(nullptr),
+	m_pPurgeableTail(nullptr),
+	m_uNumPurgeable(0),
+	m_uNumPurged(0),
+	m_uPurgeableBytes(0),
+	m_pProfiler(nullptr),
+	m_puBlockStarts(nullptr),
+	m_uNumPages(0),
+	m_uPermanentFloor(0),
+	m_puFreeSegments(nullptr),
+	m_puFreeSegmentOrder(nullptr),
+	m_puFreeSegmentCounts(nullptr),
+	m_uNumUsedSegments(0),
+	m_uNumTableSegments(0),
+	m_uNumFreeEntries(0),
+	m_uVerifyCursor(0),
+	m_uVerifyNumBlocks(0),
+	m_uVerifyNumAllocations(0),
+	m_uVerifyAllocatedBytes(0),
+	m_uNumVerifyPasses(0),
+	m_uVerifyErrorOffset(0)
 {
 }
 
@@ -51,6 +89,9 @@ void CManagedHeap::Initialise(u32 uMemorySizeInBytes)
 
 //////////////////////////////////////////////////////////////////////////
 // Sets up the heap using memory already allocated to this program
+// The block start table can't be made optional, as hint validation, the permanent floor, allocating from the top
+// and VerifyStep all find block headers through it. Its cost is about 0.1% of the heap, but never less than one
+// OS page and a 64KB reservation, so many tiny heaps are better served by one larger heap
 //////////////////////////////////////////////////////////////////////////
 void CManagedHeap::Initialise(u8* pRawMemory, u32 uMemorySizeInBytes)
 {
@@ -74,6 +115,30 @@ void CManagedHeap::Initialise(u8* pRawMemory, u32 uMemorySizeInBytes)
 		return;
 	}
 
+	//Table of the first block in each page, so an address can be traced back to its block, followed by the bitmap of pages in it with blocks
+	m_uNumPages = (u32)(((unsigned long long)uMemorySizeInBytes + CPageMap::k_uPageSize - 1) >> CPageMap::k_uPageShift);
+	u32 uNumBitWords[k_uNumBlockStartBitLevels];
+	u32 uTableSize = m_uNumPages;
+	for (u32 uLevel = 0, uNumBits = m_uNumPages; uLevel < k_uNumBlockStartBitLevels; uLevel++)
+	{
+		uNumBitWords[uLevel] = (uNumBits + 31) >> 5;
+		uNumBits = uNumBitWords[uLevel];
+		uTableSize += uNumBitWords[uLevel];
+	}
+
+	m_puBlockStarts = (u32*)CPageMap::AllocatePages(uTableSize * sizeof(u32));
+	if (!m_puBlockStarts)
+	{
+		m_ELastHeapError = EHeapState_Init_UnableToAquireMemory;
+		return;
+	}
+
+	m_puBlockStartBits[0] = m_puBlockStarts + m_uNumPages;
+	for (u32 uLevel = 1; uLevel < k_uNumBlockStartBitLevels; uLevel++)
+	{
+		m_puBlockStartBits[uLevel] = m_puBlockStartBits[uLevel - 1] + uNumBitWords[uLevel - 1];
+	}
+
 	//At this stage we have statisfied all the condidtions for setting up the heap
 	m_pMemory = pRawMemory;
 	m_uMemorySize = uMemorySizeInBytes;
@@ -83,7 +148,18 @@ void CManagedHeap::Initialise(u8* pRawMemory, u32 uMemorySizeInBytes)
 
 	m_uNumAllocations = 0;
 
+	ResetVerifyPass();
+	m_uNumVerifyPasses = 0;
+	memset(m_uAlignedFreeHints, 0, sizeof(m_uAlignedFreeHints));
+	m_uPermanentFloor = uMemorySizeInBytes;
+
 	m_pBlock = EncapsulateMemoryBlock(m_pMemory, m_uMemorySize);
+	TidyPayload(m_pBlock); //Merges only tidy what they take in, so free payloads must start out tidy
+	AddBlockStart(m_pBlock);
+	AddFreeBlock(m_pBlock);
+
+	//Not fatal if this fails, the heap just can't be found from its addresses by CPageMap::FindHeap
+	CPageMap::Register(this, m_pMemory, m_uMemorySize);
 
 	m_ELastHeapError = EHeapError_Ok;
 
@@ -94,13 +170,29 @@ void CManagedHeap::Initialise(u8* pRawMemory, u32 uMemorySizeInBytes)
 //////////////////////////////////////////////////////////////////////////
 void CManagedHeap::Shutdown()
 {
+	StopMaintenanceThread();
+	ClearOwnerThread();
+
+	if (m_pMemory)
+	{
+		CPageMap::Unregister(this, m_pMemory, m_uMemorySize);
+		CPageMap::FreePages(m_puBlockStarts);
+		m_puBlockStarts = nullptr;
+		ResizeFreeBlockTable(0);
+	}
+
 	//Only free the memory if we aquired it ourself
 	if (m_bSelfAllocatedMemory)
 	{
 		free(m_pMemory);
+		m_bSelfAllocatedMemory = false;
 	}
 
 	m_pMemory = nullptr;
+	m_uMemorySize = 0;
+	m_uFreeSpace = 0;
+	m_uActualFreeSpace = 0;
+	m_uNumAllocations = 0;
 }
 
 
@@ -111,6 +203,121 @@ void CManagedHeap::Shutdown()
 // and returns a pointer to it.
 //////////////////////////////////////////////////////////////////////////
 void* CManagedHeap::Allocate(u32 uNumBytes, u32 uAlignment)
+{
+	std::lock_guard<std::mutex> lock(m_HeapLock);
+
+	SBlockHeader* pBlock = AllocateBlock(uNumBytes, uAlignment, ELifetime_Transient);
+	if (!pBlock)
+	{
+		return nullptr;
+	}
+
+	u8 *returnptr = (u8*)pBlock;
+	returnptr += sizeof(SBlockHeader);
+	return returnptr;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Allocates with a lifetime hint. Allocate without a hint is the same as ELifetime_Transient
+//////////////////////////////////////////////////////////////////////////
+void* CManagedHeap::Allocate(u32 uNumBytes, ELifetime eLifetime, u32 uAlignment)
+{
+	std::lock_guard<std::mutex> lock(m_HeapLock);
+
+	if ((u32)eLifetime >= ELifetime_Count)
+	{
+		m_ELastHeapError = EHeapState_Alloc_BadLifetime;
+		return nullptr;
+	}
+
+	SBlockHeader* pBlock = AllocateBlock(uNumBytes, uAlignment, eLifetime);
+	if (!pBlock)
+	{
+		return nullptr;
+	}
+
+	return (u8*)pBlock + sizeof(SBlockHeader);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Allocates memory the heap may take back when an allocation would otherwise fail
+// The purge info is stored after the user's bytes, so Deallocate finds the header as normal
+//////////////////////////////////////////////////////////////////////////
+void* CManagedHeap::AllocatePurgeable(u32 uNumBytes, u32 uPriority, PurgeCallback pfnCallback, void* pUserData, u32 uAlignment)
+{
+	std::lock_guard<std::mutex> lock(m_HeapLock);
+
+	if (!pfnCallback)
+	{
+		m_ELastHeapError = EHeapState_Alloc_NoPurgeCallback;
+		return nullptr;
+	}
+	if (uNumBytes == 0)
+	{
+		m_ELastHeapError = EHeapState_Alloc_ZeroSizeAlloc;
+		return nullptr;
+	}
+	if ((unsigned long long)uNumBytes + sizeof(SPurgeableInfo) + uAlignment > k_uMaxAllocationSize)
+	{
+		m_ELastHeapError = EHeapState_Alloc_TooLarge;
+		return nullptr;
+	}
+
+	//Round up so the info sits aligned directly after the user's bytes
+	const u32 uInfoAlign = alignof(SPurgeableInfo);
+	if (uAlignment < uInfoAlign)
+	{
+		uAlignment = uInfoAlign;
+	}
+	uNumBytes = (uNumBytes + uInfoAlign - 1) & ~(uInfoAlign - 1);
+
+	SBlockHeader* pBlock = AllocateBlock(uNumBytes + sizeof(SPurgeableInfo), uAlignment, ELifetime_Transient);
+	if (!pBlock)
+	{
+		return nullptr;
+	}
+
+	SPurgeableInfo* pInfo = GetPurgeableInfo(pBlock);
+	pInfo->m_pfnPurge = pfnCallback;
+	pInfo->m_pUserData = pUserData;
+	pInfo->m_uPriority = uPriority;
+	LinkPurgeable(pBlock);
+
+	u8 *returnptr = (u8*)pBlock;
+	returnptr += sizeof(SBlockHeader);
+	return returnptr;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Marks a purgeable allocation as recently used, so it is purged later
+//////////////////////////////////////////////////////////////////////////
+void CManagedHeap::TouchPurgeable(void* pMemory)
+{
+	std::lock_guard<std::mutex> lock(m_HeapLock);
+	if (!pMemory || !Owns(pMemory))
+	{
+		return;
+	}
+
+	//Only a live purgeable block has LRU links to follow
+	SBlockHeader* pHeader = (SBlockHeader*)((u8*)pMemory - sizeof(SBlockHeader));
+	if (!IsBlockStart(pHeader) || pHeader->m_bIsFreeBlock || pHeader->m_bIsPendingRelease)
+	{
+		return;
+	}
+
+	if (pHeader->m_bIsPurgeable && pHeader != m_pPurgeableHead)
+	{
+		UnlinkPurgeable(pHeader);
+		LinkPurgeable(pHeader);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Finds, positions and marks a block for the allocation, purging if required. Lock must already be held
+// Returns the header of the allocated block, nullptr on failure
+//////////////////////////////////////////////////////////////////////////
+CManagedHeap::SBlockHeader* CManagedHeap::AllocateBlock(u32 uNumBytes, u32 uAlignment, ELifetime eLifetime)
 {
 	m_ELastHeapError = EHeapError_Ok;
 
@@ -120,6 +327,12 @@ void* CManagedHeap::Allocate(u32 uNumBytes, u32 uAlignment)
 		m_ELastHeapError = EHeapState_Init_NotInitialised;
 		return nullptr;
 	}
+
+	//Take back anything other threads have freed since the last allocation
+	if (m_pRemoteFreeHead.load(std::memory_order_relaxed))
+	{
+		DrainRemoteFrees();
+	}
 	if (!IsPowerOfTwo(uAlignment) || uAlignment < _PLATFORM_MIN_ALIGN) //Bad alignment values
 	{
 		m_ELastHeapError = EHeapState_Alloc_BadAlign;
@@ -132,36 +345,113 @@ void* CManagedHeap::Allocate(u32 uNumBytes, u32 uAlignment)
 		return nullptr;
 	}
 
-	//Always allocate memory in multiples of 4 bytes (helps keep blocks regular sized and reduces allignment padding)
-	if (uNumBytes % 4 != 0)
+	//Rounding and alignment padding could otherwise wrap the size round to a small block
+	if ((unsigned long long)uNumBytes + uAlignment > k_uMaxAllocationSize)
 	{
-		uNumBytes += 4 - (uNumBytes % 4);
+		m_ELastHeapError = EHeapState_Alloc_TooLarge;
+		return nullptr;
+	}
+
+	uNumBytes = RoundAllocationSize(uNumBytes);
+
+	//Purgeable blocks count towards the limit, so evict them before giving up on it
+	if (m_uByteLimit && (uNumBytes > m_uByteLimit || GetAllocatedBytes() > m_uByteLimit - uNumBytes))
+	{
+		if (uNumBytes > m_uByteLimit || GetAllocatedBytes() - m_uPurgeableBytes > m_uByteLimit - uNumBytes)
+		{
+			m_ELastHeapError = EHeapState_Alloc_OverByteLimit;
+			return nullptr;
+		}
+
+		while (GetAllocatedBytes() > m_uByteLimit - uNumBytes)
+		{
+			//Blocks other threads free meanwhile can't be purged, but may be enough once released
+			if (m_pRemoteFreeHead.load(std::memory_order_relaxed))
+			{
+				DrainRemoteFrees();
+			}
+			else if (!PurgeBlock(ChoosePurgeVictim(uNumBytes, uAlignment)))
+			{
+				m_ELastHeapError = EHeapState_Alloc_OverByteLimit;
+				return nullptr;
+			}
+		}
 	}
 
+	SBlockHeader* pBlockToAllocateTo = FindFreeBlock(uNumBytes, uAlignment, eLifetime);
 
-	SBlockHeader* pBlockToAllocateTo = FindFreeBlock(uNumBytes, uAlignment);
+	//Blocks waiting on the maintenance thread may free up enough space. Only so many are released here,
+	//so one allocation can't take on the whole queue while every other caller waits on the lock
+	for (u32 uReleased = 0; !pBlockToAllocateTo && m_pPendingReleaseHead && uReleased < k_uMaxInlineReleases; uReleased += k_uInlineReleaseBatch)
+	{
+		ReleasePending(k_uInlineReleaseBatch);
+		pBlockToAllocateTo = FindFreeBlock(uNumBytes, uAlignment, eLifetime);
+	}
+	//Evict purgeable blocks until a large enough hole opens up, unless even evicting them all would leave too little space
+	while (!pBlockToAllocateTo && m_pPurgeableHead && CouldPurgeFit(uNumBytes))
+	{
+		//Blocks other threads free meanwhile can't be purged, but may be enough once released
+		if (m_pRemoteFreeHead.load(std::memory_order_relaxed))
+		{
+			DrainRemoteFrees();
+		}
+		else if (!PurgeBlock(ChoosePurgeVictim(uNumBytes, uAlignment)))
+		{
+			break;
+		}
+		pBlockToAllocateTo = FindFreeBlock(uNumBytes, uAlignment, eLifetime);
+	}
 	if (!pBlockToAllocateTo) //Could not find a free block for this size
 	{
 		m_ELastHeapError = EHeapState_Alloc_NoLargeEnoughBlocks;
 		return nullptr;
 	}
 
-	AdjustBlockPositionForPadding(uAlignment, pBlockToAllocateTo);
+	RemoveFreeBlock(pBlockToAllocateTo);
+
+	bool bFromTop = eLifetime != ELifetime_Transient;
+	AdjustBlockPositionForPadding(uNumBytes, uAlignment, bFromTop, pBlockToAllocateTo);
 
 	ManageFreeSpacePostAllocation(pBlockToAllocateTo, uNumBytes);
 
+	//The space left after an over-aligned block is where the next one of the same alignment is most likely to pack
+	if (uAlignment >= k_uMinOverAlignment && !bFromTop)
+	{
+		SBlockHeader* pRemainder = pBlockToAllocateTo->m_pSMemBlockNext;
+		GetAlignedFreeHint(uAlignment) = (pRemainder && pRemainder->m_bIsFreeBlock) ? (u32)((u8*)pRemainder - m_pMemory) + 1 : 0;
+	}
+
 	pBlockToAllocateTo->m_bIsFreeBlock = false;
+	pBlockToAllocateTo->m_bIsPendingRelease = false;
+	pBlockToAllocateTo->m_bIsPurgeable = false;
+	pBlockToAllocateTo->m_bIsSampled = false;
+	pBlockToAllocateTo->m_bIsRemoteFreed.store(false, std::memory_order_relaxed);
+	pBlockToAllocateTo->m_uLifetime = eLifetime;
 	pBlockToAllocateTo->m_uBlockSize = uNumBytes;
 	m_uActualFreeSpace -= uNumBytes;
 	m_uFreeSpace -= uNumBytes;
 	WriteFooter(pBlockToAllocateTo);
 
-	u8 *returnptr = (u8*)pBlockToAllocateTo;
-	returnptr += sizeof(SBlockHeader);
+	if (m_pProfiler && m_pProfiler->ShouldSample(uNumBytes))
+	{
+		pBlockToAllocateTo->m_bIsSampled = m_pProfiler->RecordSample((u8*)pBlockToAllocateTo + sizeof(SBlockHeader), uNumBytes);
+	}
 
 	m_uNumAllocations++;
-	return returnptr;
 
+	u32 uOffset = (u32)((u8*)pBlockToAllocateTo - m_pMemory);
+	if (eLifetime == ELifetime_Permanent && uOffset < m_uPermanentFloor)
+	{
+		m_uPermanentFloor = uOffset;
+	}
+
+	//Blocks behind the verify cursor have already been counted by the current pass
+	if (uOffset < m_uVerifyCursor)
+	{
+		m_uVerifyNumAllocations++;
+		m_uVerifyAllocatedBytes += uNumBytes;
+	}
+	return pBlockToAllocateTo;
 }
 
 //////////////////////////////////////////////////////////////////////////
@@ -170,6 +460,15 @@ void* CManagedHeap::Allocate(u32 uNumBytes, u32 uAlignment)
 //////////////////////////////////////////////////////////////////////////
 void CManagedHeap::Deallocate(void* pMemory)
 {
+	//Deallocations from other threads are handed to the owner without touching the lock
+	std::thread::id owner = m_OwnerThread.load(std::memory_order_relaxed);
+	if (pMemory && Owns(pMemory) && owner != std::thread::id() && owner != std::this_thread::get_id() &&
+		PushRemoteFree((SBlockHeader*)((u8*)pMemory - sizeof(SBlockHeader))))
+	{
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(m_HeapLock);
 	m_ELastHeapError = EHeapError_Ok;
 	//Nullptr, return early
 	if (!pMemory)
@@ -179,55 +478,185 @@ void CManagedHeap::Deallocate(void* pMemory)
 
 	}
 
+	//Foreign pointer, reading a header in front of it would corrupt someone else's memory
+	if (!Owns(pMemory))
+	{
+		m_ELastHeapError = EHeapState_Dealloc_NotOwned;
+		return;
+	}
+
 	u8* pMemoryBlock = (u8*)pMemory;
 	pMemoryBlock -= sizeof(SBlockHeader); //Find the header for this block
 
 	SBlockHeader* pHeader = (SBlockHeader*)pMemoryBlock;
 
-	//Block was already free, return early
-	if (pHeader->m_bIsFreeBlock)
+	//Interior pointer, or one which was never allocated
+	if (!IsBlockStart(pHeader))
+	{
+		m_ELastHeapError = EHeapState_Dealloc_NotBlockStart;
+		return;
+	}
+
+	DeallocateBlock(pHeader);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Deallocates with the size that was requested from Allocate. The footer is found from the size
+// rather than the header, so the two loads don't wait on each other. The header is only
+// searched for in the block start table if they disagree
+//////////////////////////////////////////////////////////////////////////
+void CManagedHeap::Deallocate(void* pMemory, u32 uNumBytes)
+{
+	std::thread::id owner = m_OwnerThread.load(std::memory_order_relaxed);
+	if (pMemory && Owns(pMemory) && owner != std::thread::id() && owner != std::this_thread::get_id() &&
+		PushRemoteFree((SBlockHeader*)((u8*)pMemory - sizeof(SBlockHeader))))
+	{
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(m_HeapLock);
+	m_ELastHeapError = EHeapError_Ok;
+	if (!pMemory)
+	{
+		m_ELastHeapError = EHeapState_Dealloc_Nullptr;
+		return;
+	}
+	if (!Owns(pMemory))
+	{
+		m_ELastHeapError = EHeapState_Dealloc_NotOwned;
+		return;
+	}
+
+	//No allocation this large could have been made, and rounding it would wrap
+	if (uNumBytes > k_uMaxAllocationSize)
+	{
+		m_ELastHeapError = EHeapState_Dealloc_SizeMismatch;
+		return;
+	}
+
+	SBlockHeader* pHeader = (SBlockHeader*)((u8*)pMemory - sizeof(SBlockHeader));
+	u32 uBlockSize = RoundAllocationSize(uNumBytes);
+	u8* pFooter = (u8*)pMemory + uBlockSize;
+
+	bool bFooterMatches = uBlockSize >= uNumBytes && pFooter + sizeof(SFooterBlock) <= m_pMemory + m_uMemorySize &&
+		((SFooterBlock*)pFooter)->m_pMatchingHeader == pHeader && ((SFooterBlock*)pFooter)->m_uSizeOfBlock == uBlockSize;
+
+	if (!bFooterMatches)
+	{
+		if (!IsBlockStart(pHeader))
+		{
+			m_ELastHeapError = EHeapState_Dealloc_NotBlockStart;
+			return;
+		}
+
+		//Purgeable blocks carry their info after the user's bytes
+		if (pHeader->m_bIsPurgeable)
+		{
+			const u32 uInfoAlign = alignof(SPurgeableInfo);
+			uBlockSize = ((uNumBytes + uInfoAlign - 1) & ~(uInfoAlign - 1)) + sizeof(SPurgeableInfo);
+		}
+
+		//A matching size means the header is intact and the footer was overwritten, which DeallocateBlock reports
+		if (pHeader->m_uBlockSize != uBlockSize)
+		{
+			m_ELastHeapError = EHeapState_Dealloc_SizeMismatch;
+			return;
+		}
+	}
+
+	DeallocateBlock(pHeader);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Validates, then releases or queues a block being deallocated. Lock must already be held
+//////////////////////////////////////////////////////////////////////////
+void CManagedHeap::DeallocateBlock(SBlockHeader* pHeader)
+{
+	//Block was already free, or is already queued to be freed, return early
+	if (pHeader->m_bIsFreeBlock || pHeader->m_bIsPendingRelease || pHeader->m_bIsRemoteFreed.load(std::memory_order_relaxed))
 	{
 		m_ELastHeapError = EHeapState_Dealloc_AlreadyDeallocated;
 		return;
 	}
 
-	//Mark the block as free, then update counters
-	pHeader->m_bIsFreeBlock = true;
-	m_uNumAllocations--;
-	m_uFreeSpace += pHeader->m_uBlockSize;
-	m_uActualFreeSpace += pHeader->m_uBlockSize;
+	CheckBlockIntegrity(pHeader);
 
-	/////////////////////////////////////////////////////
-	// Check block integrity
-	//If we want to check for underrun, compare the values of our right padding field (the one most likely to get overritten)
-	//To the next blocks Left value. These should both be identical, and if not, it is likely our value has been corrupted
-	if (pHeader->m_RightPadding != pHeader->m_pSMemBlockNext->m_LeftPadding)
+	//The owner has finished with it, so it can no longer be purged
+	if (pHeader->m_bIsPurgeable)
 	{
-		m_ELastHeapError = EHeapState_Dealloc_OverwriteUnderrun;
+		UnlinkPurgeable(pHeader);
 	}
 
-	//If the pointer in the footer to the header does not match where the header should be, it is likely to have been overritten and therefore corrupted
-	if (GetFooter(pHeader)->m_pMatchingHeader != pHeader)
+	//Leave the merging and tidying to the maintenance thread if it is running
+	if (m_bMaintenanceRunning)
 	{
-		m_ELastHeapError = EHeapState_Dealloc_OverwriteOverrun;
+		PushPendingRelease(pHeader);
+		return;
 	}
-	/////////////////////////////////////////////////////
 
-	//Try to coalese with nearby freeblocks and padding
+	ReleaseBlock(pHeader, false);
+}
 
-	u8* pStartOfBlockToMerge = (u8*)pHeader;
-	u8* pEndOfBlockToMerge = (u8*)GetFooter(pHeader) + sizeof(SFooterBlock);
-	MergeWithNearbyBlocks(pStartOfBlockToMerge, pEndOfBlockToMerge);
 
+
+//////////////////////////////////////////////////////////////////////////
+// Returns the number of bytes usable in an allocation made by this heap
+// This may be larger than requested, as sizes are rounded up
+//////////////////////////////////////////////////////////////////////////
+u32 CManagedHeap::GetAllocationSize(void* pMemory)
+{
+	std::lock_guard<std::mutex> lock(m_HeapLock);
+	if (!pMemory || !Owns(pMemory))
+	{
+		return 0;
+	}
+
+	//Interior pointers and freed blocks have no size, rather than whatever their bytes would read as
+	SBlockHeader* pHeader = (SBlockHeader*)((u8*)pMemory - sizeof(SBlockHeader));
+	if (!IsBlockStart(pHeader) || pHeader->m_bIsFreeBlock || pHeader->m_bIsPendingRelease)
+	{
+		return 0;
+	}
+
+	if (pHeader->m_bIsPurgeable) //The purge info at the end is not the user's
+	{
+		return pHeader->m_uBlockSize - sizeof(SPurgeableInfo);
+	}
+	return pHeader->m_uBlockSize;
 }
 
+//////////////////////////////////////////////////////////////////////////
+// Returns the start of the allocation containing the address, nullptr if the address
+// is not inside an allocation's bytes. Works for interior pointers
+//////////////////////////////////////////////////////////////////////////
+void* CManagedHeap::FindBlockContaining(void* pAddress)
+{
+	std::lock_guard<std::mutex> lock(m_HeapLock);
+	if (!m_pMemory || !Owns(pAddress))
+	{
+		return nullptr;
+	}
+
+	SBlockHeader* pHeader = FindBlockHeader((u8*)pAddress);
+	if (!pHeader || pHeader->m_bIsFreeBlock || pHeader->m_bIsPendingRelease)
+	{
+		return nullptr;
+	}
 
+	u8* pPayload = (u8*)pHeader + sizeof(SBlockHeader);
+	if ((u8*)pAddress < pPayload || (u8*)pAddress >= pPayload + pHeader->m_uBlockSize)
+	{
+		return nullptr; //In the header, footer or padding
+	}
+	return pPayload;
+}
 
 //////////////////////////////////////////////////////////////////////////
 //Returns the freespace available, accounting for overheads
 //////////////////////////////////////////////////////////////////////////
 u32 CManagedHeap::GetFreeMemory()
 {
+	std::lock_guard<std::mutex> lock(m_HeapLock);
 	if (m_uNumAllocations != 0)
 	{
 		return m_uActualFreeSpace;
@@ -238,28 +667,414 @@ u32 CManagedHeap::GetFreeMemory()
 	}
 }
 
-
 //////////////////////////////////////////////////////////////////////////
-// Calcuates the offset to add to a pointer to align it to the alignment passed
-// Must be a power of two
+// Starts a thread to coalesce and tidy deallocated blocks in the background
+// While it is running, Deallocate only validates and queues the block
+// The thread binds itself before it does any work, so none of it runs on the wrong CPUs,
+// and this waits until it has, so a mask which can't be applied is reported here
 //////////////////////////////////////////////////////////////////////////
-u32 CManagedHeap::CalculateAlignmentDelta(void* pPointerToAlign, u32 uAlignment)
+void CManagedHeap::StartMaintenanceThread(const SMaintenanceSettings& sSettings)
 {
-	u32 uAlignAdd = uAlignment - 1;
-	u32 uAlignMask = ~uAlignAdd;
-	u32 uAddressToAlign = ((u32)pPointerToAlign);
-	u32 uAligned = uAddressToAlign + uAlignAdd;
-	uAligned &= uAlignMask;
-	return(uAligned - uAddressToAlign);
+	std::unique_lock<std::mutex> lock(m_HeapLock);
+	m_ELastHeapError = EHeapError_Ok;
+
+	if (!m_pMemory) //Heap had not been initialised
+	{
+		m_ELastHeapError = EHeapState_Init_NotInitialised;
+		return;
+	}
+	if (m_bMaintenanceRunning)
+	{
+		m_ELastHeapError = EHeapState_Maint_AlreadyRunning;
+		return;
+	}
+	if (sSettings.m_uPeriodMicroseconds == 0 || sSettings.m_uBudgetMicroseconds > sSettings.m_uPeriodMicroseconds)
+	{
+		m_ELastHeapError = EHeapState_Maint_BadSettings;
+		return;
+	}
+
+	m_sMaintenanceSettings = sSettings;
+	m_bStopMaintenance = false;
+	m_bMaintenanceRunning = true;
+	m_bMaintenanceStarting = true;
+	m_MaintenanceThread = std::thread(&CManagedHeap::MaintenanceThreadMain, this);
+
+	m_MaintenanceWake.wait(lock, [this] { return !m_bMaintenanceStarting; });
+	if (m_bStopMaintenance) //The thread could not apply the mask and has exited
+	{
+		m_bMaintenanceRunning = false;
+		ReleaseAllPending(); //Anything queued while we waited
+		m_ELastHeapError = EHeapState_Maint_BadAffinity;
+		lock.unlock();
+		m_MaintenanceThread.join();
+	}
 }
 
 //////////////////////////////////////////////////////////////////////////
-// Prints the current state of the managed memory in a friendly format
+// Stops the maintenance thread, releasing anything still queued on the calling thread
 //////////////////////////////////////////////////////////////////////////
-void CManagedHeap::Print()
+void CManagedHeap::StopMaintenanceThread()
 {
-	HANDLE hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
-
+	{
+		std::lock_guard<std::mutex> lock(m_HeapLock);
+		if (!m_bMaintenanceRunning)
+		{
+			return;
+		}
+		m_bStopMaintenance = true;
+	}
+	m_MaintenanceWake.notify_one();
+	m_MaintenanceThread.join(); //Must not hold the lock here, the thread needs it to finish
+
+	std::lock_guard<std::mutex> lock(m_HeapLock);
+	m_bMaintenanceRunning = false;
+	ReleaseAllPending();
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Releases every queued block on the calling thread
+//////////////////////////////////////////////////////////////////////////
+void CManagedHeap::FlushMaintenance()
+{
+	std::lock_guard<std::mutex> lock(m_HeapLock);
+	DrainRemoteFrees();
+	ReleaseAllPending();
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Binds the heap to the calling thread. Deallocations from any other thread are then
+// pushed to a lock free list, and released in a batch on the next Allocate
+//////////////////////////////////////////////////////////////////////////
+void CManagedHeap::SetOwnerThread()
+{
+	m_OwnerThread.store(std::this_thread::get_id());
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Removes the owner, all deallocations take the heap lock again
+// Anything already on the remote free list is released
+//////////////////////////////////////////////////////////////////////////
+void CManagedHeap::ClearOwnerThread()
+{
+	m_OwnerThread.store(std::thread::id());
+
+	std::lock_guard<std::mutex> lock(m_HeapLock);
+	DrainRemoteFrees();
+}
+
+
+//////////////////////////////////////////////////////////////////////////
+// Calcuates the offset to add to a pointer to align it to the alignment passed
+// Must be a power of two
+//////////////////////////////////////////////////////////////////////////
+u32 CManagedHeap::CalculateAlignmentDelta(void* pPointerToAlign, u32 uAlignment)
+{
+	u32 uAlignAdd = uAlignment - 1;
+	u32 uAlignMask = ~uAlignAdd;
+	u32 uAddressToAlign = ((u32)pPointerToAlign);
+	u32 uAligned = uAddressToAlign + uAlignAdd;
+	uAligned &= uAlignMask;
+	return(uAligned - uAddressToAlign);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Streams the block layout through the writer from a fixed buffer on the stack, without allocating
+// The heap is locked for the whole walk, so the snapshot is consistent. Copying the layout out
+// to write it after unlocking would need memory proportional to the number of blocks, which
+// can't come from this heap, so the writer runs under the lock and stalls the heap while it does
+//////////////////////////////////////////////////////////////////////////
+bool CManagedHeap::Snapshot(SnapshotWriter pfnWrite, void* pUserData)
+{
+	const u32 k_uRecordsPerWrite = 128;
+
+	std::lock_guard<std::mutex> lock(m_HeapLock);
+	if (!m_pMemory)
+	{
+		m_ELastHeapError = EHeapState_Init_NotInitialised;
+		return false;
+	}
+
+	SSnapshotHeader sHeader;
+	sHeader.m_uMagic = k_uSnapshotMagic;
+	sHeader.m_uVersion = k_uSnapshotVersion;
+	sHeader.m_uHeaderSize = sizeof(SBlockHeader);
+	sHeader.m_uFooterSize = sizeof(SFooterBlock);
+	sHeader.m_uHeapSize = m_uMemorySize;
+	sHeader.m_uNumAllocations = m_uNumAllocations;
+	sHeader.m_uFreeSpace = m_uFreeSpace;
+	sHeader.m_uActualFreeSpace = m_uActualFreeSpace;
+	if (!pfnWrite(&sHeader, sizeof(sHeader), pUserData))
+	{
+		return false;
+	}
+
+	SSnapshotBlock sRecords[k_uRecordsPerWrite];
+	u32 uNumRecords = 0;
+	for (SBlockHeader* pBlock = m_pBlock; pBlock; pBlock = pBlock->m_pSMemBlockNext)
+	{
+		uintptr_t uPayload = (uintptr_t)pBlock + sizeof(SBlockHeader);
+		uintptr_t uAlignment = uPayload & (~uPayload + 1); //Lowest set bit
+
+		SSnapshotBlock& sRecord = sRecords[uNumRecords++];
+		sRecord.m_uOffset = (u32)((u8*)pBlock - m_pMemory);
+		sRecord.m_uBlockSize = pBlock->m_uBlockSize;
+		sRecord.m_uLeftPadding = pBlock->m_LeftPadding;
+		sRecord.m_uRightPadding = pBlock->m_RightPadding;
+		sRecord.m_uFlags = (pBlock->m_bIsFreeBlock ? ESnapshotFlag_Free : 0) |
+			(pBlock->m_bIsPendingRelease ? ESnapshotFlag_PendingRelease : 0) |
+			(pBlock->m_bIsPurgeable ? ESnapshotFlag_Purgeable : 0) |
+			(pBlock->m_bIsSampled ? ESnapshotFlag_Sampled : 0);
+		sRecord.m_uAlignment = uAlignment > 0x80000000u ? 0x80000000u : (u32)uAlignment;
+
+		if (uNumRecords == k_uRecordsPerWrite)
+		{
+			if (!pfnWrite(sRecords, uNumRecords * sizeof(SSnapshotBlock), pUserData))
+			{
+				return false;
+			}
+			uNumRecords = 0;
+		}
+	}
+
+	return uNumRecords == 0 || pfnWrite(sRecords, uNumRecords * sizeof(SSnapshotBlock), pUserData);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Writes the block layout to a file with WriteFile, never allocating
+// The records are already batched on the stack, so each write goes straight to the OS.
+// A stream would allocate its buffer and locale through malloc, which may be this heap
+//////////////////////////////////////////////////////////////////////////
+bool CManagedHeap::Snapshot(const char* szFilename)
+{
+	HANDLE hFile = CreateFileA(szFilename, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (hFile == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+
+	SnapshotWriter pfnWriteToFile = [](const void* pData, u32 uNumBytes, void* pUserData)
+	{
+		DWORD uWritten = 0;
+		return WriteFile((HANDLE)pUserData, pData, uNumBytes, &uWritten, nullptr) && uWritten == uNumBytes;
+	};
+
+	bool bWritten = Snapshot(pfnWriteToFile, hFile);
+	return CloseHandle(hFile) && bWritten;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Checks up to uMaxBlocks blocks, carrying on from where the last call stopped
+// The cursor is an offset rather than a header, so it survives the blocks around it being merged or split.
+// The pass totals are adjusted whenever a block behind the cursor changes, so they always describe the
+// heap as it is now and can be compared exactly against the counters when the pass ends
+//////////////////////////////////////////////////////////////////////////
+bool CManagedHeap::VerifyStep(u32 uMaxBlocks)
+{
+	std::lock_guard<std::mutex> lock(m_HeapLock);
+	m_ELastHeapError = EHeapError_Ok;
+
+	if (!m_pMemory)
+	{
+		m_ELastHeapError = EHeapState_Init_NotInitialised;
+		return false;
+	}
+
+	//Carry on from the first header at or after the cursor
+	SBlockHeader* pBlock = m_pBlock;
+	if (m_uVerifyCursor != 0)
+	{
+		pBlock = FindBlockHeader(m_pMemory + m_uVerifyCursor);
+		if (!pBlock)
+		{
+			pBlock = m_pBlock;
+		}
+		else if ((u8*)pBlock < m_pMemory + m_uVerifyCursor)
+		{
+			pBlock = pBlock->m_pSMemBlockNext;
+		}
+	}
+	else if ((u8*)m_pBlock - m_pBlock->m_LeftPadding != m_pMemory)
+	{
+		m_ELastHeapError = EHeapState_Verify_PaddingMismatch;
+		m_uVerifyErrorOffset = (u32)((u8*)m_pBlock - m_pMemory);
+		ResetVerifyPass();
+		return false;
+	}
+
+	for (u32 uNumChecked = 0; pBlock && uNumChecked < uMaxBlocks; uNumChecked++)
+	{
+		EHeapState eState = VerifyBlock(pBlock);
+		if (eState != EHeapError_Ok)
+		{
+			m_ELastHeapError = eState;
+			m_uVerifyErrorOffset = (u32)((u8*)pBlock - m_pMemory);
+			ResetVerifyPass();
+			return false;
+		}
+
+		m_uVerifyNumBlocks++;
+		if (!pBlock->m_bIsFreeBlock)
+		{
+			m_uVerifyNumAllocations++;
+			m_uVerifyAllocatedBytes += pBlock->m_uBlockSize;
+		}
+
+		pBlock = pBlock->m_pSMemBlockNext;
+		m_uVerifyCursor = pBlock ? (u32)((u8*)pBlock - m_pMemory) : m_uMemorySize;
+	}
+
+	if (pBlock)
+	{
+		return true;
+	}
+
+	//Reached the end of the heap, every block has been counted exactly once
+	u32 uOverheads = m_uVerifyNumBlocks * (sizeof(SBlockHeader) + sizeof(SFooterBlock));
+	bool bCountersMatch = m_uVerifyNumAllocations == m_uNumAllocations &&
+		m_uVerifyAllocatedBytes == m_uMemorySize - m_uFreeSpace &&
+		m_uVerifyAllocatedBytes + uOverheads == m_uMemorySize - m_uActualFreeSpace;
+
+	//Every free block was found in the table, so any extra entries are for blocks which are no longer free
+	if (m_puFreeSegments && m_uNumFreeEntries != m_uVerifyNumBlocks - m_uVerifyNumAllocations)
+	{
+		ResetVerifyPass();
+		m_ELastHeapError = EHeapState_Verify_FreeTableMismatch;
+		m_uVerifyErrorOffset = 0;
+		return false;
+	}
+
+	ResetVerifyPass();
+	if (!bCountersMatch)
+	{
+		m_ELastHeapError = EHeapState_Verify_CounterMismatch;
+		m_uVerifyErrorOffset = 0;
+		return false;
+	}
+
+	m_uNumVerifyPasses++;
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Walks the heap to measure how tightly the allocations of one lifetime are packed
+// The first walk finds the span of the lifetime's blocks, the second totals what else lies inside it
+//////////////////////////////////////////////////////////////////////////
+bool CManagedHeap::GetLifetimeStats(ELifetime eLifetime, SLifetimeStats& sStats)
+{
+	std::lock_guard<std::mutex> lock(m_HeapLock);
+	memset(&sStats, 0, sizeof(sStats));
+
+	if (!m_pMemory || (u32)eLifetime >= ELifetime_Count)
+	{
+		return false;
+	}
+
+	SBlockHeader* pFirst = nullptr;
+	SBlockHeader* pLast = nullptr;
+	for (SBlockHeader* pBlock = m_pBlock; pBlock; pBlock = pBlock->m_pSMemBlockNext)
+	{
+		if (!pBlock->m_bIsFreeBlock && pBlock->m_uLifetime == eLifetime)
+		{
+			pFirst = pFirst ? pFirst : pBlock;
+			pLast = pBlock;
+			sStats.m_uNumAllocations++;
+			sStats.m_uAllocatedBytes += pBlock->m_uBlockSize;
+		}
+	}
+
+	if (!pFirst)
+	{
+		return true;
+	}
+
+	sStats.m_uSpanBytes = (u32)((u8*)GetFooter(pLast) + sizeof(SFooterBlock) - (u8*)pFirst);
+	for (SBlockHeader* pBlock = pFirst; pBlock != pLast; pBlock = pBlock->m_pSMemBlockNext)
+	{
+		sStats.m_uFreeBytesInSpan += pBlock->m_RightPadding;
+		if (pBlock->m_bIsFreeBlock)
+		{
+			sStats.m_uFreeBytesInSpan += pBlock->m_uBlockSize;
+			sStats.m_uNumHolesInSpan++;
+		}
+		else if (pBlock->m_uLifetime != eLifetime)
+		{
+			sStats.m_uOtherBytesInSpan += pBlock->m_uBlockSize;
+		}
+	}
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Keeps every free block's offset and size in a dense table outside the heap, so allocations scan
+// the table rather than the header of every block. Falls back to walking the blocks if the table can't grow
+// The blocks are walked in address order when it is enabled, so the table starts out sorted
+//////////////////////////////////////////////////////////////////////////
+bool CManagedHeap::EnableFreeBlockTable(bool bEnable)
+{
+	std::lock_guard<std::mutex> lock(m_HeapLock);
+
+	if (!m_pMemory)
+	{
+		m_ELastHeapError = EHeapState_Init_NotInitialised;
+		return false;
+	}
+
+	if (!bEnable)
+	{
+		ResizeFreeBlockTable(0);
+		return true;
+	}
+
+	if (m_puFreeSegments)
+	{
+		return true;
+	}
+
+	u32 uNumFreeBlocks = 0;
+	for (SBlockHeader* pBlock = m_pBlock; pBlock; pBlock = pBlock->m_pSMemBlockNext)
+	{
+		uNumFreeBlocks += pBlock->m_bIsFreeBlock ? 1 : 0;
+	}
+
+	//Segments start half full, so the blocks freed next rarely split them, and there are as many again spare
+	const u32 k_uInitialFill = k_uFreeSegmentEntries / 2;
+	u32 uNumSegments = (uNumFreeBlocks + k_uInitialFill - 1) / k_uInitialFill;
+	if (!ResizeFreeBlockTable(uNumSegments ? uNumSegments * 2 : 1))
+	{
+		m_ELastHeapError = EHeapState_Init_UnableToAquireMemory;
+		return false;
+	}
+
+	for (SBlockHeader* pBlock = m_pBlock; pBlock; pBlock = pBlock->m_pSMemBlockNext)
+	{
+		if (pBlock->m_bIsFreeBlock)
+		{
+			if (m_uNumUsedSegments == 0 || m_puFreeSegmentCounts[m_puFreeSegmentOrder[m_uNumUsedSegments - 1]] == k_uInitialFill)
+			{
+				m_uNumUsedSegments++;
+			}
+
+			u32 uPosition = m_uNumUsedSegments - 1;
+			u32* puSegment = GetFreeSegment(uPosition);
+			u32& uCount = m_puFreeSegmentCounts[m_puFreeSegmentOrder[uPosition]];
+			puSegment[uCount] = (u32)((u8*)pBlock - m_pMemory);
+			puSegment[k_uFreeSegmentEntries + uCount] = pBlock->m_uBlockSize + pBlock->m_RightPadding;
+			uCount++;
+			m_uNumFreeEntries++;
+		}
+	}
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Prints the current state of the managed memory in a friendly format
+//////////////////////////////////////////////////////////////////////////
+void CManagedHeap::Print()
+{
+	std::lock_guard<std::mutex> lock(m_HeapLock);
+	HANDLE hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
+
 	int bytesFree = 0;
 	int bytesAllocatted = 0;
 	int bytesInOverheads = 0;
@@ -479,6 +1294,11 @@ CManagedHeap::SBlockHeader* CManagedHeap::EncapsulateMemoryBlock(u8 * pRawMemory
 	SBlockHeader* pHeader = new (pRawMemory) SBlockHeader;
 
 	pHeader->m_bIsFreeBlock = true;
+	pHeader->m_bIsPendingRelease = false;
+	pHeader->m_bIsPurgeable = false;
+	pHeader->m_bIsSampled = false;
+	pHeader->m_bIsRemoteFreed.store(false, std::memory_order_relaxed);
+	pHeader->m_uLifetime = ELifetime_Transient;
 	pHeader->m_pSMemBlockNext = nullptr;
 	pHeader->m_uBlockSize = uSizeOfBlock - (sizeof(SBlockHeader) + sizeof(SFooterBlock));
 	pHeader->m_LeftPadding = 0;
@@ -495,10 +1315,47 @@ CManagedHeap::SBlockHeader* CManagedHeap::EncapsulateMemoryBlock(u8 * pRawMemory
 // The block may not currently be of the corect size, but reclaiming padding will meet the requirements
 // Returns pointer to first block which satisfies the criteria, nullptr otherwise
 /////////////////////////////////////////////////////////////////////////
-CManagedHeap::SBlockHeader* CManagedHeap::FindFreeBlock(u32 uSizeOfBlockToFind, u32 uAlignment)
+CManagedHeap::SBlockHeader* CManagedHeap::FindFreeBlock(u32 uSizeOfBlockToFind, u32 uAlignment, ELifetime eLifetime)
 {
+	if (eLifetime == ELifetime_Session && m_uPermanentFloor < m_uMemorySize)
+	{
+		//Sessions stack up under the permanent allocations, so releasing them never leaves holes between those
+		SBlockHeader* pFloorBlock = FindBlockHeader(m_pMemory + m_uPermanentFloor);
+		SBlockHeader* pBelowFloor = pFloorBlock ? GetPreviousHeader(pFloorBlock) : nullptr;
+		SBlockHeader* pBlock = pBelowFloor ? FindFreeBlockFromTop(uSizeOfBlockToFind, uAlignment, pBelowFloor) : nullptr;
+		if (pBlock)
+		{
+			return pBlock;
+		}
+	}
+
+	if (eLifetime != ELifetime_Transient)
+	{
+		return FindFreeBlockFromTop(uSizeOfBlockToFind, uAlignment, FindBlockHeader(m_pMemory + m_uMemorySize - 1));
+	}
+
+	if (uAlignment >= k_uMinOverAlignment)
+	{
+		return FindAlignedFreeBlock(uSizeOfBlockToFind, uAlignment);
+	}
+
+	if (m_puFreeSegments)
+	{
+		//Capacity is all a block of the minimum alignment needs, so only blocks which pass are looked at
+		for (u32 uIndex = ScanFreeTable(0, uSizeOfBlockToFind); uIndex != k_uNoFit; uIndex = ScanFreeTable(uIndex + 1, uSizeOfBlockToFind))
+		{
+			SBlockHeader* pBlockToCheck = (SBlockHeader*)(m_pMemory + GetFreeTableOffset(uIndex));
+			if (IsBlockViable(pBlockToCheck, uSizeOfBlockToFind, uAlignment))
+			{
+				return pBlockToCheck;
+			}
+		}
+
+		m_ELastHeapError = EHeapState_Alloc_NoLargeEnoughBlocks;
+		return nullptr;
+	}
+
 	//Find Free Block
-	bool found = false;
 	SBlockHeader* pBlockToCheck = m_pBlock;		//Get the first block
 	do
 	{
@@ -514,100 +1371,259 @@ CManagedHeap::SBlockHeader* CManagedHeap::FindFreeBlock(u32 uSizeOfBlockToFind,
 }
 
 //////////////////////////////////////////////////////////////////////////
-// Validates if a given unsigned interger is a power of two
-/////////////////////////////////////////////////////////////////////////
-bool CManagedHeap::IsPowerOfTwo(u32 uNumberToTest)
-{
-	bool isNonZero = (uNumberToTest != 0);
-	bool isPow2 = (((uNumberToTest) & (uNumberToTest - 1)) == 0);
-	return(isNonZero && isPow2); // Uses binary AND
-}
-
-//////////////////////////////////////////////////////////////////////////
-// Determines if a block is viable, given the block to check, the size of the allocation and the alignment required
-// This function takes into account reclaiming padding for this block
+// Walks back from pStartBlock for the first free block an allocation fits at the top of, nullptr if none
 /////////////////////////////////////////////////////////////////////////
-bool CManagedHeap::IsBlockViable(SBlockHeader* pBlockToCheck, u32 uSizeOfBlockToFind, u32 uAlignment)
+CManagedHeap::SBlockHeader* CManagedHeap::FindFreeBlockFromTop(u32 uSizeOfBlockToFind, u32 uAlignment, SBlockHeader* pStartBlock)
 {
-	if (!pBlockToCheck->m_bIsFreeBlock)
+	if (m_puFreeSegments && pStartBlock)
 	{
-		return false;
-	}
+		//A free block's left padding is always smaller than a block, and may make up the rest of the space
+		u32 uMinCapacity = uSizeOfBlockToFind > k_uMinBlockSpan ? uSizeOfBlockToFind - k_uMinBlockSpan : 0;
+		u32 uAfterStart = FindFreeTableIndex((u32)((u8*)pStartBlock - m_pMemory) + 1);
+		for (u32 uIndex = GetPreviousFreeTableIndex(uAfterStart); uIndex != k_uNoFit; uIndex = GetPreviousFreeTableIndex(uIndex))
+		{
+			if (GetFreeTableCapacity(uIndex) < uMinCapacity)
+			{
+				continue;
+			}
 
-	u8* pMemoryAllocationStart = (u8*)pBlockToCheck - pBlockToCheck->m_LeftPadding; //See if reclaiming padding will help
-	pMemoryAllocationStart += sizeof(SBlockHeader);
-	u32 paddingRequired = CalculateAlignmentDelta(pMemoryAllocationStart, uAlignment);// Calculate how much padding is needed
-	u32 uTotalSizeRequired = paddingRequired + uSizeOfBlockToFind;
+			SBlockHeader* pBlockToCheck = (SBlockHeader*)(m_pMemory + GetFreeTableOffset(uIndex));
+			if (CalculateLeadingGap(pBlockToCheck, uSizeOfBlockToFind, uAlignment, true) != k_uNoFit)
+			{
+				return pBlockToCheck;
+			}
+		}
 
-	if (uTotalSizeRequired > pBlockToCheck->m_uBlockSize + pBlockToCheck->m_RightPadding)// Too big for this block including padding reclaimation
+		m_ELastHeapError = EHeapState_Alloc_NoLargeEnoughBlocks;
+		return nullptr;
+	}
+
+	for (SBlockHeader* pBlockToCheck = pStartBlock; pBlockToCheck; pBlockToCheck = GetPreviousHeader(pBlockToCheck))
 	{
-		return false;
+		if (pBlockToCheck->m_bIsFreeBlock && CalculateLeadingGap(pBlockToCheck, uSizeOfBlockToFind, uAlignment, true) != k_uNoFit)
+		{
+			return pBlockToCheck;
+		}
 	}
 
-	return true;
+	m_ELastHeapError = EHeapState_Alloc_NoLargeEnoughBlocks;
+	return nullptr;
 }
 
 //////////////////////////////////////////////////////////////////////////
-// Moves the position of the header to correct allignment, reclaiming or adding padding if required
-// WILL CHANGE THE ADDRESS OF THE POINTER, therefore the varible itself is passed by reference
+// Finds the free block an over-aligned allocation would waste the least space in, trying the alignment's hint first
+// Stops at the first block which wastes nothing, returns nullptr if no block is large enough
 /////////////////////////////////////////////////////////////////////////
-void CManagedHeap::AdjustBlockPositionForPadding(u32 uAlignment, SBlockHeader*& pBlockToAllocateTo)
+CManagedHeap::SBlockHeader* CManagedHeap::FindAlignedFreeBlock(u32 uSizeOfBlockToFind, u32 uAlignment)
 {
-	SBlockHeader* pPreviousBlock = GetPreviousHeader(pBlockToAllocateTo);
-
-	if (pPreviousBlock) //If there is a previous block, and there is padding we can reclaim
+	//The hint may have been merged away or allocated since, so only use it if it still starts a free block.
+	//It is taken if the padding it leaves is too small to have held a block, which keeps runs of
+	//same aligned allocations packed together without a search each
+	u32 uHint = GetAlignedFreeHint(uAlignment);
+	if (uHint != 0)
 	{
+		SBlockHeader* pHintBlock = (SBlockHeader*)(m_pMemory + uHint - 1);
+		if (FindBlockHeader((u8*)pHintBlock) == pHintBlock && pHintBlock->m_bIsFreeBlock &&
+			CalculateAlignmentWaste(pHintBlock, uSizeOfBlockToFind, uAlignment) < k_uMinBlockSpan)
+		{
+			return pHintBlock;
+		}
+	}
 
-		u8* pFooterPos = (u8*)GetFooter(pPreviousBlock); //Gets the start of the footter
-
-		pFooterPos += sizeof(SFooterBlock);			//Moves pointer to the end of the footer
-
-
-		u8* pMemoryStart = pFooterPos += sizeof(SBlockHeader); // Start of our allocation, end of the previous blocks footer, plus the size of our header
+	SBlockHeader* pBestBlock = nullptr;
+	u32 uBestWaste = k_uNoFit;
 
+	//With the free block table only entries which may be large enough are looked at, otherwise every block
+	u32 uMinCapacity = uSizeOfBlockToFind > k_uMinBlockSpan ? uSizeOfBlockToFind - k_uMinBlockSpan : 0;
+	u32 uIndex = 0;
+	SBlockHeader* pBlockToCheck = m_pBlock;
+	if (m_puFreeSegments)
+	{
+		uIndex = ScanFreeTable(0, uMinCapacity);
+		pBlockToCheck = uIndex != k_uNoFit ? (SBlockHeader*)(m_pMemory + GetFreeTableOffset(uIndex)) : nullptr;
+	}
 
-		u32 uPadding = CalculateAlignmentDelta(pMemoryStart, uAlignment);
+	while (pBlockToCheck)
+	{
+		u32 uWaste = pBlockToCheck->m_bIsFreeBlock ? CalculateAlignmentWaste(pBlockToCheck, uSizeOfBlockToFind, uAlignment) : k_uNoFit;
+		if (uWaste < uBestWaste)
+		{
+			pBestBlock = pBlockToCheck;
+			uBestWaste = uWaste;
+			if (uWaste == 0)
+			{
+				break;
+			}
+		}
 
-		pMemoryStart += uPadding; //Offset our memory allocation with the padding
+		if (m_puFreeSegments)
+		{
+			uIndex = ScanFreeTable(uIndex + 1, uMinCapacity);
+			pBlockToCheck = uIndex != k_uNoFit ? (SBlockHeader*)(m_pMemory + GetFreeTableOffset(uIndex)) : nullptr;
+		}
+		else
+		{
+			pBlockToCheck = pBlockToCheck->m_pSMemBlockNext;
+		}
+	}
 
-		u8* pHeaderStart = pMemoryStart - sizeof(SBlockHeader); //Find position for our header
+	if (!pBestBlock)
+	{
+		m_ELastHeapError = EHeapState_Alloc_NoLargeEnoughBlocks;
+	}
+	return pBestBlock;
+}
 
-		SBlockHeader* pNextBlock = pBlockToAllocateTo->m_pSMemBlockNext; //Store the pointer for the next block so we dont loose in destroying the header
+//////////////////////////////////////////////////////////////////////////
+// Returns the gap between the start of a free block's memory and the header of an allocation placed in it,
+// or k_uNoFit if it does not fit. The block's padding on both sides counts towards the space available
+// Placed as low as alignment allows, or as high if bFromTop
+/////////////////////////////////////////////////////////////////////////
+u32 CManagedHeap::CalculateLeadingGap(SBlockHeader* pBlock, u32 uSizeOfBlockToFind, u32 uAlignment, bool bFromTop)
+{
+	u8* pRegionStart = (u8*)pBlock - pBlock->m_LeftPadding;
+	unsigned long long uRegionSize = (unsigned long long)pBlock->m_LeftPadding + sizeof(SBlockHeader) + pBlock->m_uBlockSize + sizeof(SFooterBlock) + pBlock->m_RightPadding;
+	unsigned long long uSpanRequired = (unsigned long long)sizeof(SBlockHeader) + uSizeOfBlockToFind + sizeof(SFooterBlock);
 
-		pBlockToAllocateTo->~SBlockHeader(); //Destroy old header
+	if (bFromTop)
+	{
+		if (uSpanRequired > uRegionSize)
+		{
+			return k_uNoFit;
+		}
 
-		pBlockToAllocateTo = new (pHeaderStart) SBlockHeader(); //Placement new - using the position of the header calculated previously
+		//Highest aligned payload whose footer still ends inside the region
+		uintptr_t uPayload = (uintptr_t)pRegionStart + (uintptr_t)(uRegionSize - uSpanRequired) + sizeof(SBlockHeader);
+		uPayload &= ~(uintptr_t)(uAlignment - 1);
+		if (uPayload < (uintptr_t)pRegionStart + sizeof(SBlockHeader))
+		{
+			return k_uNoFit;
+		}
+		return (u32)(uPayload - sizeof(SBlockHeader) - (uintptr_t)pRegionStart);
+	}
 
-		pBlockToAllocateTo->m_pSMemBlockNext = pNextBlock;
-		pBlockToAllocateTo->m_LeftPadding = uPadding;
-		pPreviousBlock->m_pSMemBlockNext = pBlockToAllocateTo; // Update pointer for previous block
+	u32 uGap = CalculateAlignmentDelta(pRegionStart + sizeof(SBlockHeader), uAlignment);
+	return (uGap + uSpanRequired <= uRegionSize) ? uGap : k_uNoFit;
+}
 
-		pPreviousBlock->m_RightPadding = pBlockToAllocateTo->m_LeftPadding; //Inform previous block of new padding size
+//////////////////////////////////////////////////////////////////////////
+// Returns the bytes an allocation placed in a free block would leave as padding, or k_uNoFit if it does not fit
+/////////////////////////////////////////////////////////////////////////
+u32 CManagedHeap::CalculateAlignmentWaste(SBlockHeader* pBlock, u32 uSizeOfBlockToFind, u32 uAlignment)
+{
+	u32 uGap = CalculateLeadingGap(pBlock, uSizeOfBlockToFind, uAlignment, false);
+	if (uGap == k_uNoFit)
+	{
+		return k_uNoFit;
 	}
-	else
+
+	u32 uRegionSize = pBlock->m_LeftPadding + sizeof(SBlockHeader) + pBlock->m_uBlockSize + sizeof(SFooterBlock) + pBlock->m_RightPadding;
+	u32 uRemainder = uRegionSize - uGap - (sizeof(SBlockHeader) + uSizeOfBlockToFind + sizeof(SFooterBlock));
+
+	//Either side becomes a free block if large enough, otherwise it is padding until a neighbour is released
+	return (uGap < k_uMinBlockSpan ? uGap : 0) + (uRemainder < k_uMinBlockSpan ? uRemainder : 0);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Returns the free hint slot for an alignment of k_uMinOverAlignment or more
+/////////////////////////////////////////////////////////////////////////
+u32& CManagedHeap::GetAlignedFreeHint(u32 uAlignment)
+{
+	u32 uIndex = 0;
+	while ((k_uMinOverAlignment << uIndex) < uAlignment)
 	{
-		//Special case, our block was the first block
+		uIndex++;
+	}
+	return m_uAlignedFreeHints[uIndex];
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Validates if a given unsigned interger is a power of two
+/////////////////////////////////////////////////////////////////////////
+bool CManagedHeap::IsPowerOfTwo(u32 uNumberToTest)
+{
+	bool isNonZero = (uNumberToTest != 0);
+	bool isPow2 = (((uNumberToTest) & (uNumberToTest - 1)) == 0);
+	return(isNonZero && isPow2); // Uses binary AND
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Determines if a block is viable, given the block to check, the size of the allocation and the alignment required
+// This function takes into account reclaiming padding for this block
+/////////////////////////////////////////////////////////////////////////
+bool CManagedHeap::IsBlockViable(SBlockHeader* pBlockToCheck, u32 uSizeOfBlockToFind, u32 uAlignment)
+{
+	if (!pBlockToCheck->m_bIsFreeBlock)
+	{
+		return false;
+	}
+
+	u8* pMemoryAllocationStart = (u8*)pBlockToCheck - pBlockToCheck->m_LeftPadding; //See if reclaiming padding will help
+	pMemoryAllocationStart += sizeof(SBlockHeader);
+	u32 paddingRequired = CalculateAlignmentDelta(pMemoryAllocationStart, uAlignment);// Calculate how much padding is needed
+	u32 uTotalSizeRequired = paddingRequired + uSizeOfBlockToFind;
+
+	if (uTotalSizeRequired > pBlockToCheck->m_uBlockSize + pBlockToCheck->m_RightPadding)// Too big for this block including padding reclaimation
+	{
+		return false;
+	}
+
+	return true;
+}
 
-		u8* pMemoryStart = m_pMemory + sizeof(SBlockHeader); //Use the base pointer as we are the first block
+//////////////////////////////////////////////////////////////////////////
+// Moves the position of the header to correct allignment, reclaiming or adding padding if required
+// WILL CHANGE THE ADDRESS OF THE POINTER, therefore the varible itself is passed by reference
+/////////////////////////////////////////////////////////////////////////
+void CManagedHeap::AdjustBlockPositionForPadding(u32 uNumBytes, u32 uAlignment, bool bFromTop, SBlockHeader*& pBlockToAllocateTo)
+{
+	SBlockHeader* pPreviousBlock = GetPreviousHeader(pBlockToAllocateTo);
+	SBlockHeader* pOldHeader = pBlockToAllocateTo;
 
-		u32 uPadding = CalculateAlignmentDelta(pMemoryStart, uAlignment);
+	//The block's memory starts at the end of the previous block's footer, or the start of the heap if we are the first block
+	u8* pRegionStart = (u8*)pBlockToAllocateTo - pBlockToAllocateTo->m_LeftPadding;
 
-		pMemoryStart += uPadding;
+	u32 uGap = CalculateLeadingGap(pBlockToAllocateTo, uNumBytes, uAlignment, bFromTop);
 
-		u8* pHeaderStart = pMemoryStart - sizeof(SBlockHeader); //Calculated position of new header
+	SBlockHeader* pNextBlock = pBlockToAllocateTo->m_pSMemBlockNext; //Store the pointer for the next block so we dont loose in destroying the header
 
-		SBlockHeader* pNextBlock = pBlockToAllocateTo->m_pSMemBlockNext;//Store the pointer for the next block so we dont loose in destroying the header
+	pBlockToAllocateTo->~SBlockHeader(); //Destroy old header
 
-		pBlockToAllocateTo->~SBlockHeader(); //Destroy old header
+	pBlockToAllocateTo = new (pRegionStart + uGap) SBlockHeader(); //Placement new - after the gap which aligns our allocation
 
-		pBlockToAllocateTo = new (pHeaderStart) SBlockHeader();
+	pBlockToAllocateTo->m_pSMemBlockNext = pNextBlock;
+	pBlockToAllocateTo->m_LeftPadding = uGap;
 
-		pBlockToAllocateTo->m_pSMemBlockNext = pNextBlock;
-		pBlockToAllocateTo->m_LeftPadding = uPadding;
+	//A gap large enough for a block becomes a free block rather than padding, so it can still be allocated
+	SBlockHeader* pGapBlock = nullptr;
+	if (uGap >= k_uMinBlockSpan)
+	{
+		pGapBlock = EncapsulateMemoryBlock(pRegionStart, uGap);
+		pGapBlock->m_pSMemBlockNext = pBlockToAllocateTo;
+		pBlockToAllocateTo->m_LeftPadding = 0;
+	}
 
-		m_pBlock = pBlockToAllocateTo; //Update class pointer to the first block position
+	SBlockHeader* pFirstBlock = pGapBlock ? pGapBlock : pBlockToAllocateTo;
+	if (pPreviousBlock)
+	{
+		pPreviousBlock->m_pSMemBlockNext = pFirstBlock; // Update pointer for previous block
+		pPreviousBlock->m_RightPadding = pFirstBlock->m_LeftPadding; //Inform previous block of new padding size
+	}
+	else
+	{
+		m_pBlock = pFirstBlock; //Update class pointer to the first block position
 	}
 
+	if (pGapBlock || pBlockToAllocateTo != pOldHeader)
+	{
+		RemoveBlockStart(pOldHeader, pNextBlock);
+		if (pGapBlock)
+		{
+			AddBlockStart(pGapBlock);
+			AddFreeBlock(pGapBlock);
+		}
+		AddBlockStart(pBlockToAllocateTo);
+	}
 }
 
 //////////////////////////////////////////////////////////////////////////
@@ -639,11 +1655,16 @@ void CManagedHeap::ManageFreeSpacePostAllocation(SBlockHeader* pBlockToAllocateT
 	if (sizeOfFreespace < sizeof(SBlockHeader) + sizeof(SFooterBlock) + _PLATFORM_MIN_ALIGN) //If the freespace is smaller than the overheads
 	{
 		pBlockToAllocateTo->m_RightPadding = sizeOfFreespace; //The freespace is marked as padding
-		pBlockToAllocateTo->m_pSMemBlockNext->m_LeftPadding = sizeOfFreespace;//The freespace is marked as padding
+		if (pBlockToAllocateTo->m_pSMemBlockNext)
+		{
+			pBlockToAllocateTo->m_pSMemBlockNext->m_LeftPadding = sizeOfFreespace;//The freespace is marked as padding
+		}
 	}
 	else //Sufficient space for a block
 	{
 		SBlockHeader* pNewBlock = EncapsulateMemoryBlock(pNewBlockPointer, sizeOfFreespace);
+		AddBlockStart(pNewBlock);
+		AddFreeBlock(pNewBlock);
 
 		pNewBlock->m_pSMemBlockNext = pBlockToAllocateTo->m_pSMemBlockNext; //Set up links to this block
 
@@ -664,10 +1685,20 @@ void CManagedHeap::MergeWithNearbyBlocks(u8 *& pMergeStartPoint, u8 *& pMergeEnd
 {
 	bool bCanMerge = false;
 	SBlockHeader* pHeader = ((SBlockHeader*)pMergeStartPoint);
+	SBlockHeader* pMergedNext = nullptr; //Headers swallowed by the merge, removed from the block start table
+	SBlockHeader* pMergedPrev = nullptr;
+
+	//Payloads already tidied, so only what lies between them needs overwriting once merged. In address order
+	u8* pTidyRanges[3][2] = {};
+	pTidyRanges[1][0] = pMergeStartPoint + sizeof(SBlockHeader);
+	pTidyRanges[1][1] = (u8*)GetFooter(pHeader);
 	//Merge forwards
-	if (pHeader->m_pSMemBlockNext->m_bIsFreeBlock) //Merge with next if possible
+	if (pHeader->m_pSMemBlockNext && pHeader->m_pSMemBlockNext->m_bIsFreeBlock) //Merge with next if possible
 	{
 		bCanMerge = true;
+		pMergedNext = pHeader->m_pSMemBlockNext;
+		pTidyRanges[2][0] = (u8*)pMergedNext + sizeof(SBlockHeader);
+		pTidyRanges[2][1] = (u8*)GetFooter(pMergedNext);
 		//Update our end pointer to merge over the other block
 		pMergeEndPoint = (u8*)GetFooter(pHeader->m_pSMemBlockNext) + sizeof(SFooterBlock) + pHeader->m_pSMemBlockNext->m_RightPadding;
 
@@ -681,6 +1712,16 @@ void CManagedHeap::MergeWithNearbyBlocks(u8 *& pMergeStartPoint, u8 *& pMergeEnd
 		m_uActualFreeSpace += sizeof(SBlockHeader) + sizeof(SFooterBlock); // We have reclaimed a header and footer
 
 	}
+	else if (pHeader->m_RightPadding != 0) //Otherwise just take our trailing padding
+	{
+		bCanMerge = true;
+		pMergeEndPoint += pHeader->m_RightPadding;
+
+		if (pHeader->m_pSMemBlockNext)
+		{
+			pHeader->m_pSMemBlockNext->m_LeftPadding = 0;
+		}
+	}
 
 	////////////////////////////////////////////////////
 	//Merge backwards
@@ -692,6 +1733,9 @@ void CManagedHeap::MergeWithNearbyBlocks(u8 *& pMergeStartPoint, u8 *& pMergeEnd
 	if (pPrevHeader && pPrevHeader->m_bIsFreeBlock)
 	{
 		bCanMerge = true;
+		pMergedPrev = pPrevHeader;
+		pTidyRanges[0][0] = (u8*)pMergedPrev + sizeof(SBlockHeader);
+		pTidyRanges[0][1] = (u8*)GetFooter(pMergedPrev);
 
 		pMergeStartPoint = (u8*)pPrevHeader;
 		m_uActualFreeSpace += sizeof(SBlockHeader) + sizeof(SFooterBlock);
@@ -705,15 +1749,42 @@ void CManagedHeap::MergeWithNearbyBlocks(u8 *& pMergeStartPoint, u8 *& pMergeEnd
 	if (pHeader->m_LeftPadding != 0)
 	{
 		bCanMerge = true;
-		pMergeStartPoint -= (u8)(pHeader->m_LeftPadding);
+		pMergeStartPoint -= pHeader->m_LeftPadding;
+		if (pPrevHeader)
+		{
+			pPrevHeader->m_RightPadding = 0; //The padding now belongs to the merged block
+		}
 	}
 
 	//If we determined we can merge, merge blocks
 	if (bCanMerge)
 	{
+		m_uActualFreeSpace += sizeof(SBlockHeader) + sizeof(SFooterBlock); //Our own header is replaced by the merged one
 		SBlockHeader* newBlock = EncapsulateMemoryBlock(pMergeStartPoint, pMergeEndPoint - pMergeStartPoint);
 		newBlock->m_pSMemBlockNext = pNextBlock;
 
+		//The merged block may reuse one of the old headers, it is removed and added back like any other
+		SBlockHeader* pRemovedHeaders[] = { pMergedPrev, pHeader, pMergedNext };
+		for (SBlockHeader* pRemoved : pRemovedHeaders)
+		{
+			if (pRemoved)
+			{
+				RemoveBlockStart(pRemoved, pNextBlock);
+			}
+		}
+		AddBlockStart(newBlock);
+
+		//Only the neighbours were free before, the block being released was not in the table
+		if (pMergedPrev)
+		{
+			RemoveFreeBlock(pMergedPrev);
+		}
+		if (pMergedNext)
+		{
+			RemoveFreeBlock(pMergedNext);
+		}
+		AddFreeBlock(newBlock);
+
 		if (pPrevHeader == nullptr)
 		{
 			m_pBlock = newBlock;
@@ -721,22 +1792,1091 @@ void CManagedHeap::MergeWithNearbyBlocks(u8 *& pMergeStartPoint, u8 *& pMergeEnd
 		else
 		{
 			pPrevHeader->m_pSMemBlockNext = newBlock;
-			SFooterBlock* test = GetFooter(newBlock);
-
 		}
 #ifdef TIDYDATA
+		//Only the old headers, footers and padding, so the time spent here doesn't grow with the size of the neighbours
 		u8* pMemoryBlock = (u8*)newBlock;
 		pMemoryBlock += sizeof(SBlockHeader);
-		memset(pMemoryBlock, '0', newBlock->m_uBlockSize);
+		for (u8** pRange : pTidyRanges)
+		{
+			if (pRange[0])
+			{
+				memset(pMemoryBlock, '0', pRange[0] - pMemoryBlock);
+				pMemoryBlock = pRange[1];
+			}
+		}
+		memset(pMemoryBlock, '0', (u8*)GetFooter(newBlock) - pMemoryBlock);
 #endif // TIDYDATA
 	}
 	else
 	{
-#ifdef TIDYDATA
-		u8* pMemoryBlock = pMergeStartPoint;
-		pMemoryBlock += sizeof(SBlockHeader);
-		memset(pMemoryBlock, '0', ((SBlockHeader*)pMergeStartPoint)->m_uBlockSize);
-#endif // TIDYDATA
+		AddFreeBlock((SBlockHeader*)pMergeStartPoint);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Compares the padding and footer of a block being deallocated against its neighbours
+// Sets the last error if an overwrite is detected
+//////////////////////////////////////////////////////////////////////////
+void CManagedHeap::CheckBlockIntegrity(SBlockHeader* pHeader)
+{
+	//If we want to check for underrun, compare the values of our right padding field (the one most likely to get overritten)
+	//To the next blocks Left value. These should both be identical, and if not, it is likely our value has been corrupted
+	if (pHeader->m_pSMemBlockNext && pHeader->m_RightPadding != pHeader->m_pSMemBlockNext->m_LeftPadding)
+	{
+		m_ELastHeapError = EHeapState_Dealloc_OverwriteUnderrun;
+	}
+
+	//If the pointer in the footer to the header does not match where the header should be, it is likely to have been overritten and therefore corrupted
+	if (GetFooter(pHeader)->m_pMatchingHeader != pHeader)
+	{
+		m_ELastHeapError = EHeapState_Dealloc_OverwriteOverrun;
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Rounds an allocation size up to the size of the block which will hold it
+//////////////////////////////////////////////////////////////////////////
+u32 CManagedHeap::RoundAllocationSize(u32 uNumBytes)
+{
+	//Always allocate memory in multiples of 4 bytes (helps keep blocks regular sized and reduces allignment padding)
+	if (uNumBytes % 4 != 0)
+	{
+		uNumBytes += 4 - (uNumBytes % 4);
+	}
+
+	//Blocks must be able to hold a link, so they can be queued for the maintenance thread once deallocated
+	if (uNumBytes < sizeof(SBlockHeader*))
+	{
+		uNumBytes = sizeof(SBlockHeader*);
+	}
+	return uNumBytes;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Checks a header found from a caller's pointer really starts a block, before anything is written to it
+// A footer pointing back at the header is taken as proof, otherwise the block start table decides
+//////////////////////////////////////////////////////////////////////////
+bool CManagedHeap::IsBlockStart(SBlockHeader* pHeader)
+{
+	u8* pEnd = m_pMemory + m_uMemorySize;
+	if ((u8*)pHeader < m_pMemory || (u8*)pHeader + sizeof(SBlockHeader) + sizeof(SFooterBlock) > pEnd)
+	{
+		return false;
+	}
+
+	if (HasMatchingFooter(pHeader))
+	{
+		return true;
+	}
+
+	//The footer may just have been overwritten, which is reported later as an overrun
+	return FindBlockHeader((u8*)pHeader) == pHeader;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Checks the header's size keeps its footer inside the heap, and the footer points back at it
+// Neither changes while a block is allocated, so this is safe without the lock
+//////////////////////////////////////////////////////////////////////////
+bool CManagedHeap::HasMatchingFooter(SBlockHeader* pHeader)
+{
+	u8* pEnd = m_pMemory + m_uMemorySize;
+	if ((u8*)pHeader < m_pMemory || (u8*)pHeader + sizeof(SBlockHeader) + sizeof(SFooterBlock) > pEnd)
+	{
+		return false;
+	}
+
+	u32 uMaxBlockSize = (u32)(pEnd - (u8*)pHeader) - (sizeof(SBlockHeader) + sizeof(SFooterBlock));
+	return pHeader->m_uBlockSize <= uMaxBlockSize && GetFooter(pHeader)->m_pMatchingHeader == pHeader;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Records a header in the block start table
+//////////////////////////////////////////////////////////////////////////
+void CManagedHeap::AddBlockStart(SBlockHeader* pHeader)
+{
+	u32 uOffset = (u32)((u8*)pHeader - m_pMemory);
+	if (uOffset < m_uVerifyCursor)
+	{
+		m_uVerifyNumBlocks++;
+	}
+
+	u32 uPage = uOffset >> CPageMap::k_uPageShift;
+	u32& uFirst = m_puBlockStarts[uPage];
+	if (uFirst == 0)
+	{
+		SetBlockStartBit(uPage, true);
+	}
+	if (uFirst == 0 || uOffset < uFirst - 1)
+	{
+		uFirst = uOffset + 1;
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Removes a header which no longer exists from the block start table
+// pNextHeader is the first header after it which still exists, and takes its place if in the same page
+//////////////////////////////////////////////////////////////////////////
+void CManagedHeap::RemoveBlockStart(SBlockHeader* pOldHeader, SBlockHeader* pNextHeader)
+{
+	u32 uOffset = (u32)((u8*)pOldHeader - m_pMemory);
+	if (uOffset < m_uVerifyCursor)
+	{
+		m_uVerifyNumBlocks--;
+	}
+
+	u32 uPage = uOffset >> CPageMap::k_uPageShift;
+	if (m_puBlockStarts[uPage] != uOffset + 1)
+	{
+		return;
+	}
+
+	u32 uNextOffset = pNextHeader ? (u32)((u8*)pNextHeader - m_pMemory) : 0;
+	m_puBlockStarts[uPage] = (pNextHeader && (uNextOffset >> CPageMap::k_uPageShift) == uPage) ? uNextOffset + 1 : 0;
+	if (m_puBlockStarts[uPage] == 0)
+	{
+		SetBlockStartBit(uPage, false);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Finds the header of the block whose header, payload, footer or trailing padding holds the address
+// Starts from the first block in the address's page, or the closest page before it with a block start,
+// so only the blocks starting in one page are walked
+//////////////////////////////////////////////////////////////////////////
+CManagedHeap::SBlockHeader* CManagedHeap::FindBlockHeader(u8* pAddress)
+{
+	u32 uOffset = (u32)(pAddress - m_pMemory);
+	u32 uPage = uOffset >> CPageMap::k_uPageShift;
+
+	if (m_puBlockStarts[uPage] == 0 || m_puBlockStarts[uPage] - 1 > uOffset)
+	{
+		//Covered by the last block of the closest earlier page that has any
+		uPage = uPage != 0 ? FindBlockStartPage(uPage - 1) : k_uNoFit;
+		if (uPage == k_uNoFit)
+		{
+			return nullptr; //Before the first block's header
+		}
+	}
+
+	SBlockHeader* pHeader = (SBlockHeader*)(m_pMemory + m_puBlockStarts[uPage] - 1);
+	while (pHeader->m_pSMemBlockNext && (u8*)pHeader->m_pSMemBlockNext <= pAddress)
+	{
+		pHeader = pHeader->m_pSMemBlockNext;
+	}
+	return pHeader;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Sets or clears a page's bit in the block start bitmap, and the bits above it which summarise it
+// A level above only changes when a word below becomes empty or stops being empty
+//////////////////////////////////////////////////////////////////////////
+void CManagedHeap::SetBlockStartBit(u32 uPage, bool bHasBlockStart)
+{
+	u32 uIndex = uPage;
+	for (u32 uLevel = 0; uLevel < k_uNumBlockStartBitLevels; uLevel++)
+	{
+		u32& uWord = m_puBlockStartBits[uLevel][uIndex >> 5];
+		bool bWasEmpty = uWord == 0;
+		if (bHasBlockStart)
+		{
+			uWord |= 1u << (uIndex & 31);
+		}
+		else
+		{
+			uWord &= ~(1u << (uIndex & 31));
+		}
+
+		if ((uWord == 0) == bWasEmpty)
+		{
+			return;
+		}
+		uIndex >>= 5;
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Returns the closest page at or before uPage with a block start, k_uNoFit if there is none
+// Climbs until a word has a bit set at or before the index, then follows the highest set bits back down.
+// Only the top level is scanned word by word, and it has a word per 32768 pages
+//////////////////////////////////////////////////////////////////////////
+u32 CManagedHeap::FindBlockStartPage(u32 uPage)
+{
+	u32 uIndex = uPage;
+	u32 uLevel = 0;
+	unsigned long uBit;
+
+	for (;;)
+	{
+		u32 uWord = m_puBlockStartBits[uLevel][uIndex >> 5] & (0xFFFFFFFFu >> (31 - (uIndex & 31)));
+		if (uWord != 0)
+		{
+			_BitScanReverse(&uBit, uWord);
+			uIndex = (uIndex & ~31u) | uBit;
+			break;
+		}
+
+		u32 uWordIndex = uIndex >> 5;
+		if (uWordIndex == 0)
+		{
+			return k_uNoFit;
+		}
+
+		//The words before this one are summarised by the level above, except at the top where the previous word is read directly
+		if (uLevel + 1 < k_uNumBlockStartBitLevels)
+		{
+			uLevel++;
+			uIndex = uWordIndex - 1;
+		}
+		else
+		{
+			uIndex = (uWordIndex << 5) - 1;
+		}
+	}
+
+	while (uLevel > 0)
+	{
+		uLevel--;
+		_BitScanReverse(&uBit, m_puBlockStartBits[uLevel][uIndex]);
+		uIndex = (uIndex << 5) | uBit;
 	}
+	return uIndex;
 }
 
+//////////////////////////////////////////////////////////////////////////
+// Checks one block against its footer and the next block, returns EHeapError_Ok if consistent
+// Bounds are checked before anything is read through the block's fields
+//////////////////////////////////////////////////////////////////////////
+CManagedHeap::EHeapState CManagedHeap::VerifyBlock(SBlockHeader* pBlock)
+{
+	u8* pEnd = m_pMemory + m_uMemorySize;
+	if ((u8*)pBlock < m_pMemory || (u8*)pBlock + sizeof(SBlockHeader) + sizeof(SFooterBlock) > pEnd ||
+		pBlock->m_uBlockSize > (u32)(pEnd - (u8*)pBlock) - (sizeof(SBlockHeader) + sizeof(SFooterBlock)))
+	{
+		return EHeapState_Verify_BadBounds;
+	}
+
+	SFooterBlock* pFooter = GetFooter(pBlock);
+	if (pFooter->m_pMatchingHeader != pBlock || pFooter->m_uSizeOfBlock != pBlock->m_uBlockSize)
+	{
+		return EHeapState_Verify_FooterMismatch;
+	}
+
+	if (pBlock->m_bIsFreeBlock && (pBlock->m_bIsPendingRelease || pBlock->m_bIsPurgeable))
+	{
+		return EHeapState_Verify_BadFlags;
+	}
+
+	if (pBlock->m_bIsFreeBlock && m_puFreeSegments)
+	{
+		u32 uOffset = (u32)((u8*)pBlock - m_pMemory);
+		u32 uIndex = FindFreeTableIndex(uOffset);
+		if (uIndex == k_uNoFit || GetFreeTableOffset(uIndex) != uOffset ||
+			GetFreeTableCapacity(uIndex) != pBlock->m_uBlockSize + pBlock->m_RightPadding)
+		{
+			return EHeapState_Verify_FreeTableMismatch;
+		}
+	}
+
+	//The next header sits straight after this block's footer and the padding between them
+	u8* pBlockEnd = (u8*)pFooter + sizeof(SFooterBlock);
+	SBlockHeader* pNext = pBlock->m_pSMemBlockNext;
+	if (!pNext)
+	{
+		return (pBlock->m_RightPadding == (u32)(pEnd - pBlockEnd)) ? EHeapError_Ok : EHeapState_Verify_BadLink;
+	}
+
+	if ((u8*)pNext < pBlockEnd || (u8*)pNext + sizeof(SBlockHeader) + sizeof(SFooterBlock) > pEnd ||
+		(u32)((u8*)pNext - pBlockEnd) != pBlock->m_RightPadding)
+	{
+		return EHeapState_Verify_BadLink;
+	}
+
+	if (pNext->m_LeftPadding != pBlock->m_RightPadding)
+	{
+		return EHeapState_Verify_PaddingMismatch;
+	}
+
+	if (pBlock->m_bIsFreeBlock && pNext->m_bIsFreeBlock)
+	{
+		return EHeapState_Verify_AdjacentFreeBlocks;
+	}
+
+	return EHeapError_Ok;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Discards the totals of the current verify pass, the next step starts from the first block
+//////////////////////////////////////////////////////////////////////////
+void CManagedHeap::ResetVerifyPass()
+{
+	m_uVerifyCursor = 0;
+	m_uVerifyNumBlocks = 0;
+	m_uVerifyNumAllocations = 0;
+	m_uVerifyAllocatedBytes = 0;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Adds a free block to the free block table, if enabled. Drops the table if it can't grow
+// Free blocks never change size or right padding in place, so the capacity stays correct until removed
+// Only the segment the block belongs in is moved, and a full segment is first split in two
+//////////////////////////////////////////////////////////////////////////
+void CManagedHeap::AddFreeBlock(SBlockHeader* pHeader)
+{
+	if (!m_puFreeSegments)
+	{
+		return;
+	}
+
+	u32 uOffset = (u32)((u8*)pHeader - m_pMemory);
+	if (m_uNumUsedSegments == 0)
+	{
+		m_uNumUsedSegments = 1; //Spare segments are always empty
+	}
+
+	u32 uPosition = FindFreeSegment(uOffset);
+	if (m_puFreeSegmentCounts[m_puFreeSegmentOrder[uPosition]] == k_uFreeSegmentEntries)
+	{
+		if (m_uNumUsedSegments == m_uNumTableSegments && !ResizeFreeBlockTable(m_uNumTableSegments * 2))
+		{
+			//Walking the blocks finds the same blocks, just slower, so the heap carries on without the table
+			ResizeFreeBlockTable(0);
+			m_ELastHeapError = EHeapState_FreeTable_Dropped;
+			return;
+		}
+
+		SplitFreeSegment(uPosition);
+		if (uOffset >= GetFreeSegment(uPosition + 1)[0])
+		{
+			uPosition++;
+		}
+	}
+
+	u32* puOffsets = GetFreeSegment(uPosition);
+	u32* puCapacities = puOffsets + k_uFreeSegmentEntries;
+	u32& uCount = m_puFreeSegmentCounts[m_puFreeSegmentOrder[uPosition]];
+
+	u32 uSlot = 0;
+	while (uSlot < uCount && puOffsets[uSlot] < uOffset)
+	{
+		uSlot++;
+	}
+
+	u32 uNumToMove = uCount - uSlot;
+	memmove(puOffsets + uSlot + 1, puOffsets + uSlot, uNumToMove * sizeof(u32));
+	memmove(puCapacities + uSlot + 1, puCapacities + uSlot, uNumToMove * sizeof(u32));
+
+	puOffsets[uSlot] = uOffset;
+	puCapacities[uSlot] = pHeader->m_uBlockSize + pHeader->m_RightPadding;
+	uCount++;
+	m_uNumFreeEntries++;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Removes a block which is no longer free from the free block table, if enabled
+// Only the header's address is used, so it may already have been overwritten.
+// Neighbouring segments which fit in half of one are merged, which keeps the segments a quarter full
+// on average, and the table is halved once three quarters of its segments are spare
+//////////////////////////////////////////////////////////////////////////
+void CManagedHeap::RemoveFreeBlock(SBlockHeader* pHeader)
+{
+	if (!m_puFreeSegments)
+	{
+		return;
+	}
+
+	u32 uOffset = (u32)((u8*)pHeader - m_pMemory);
+	u32 uIndex = FindFreeTableIndex(uOffset);
+	if (uIndex == k_uNoFit || GetFreeTableOffset(uIndex) != uOffset)
+	{
+		return;
+	}
+
+	u32 uPosition = uIndex >> k_uFreeSegmentShift;
+	u32 uSlot = uIndex & (k_uFreeSegmentEntries - 1);
+	u32* puOffsets = GetFreeSegment(uPosition);
+	u32* puCapacities = puOffsets + k_uFreeSegmentEntries;
+	u32& uCount = m_puFreeSegmentCounts[m_puFreeSegmentOrder[uPosition]];
+
+	u32 uNumToMove = uCount - uSlot - 1;
+	memmove(puOffsets + uSlot, puOffsets + uSlot + 1, uNumToMove * sizeof(u32));
+	memmove(puCapacities + uSlot, puCapacities + uSlot + 1, uNumToMove * sizeof(u32));
+	uCount--;
+	m_uNumFreeEntries--;
+
+	if (uCount == 0)
+	{
+		ReleaseFreeSegment(uPosition);
+	}
+	else if (uPosition + 1 < m_uNumUsedSegments &&
+		uCount + m_puFreeSegmentCounts[m_puFreeSegmentOrder[uPosition + 1]] <= k_uFreeSegmentEntries / 2)
+	{
+		MergeFreeSegments(uPosition);
+	}
+	else if (uPosition > 0 &&
+		m_puFreeSegmentCounts[m_puFreeSegmentOrder[uPosition - 1]] + uCount <= k_uFreeSegmentEntries / 2)
+	{
+		MergeFreeSegments(uPosition - 1);
+	}
+
+	//Not fatal if this fails, the table just keeps its spare pages
+	if (m_uNumTableSegments > 1 && m_uNumUsedSegments * 4 <= m_uNumTableSegments)
+	{
+		ResizeFreeBlockTable(m_uNumTableSegments / 2);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Moves the free block table to a new allocation of uNumSegments, returns false if it could not be found
+// The entries are kept, and the table is freed if uNumSegments is 0.
+// The segments in use are packed at the start of the new allocation in address order
+//////////////////////////////////////////////////////////////////////////
+bool CManagedHeap::ResizeFreeBlockTable(u32 uNumSegments)
+{
+	u32* pOldTable = m_puFreeSegments;
+
+	if (uNumSegments == 0)
+	{
+		CPageMap::FreePages(pOldTable);
+		m_puFreeSegments = nullptr;
+		m_puFreeSegmentOrder = nullptr;
+		m_puFreeSegmentCounts = nullptr;
+		m_uNumUsedSegments = 0;
+		m_uNumTableSegments = 0;
+		m_uNumFreeEntries = 0;
+		return true;
+	}
+
+	_ASSERT(uNumSegments >= m_uNumUsedSegments);
+
+	const u32 k_uSegmentWords = 2 * k_uFreeSegmentEntries;
+	u32* pNewTable = (u32*)CPageMap::AllocatePages((size_t)uNumSegments * (k_uSegmentWords + 2) * sizeof(u32));
+	if (!pNewTable)
+	{
+		return false;
+	}
+
+	u32* puNewOrder = pNewTable + (size_t)uNumSegments * k_uSegmentWords;
+	u32* puNewCounts = puNewOrder + uNumSegments;
+	for (u32 i = 0; i < uNumSegments; i++)
+	{
+		puNewOrder[i] = i;
+	}
+
+	for (u32 i = 0; i < m_uNumUsedSegments; i++)
+	{
+		memcpy(pNewTable + (size_t)i * k_uSegmentWords, GetFreeSegment(i), k_uSegmentWords * sizeof(u32));
+		puNewCounts[i] = m_puFreeSegmentCounts[m_puFreeSegmentOrder[i]];
+	}
+
+	if (pOldTable)
+	{
+		CPageMap::FreePages(pOldTable);
+	}
+
+	m_puFreeSegments = pNewTable;
+	m_puFreeSegmentOrder = puNewOrder;
+	m_puFreeSegmentCounts = puNewCounts;
+	m_uNumTableSegments = uNumSegments;
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Moves the top half of a full segment into a spare segment placed after it
+// There must be a spare segment
+//////////////////////////////////////////////////////////////////////////
+void CManagedHeap::SplitFreeSegment(u32 uPosition)
+{
+	const u32 k_uHalf = k_uFreeSegmentEntries / 2;
+
+	u32 uSpare = m_puFreeSegmentOrder[m_uNumUsedSegments];
+	memmove(m_puFreeSegmentOrder + uPosition + 2, m_puFreeSegmentOrder + uPosition + 1, (m_uNumUsedSegments - uPosition - 1) * sizeof(u32));
+	m_puFreeSegmentOrder[uPosition + 1] = uSpare;
+	m_uNumUsedSegments++;
+
+	u32* puFull = GetFreeSegment(uPosition);
+	u32* puSpare = GetFreeSegment(uPosition + 1);
+	memcpy(puSpare, puFull + k_uHalf, k_uHalf * sizeof(u32));
+	memcpy(puSpare + k_uFreeSegmentEntries, puFull + k_uFreeSegmentEntries + k_uHalf, k_uHalf * sizeof(u32));
+	m_puFreeSegmentCounts[m_puFreeSegmentOrder[uPosition]] = k_uHalf;
+	m_puFreeSegmentCounts[uSpare] = k_uFreeSegmentEntries - k_uHalf;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Moves the entries of the segment after uPosition onto the end of it, and makes the emptied segment spare
+// Both segments' entries must fit in one
+//////////////////////////////////////////////////////////////////////////
+void CManagedHeap::MergeFreeSegments(u32 uPosition)
+{
+	u32* puInto = GetFreeSegment(uPosition);
+	u32* puFrom = GetFreeSegment(uPosition + 1);
+	u32& uIntoCount = m_puFreeSegmentCounts[m_puFreeSegmentOrder[uPosition]];
+	u32& uFromCount = m_puFreeSegmentCounts[m_puFreeSegmentOrder[uPosition + 1]];
+
+	memcpy(puInto + uIntoCount, puFrom, uFromCount * sizeof(u32));
+	memcpy(puInto + k_uFreeSegmentEntries + uIntoCount, puFrom + k_uFreeSegmentEntries, uFromCount * sizeof(u32));
+	uIntoCount += uFromCount;
+	uFromCount = 0;
+
+	ReleaseFreeSegment(uPosition + 1);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Makes the empty segment at a position spare
+//////////////////////////////////////////////////////////////////////////
+void CManagedHeap::ReleaseFreeSegment(u32 uPosition)
+{
+	u32 uSegment = m_puFreeSegmentOrder[uPosition];
+	memmove(m_puFreeSegmentOrder + uPosition, m_puFreeSegmentOrder + uPosition + 1, (m_uNumUsedSegments - uPosition - 1) * sizeof(u32));
+	m_uNumUsedSegments--;
+	m_puFreeSegmentOrder[m_uNumUsedSegments] = uSegment;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Returns the offsets of the segment at a position in the order, its capacities follow k_uFreeSegmentEntries later
+//////////////////////////////////////////////////////////////////////////
+u32* CManagedHeap::GetFreeSegment(u32 uPosition)
+{
+	return m_puFreeSegments + (size_t)m_puFreeSegmentOrder[uPosition] * 2 * k_uFreeSegmentEntries;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Returns the position of the segment an offset belongs in: the last which starts at or before it, else the first
+//////////////////////////////////////////////////////////////////////////
+u32 CManagedHeap::FindFreeSegment(u32 uOffset)
+{
+	u32 uLow = 0;
+	u32 uHigh = m_uNumUsedSegments;
+	while (uLow < uHigh)
+	{
+		u32 uMid = uLow + (uHigh - uLow) / 2;
+		if (GetFreeSegment(uMid)[0] <= uOffset)
+		{
+			uLow = uMid + 1;
+		}
+		else
+		{
+			uHigh = uMid;
+		}
+	}
+	return uLow ? uLow - 1 : 0;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Returns the index of the first free table entry at or after the offset, k_uNoFit if none
+//////////////////////////////////////////////////////////////////////////
+u32 CManagedHeap::FindFreeTableIndex(u32 uOffset)
+{
+	if (m_uNumUsedSegments == 0)
+	{
+		return k_uNoFit;
+	}
+
+	u32 uPosition = FindFreeSegment(uOffset);
+	u32* puOffsets = GetFreeSegment(uPosition);
+	u32 uLow = 0;
+	u32 uHigh = m_puFreeSegmentCounts[m_puFreeSegmentOrder[uPosition]];
+	while (uLow < uHigh)
+	{
+		u32 uMid = uLow + (uHigh - uLow) / 2;
+		if (puOffsets[uMid] < uOffset)
+		{
+			uLow = uMid + 1;
+		}
+		else
+		{
+			uHigh = uMid;
+		}
+	}
+
+	//Past the end of this segment, so the first entry of the next one
+	if (uLow == m_puFreeSegmentCounts[m_puFreeSegmentOrder[uPosition]])
+	{
+		uPosition++;
+		uLow = 0;
+		if (uPosition == m_uNumUsedSegments)
+		{
+			return k_uNoFit;
+		}
+	}
+	return (uPosition << k_uFreeSegmentShift) | uLow;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Returns the index of the entry before uIndex, the last entry if uIndex is k_uNoFit, k_uNoFit if there is none
+//////////////////////////////////////////////////////////////////////////
+u32 CManagedHeap::GetPreviousFreeTableIndex(u32 uIndex)
+{
+	u32 uPosition = m_uNumUsedSegments;
+	if (uIndex != k_uNoFit)
+	{
+		if (uIndex & (k_uFreeSegmentEntries - 1))
+		{
+			return uIndex - 1;
+		}
+		uPosition = uIndex >> k_uFreeSegmentShift;
+	}
+
+	if (uPosition == 0)
+	{
+		return k_uNoFit;
+	}
+	uPosition--;
+	return (uPosition << k_uFreeSegmentShift) | (m_puFreeSegmentCounts[m_puFreeSegmentOrder[uPosition]] - 1);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Returns the offset of the free block at an index
+//////////////////////////////////////////////////////////////////////////
+u32 CManagedHeap::GetFreeTableOffset(u32 uIndex)
+{
+	return GetFreeSegment(uIndex >> k_uFreeSegmentShift)[uIndex & (k_uFreeSegmentEntries - 1)];
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Returns the capacity of the free block at an index
+//////////////////////////////////////////////////////////////////////////
+u32 CManagedHeap::GetFreeTableCapacity(u32 uIndex)
+{
+	return GetFreeSegment(uIndex >> k_uFreeSegmentShift)[k_uFreeSegmentEntries + (uIndex & (k_uFreeSegmentEntries - 1))];
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Returns the index of the first free table entry from uFirst with at least the capacity, k_uNoFit if none
+// uFirst may be one past the last entry of a segment. Compares four capacities at a time where SSE2 is available
+//////////////////////////////////////////////////////////////////////////
+u32 CManagedHeap::ScanFreeTable(u32 uFirst, u32 uMinCapacity)
+{
+	u32 uSlot = uFirst & (k_uFreeSegmentEntries - 1);
+	for (u32 uPosition = uFirst >> k_uFreeSegmentShift; uPosition < m_uNumUsedSegments; uPosition++, uSlot = 0)
+	{
+		const u32* puCapacities = GetFreeSegment(uPosition) + k_uFreeSegmentEntries;
+		u32 uCount = m_puFreeSegmentCounts[m_puFreeSegmentOrder[uPosition]];
+
+#if MANAGEDHEAP_SSE2
+		if (uMinCapacity != 0)
+		{
+			//SSE2 only has signed compares, flipping the top bit of both sides makes them order as unsigned
+			const __m128i vBias = _mm_set1_epi32((int)0x80000000);
+			const __m128i vThreshold = _mm_xor_si128(_mm_set1_epi32((int)(uMinCapacity - 1)), vBias);
+			for (; uSlot + 4 <= uCount; uSlot += 4)
+			{
+				__m128i vCapacities = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(puCapacities + uSlot)), vBias);
+				int iMask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(vCapacities, vThreshold)));
+				if (iMask != 0)
+				{
+					while (!(iMask & 1))
+					{
+						iMask >>= 1;
+						uSlot++;
+					}
+					return (uPosition << k_uFreeSegmentShift) | uSlot;
+				}
+			}
+		}
+#endif // MANAGEDHEAP_SSE2
+
+		for (; uSlot < uCount; uSlot++)
+		{
+			if (puCapacities[uSlot] >= uMinCapacity)
+			{
+				return (uPosition << k_uFreeSegmentShift) | uSlot;
+			}
+		}
+	}
+	return k_uNoFit;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Marks a block as free, updates the counters and coalesces it with its neighbours
+// bPayloadTidied skips overwriting the payload, for blocks tidied before the lock was taken
+//////////////////////////////////////////////////////////////////////////
+void CManagedHeap::ReleaseBlock(SBlockHeader* pHeader, bool bPayloadTidied)
+{
+	if (!bPayloadTidied)
+	{
+		TidyPayload(pHeader);
+	}
+
+	//Mark the block as free, then update counters
+	pHeader->m_bIsFreeBlock = true;
+	pHeader->m_bIsPendingRelease = false;
+	m_uNumAllocations--;
+	m_uFreeSpace += pHeader->m_uBlockSize;
+	m_uActualFreeSpace += pHeader->m_uBlockSize;
+
+	if ((u32)((u8*)pHeader - m_pMemory) < m_uVerifyCursor)
+	{
+		m_uVerifyNumAllocations--;
+		m_uVerifyAllocatedBytes -= pHeader->m_uBlockSize;
+	}
+
+	if (pHeader->m_bIsSampled && m_pProfiler)
+	{
+		m_pProfiler->RemoveSample((u8*)pHeader + sizeof(SBlockHeader));
+	}
+
+	u32 uOffset = (u32)((u8*)pHeader - m_pMemory);
+	bool bWasPermanentFloor = pHeader->m_uLifetime == ELifetime_Permanent && uOffset == m_uPermanentFloor;
+
+	//Try to coalese with nearby freeblocks and padding
+	u8* pStartOfBlockToMerge = (u8*)pHeader;
+	u8* pEndOfBlockToMerge = (u8*)GetFooter(pHeader) + sizeof(SFooterBlock);
+	MergeWithNearbyBlocks(pStartOfBlockToMerge, pEndOfBlockToMerge);
+
+	if (bWasPermanentFloor)
+	{
+		RaisePermanentFloor(FindBlockHeader(m_pMemory + uOffset));
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Moves the permanent floor up to the first permanent allocation from pStartBlock, or the end of the heap
+// Walks every block above, but only runs when the lowest permanent allocation is released
+//////////////////////////////////////////////////////////////////////////
+void CManagedHeap::RaisePermanentFloor(SBlockHeader* pStartBlock)
+{
+	m_uPermanentFloor = m_uMemorySize;
+	for (SBlockHeader* pBlock = pStartBlock; pBlock; pBlock = pBlock->m_pSMemBlockNext)
+	{
+		if (!pBlock->m_bIsFreeBlock && !pBlock->m_bIsPendingRelease && pBlock->m_uLifetime == ELifetime_Permanent)
+		{
+			m_uPermanentFloor = (u32)((u8*)pBlock - m_pMemory);
+			return;
+		}
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Overwrites the payload of a block being released, if TIDYDATA is defined
+//////////////////////////////////////////////////////////////////////////
+void CManagedHeap::TidyPayload(SBlockHeader* pHeader)
+{
+#ifdef TIDYDATA
+	memset((u8*)pHeader + sizeof(SBlockHeader), '0', pHeader->m_uBlockSize);
+#endif // TIDYDATA
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Adds a deallocated block to the end of the pending release list
+// The link to the next pending block is stored at the start of the payload
+//////////////////////////////////////////////////////////////////////////
+void CManagedHeap::PushPendingRelease(SBlockHeader* pHeader)
+{
+	pHeader->m_bIsPendingRelease = true;
+
+	SBlockHeader* pNext = nullptr;
+	memcpy((u8*)pHeader + sizeof(SBlockHeader), &pNext, sizeof(SBlockHeader*));
+
+	if (m_pPendingReleaseTail)
+	{
+		memcpy((u8*)m_pPendingReleaseTail + sizeof(SBlockHeader), &pHeader, sizeof(SBlockHeader*));
+	}
+	else
+	{
+		m_pPendingReleaseHead = pHeader;
+	}
+	m_pPendingReleaseTail = pHeader;
+	m_uNumPendingReleases++;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Removes the first block from the pending release list, nullptr if empty
+//////////////////////////////////////////////////////////////////////////
+CManagedHeap::SBlockHeader* CManagedHeap::PopPendingRelease()
+{
+	SBlockHeader* pHeader = m_pPendingReleaseHead;
+	if (pHeader)
+	{
+		memcpy(&m_pPendingReleaseHead, (u8*)pHeader + sizeof(SBlockHeader), sizeof(SBlockHeader*));
+		if (!m_pPendingReleaseHead)
+		{
+			m_pPendingReleaseTail = nullptr;
+		}
+		m_uNumPendingReleases--;
+	}
+	return pHeader;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Releases every block on the pending release list. Lock must already be held
+//////////////////////////////////////////////////////////////////////////
+void CManagedHeap::ReleaseAllPending()
+{
+	while (SBlockHeader* pHeader = PopPendingRelease())
+	{
+		ReleaseBlock(pHeader, false);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Releases up to uMaxBlocks from the front of the pending release list. Lock must already be held
+//////////////////////////////////////////////////////////////////////////
+void CManagedHeap::ReleasePending(u32 uMaxBlocks)
+{
+	for (u32 uReleased = 0; uReleased < uMaxBlocks && m_pPendingReleaseHead; uReleased++)
+	{
+		ReleaseBlock(PopPendingRelease(), false);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Pushes a block deallocated by a non owner thread to the remote free list, without locking
+// Returns false if the block could not be validated without the lock, so the caller must take the locked path
+// The link to the next block is stored at the start of the payload. Only the thread which claims the
+// block's remote free flag writes it, so a second deallocation can't link the block to itself
+//////////////////////////////////////////////////////////////////////////
+bool CManagedHeap::PushRemoteFree(SBlockHeader* pHeader)
+{
+	//An overwritten footer or a pointer which was never allocated is reported by the locked path
+	if (!HasMatchingFooter(pHeader))
+	{
+		return false;
+	}
+
+	bool bExpected = false;
+	if (!pHeader->m_bIsRemoteFreed.compare_exchange_strong(bExpected, true, std::memory_order_relaxed))
+	{
+		return true; //Already queued by another deallocation, drop the double free
+	}
+
+	SBlockHeader* pHead = m_pRemoteFreeHead.load(std::memory_order_relaxed);
+	do
+	{
+		memcpy((u8*)pHeader + sizeof(SBlockHeader), &pHead, sizeof(SBlockHeader*));
+	} while (!m_pRemoteFreeHead.compare_exchange_weak(pHead, pHeader, std::memory_order_release, std::memory_order_relaxed));
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Takes every block from the remote free list and releases or queues it. Lock must already be held
+// The whole list is taken in one exchange, so the producers never see a partially drained list
+//////////////////////////////////////////////////////////////////////////
+void CManagedHeap::DrainRemoteFrees()
+{
+	SBlockHeader* pHeader = m_pRemoteFreeHead.exchange(nullptr, std::memory_order_acquire);
+	while (pHeader)
+	{
+		SBlockHeader* pNext;
+		memcpy(&pNext, (u8*)pHeader + sizeof(SBlockHeader), sizeof(SBlockHeader*));
+
+		//A link outside the heap means the payload was written after the block was freed, nothing past it can be trusted
+		if (pNext && (!IsAligned((u8*)pNext) || !HasMatchingFooter(pNext) || pNext == pHeader))
+		{
+			_ASSERT(false);
+			pNext = nullptr;
+		}
+
+		//A block the owner had already released still has a matching footer, so that double free is caught here
+		if (!pHeader->m_bIsFreeBlock && !pHeader->m_bIsPendingRelease)
+		{
+			if (pHeader->m_bIsPurgeable)
+			{
+				UnlinkPurgeable(pHeader);
+			}
+			if (m_bMaintenanceRunning)
+			{
+				PushPendingRelease(pHeader);
+			}
+			else
+			{
+				ReleaseBlock(pHeader, false);
+			}
+		}
+		pHeader = pNext;
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Gets the purgeable info stored at the end of a purgeable block
+//////////////////////////////////////////////////////////////////////////
+CManagedHeap::SPurgeableInfo* CManagedHeap::GetPurgeableInfo(SBlockHeader* pHeader)
+{
+	return (SPurgeableInfo*)((u8*)GetFooter(pHeader) - sizeof(SPurgeableInfo));
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Adds a purgeable block as the most recently used
+//////////////////////////////////////////////////////////////////////////
+void CManagedHeap::LinkPurgeable(SBlockHeader* pHeader)
+{
+	SPurgeableInfo* pInfo = GetPurgeableInfo(pHeader);
+	pInfo->m_pLRUPrev = nullptr;
+	pInfo->m_pLRUNext = m_pPurgeableHead;
+
+	if (m_pPurgeableHead)
+	{
+		GetPurgeableInfo(m_pPurgeableHead)->m_pLRUPrev = pHeader;
+	}
+	else
+	{
+		m_pPurgeableTail = pHeader;
+	}
+	m_pPurgeableHead = pHeader;
+
+	pHeader->m_bIsPurgeable = true;
+	m_uNumPurgeable++;
+	m_uPurgeableBytes += pHeader->m_uBlockSize;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Removes a block from the purgeable list, it is then an ordinary allocation
+//////////////////////////////////////////////////////////////////////////
+void CManagedHeap::UnlinkPurgeable(SBlockHeader* pHeader)
+{
+	SPurgeableInfo* pInfo = GetPurgeableInfo(pHeader);
+
+	if (pInfo->m_pLRUPrev)
+	{
+		GetPurgeableInfo(pInfo->m_pLRUPrev)->m_pLRUNext = pInfo->m_pLRUNext;
+	}
+	else
+	{
+		m_pPurgeableHead = pInfo->m_pLRUNext;
+	}
+
+	if (pInfo->m_pLRUNext)
+	{
+		GetPurgeableInfo(pInfo->m_pLRUNext)->m_pLRUPrev = pInfo->m_pLRUPrev;
+	}
+	else
+	{
+		m_pPurgeableTail = pInfo->m_pLRUPrev;
+	}
+
+	pHeader->m_bIsPurgeable = false;
+	m_uNumPurgeable--;
+	m_uPurgeableBytes -= pHeader->m_uBlockSize;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Picks the purgeable block to evict for an allocation. Blocks whose release would open a large enough hole come first,
+// then blocks next to free space, then the rest. Within each, lowest priority then least recently used
+// Blocks another thread has already freed are skipped. Returns nullptr if there is nothing to purge
+//////////////////////////////////////////////////////////////////////////
+CManagedHeap::SBlockHeader* CManagedHeap::ChoosePurgeVictim(u32 uNumBytes, u32 uAlignment)
+{
+	SBlockHeader* pBest = nullptr;
+	u32 uBestRank = 0;
+	u32 uBestPriority = 0;
+
+	//Walk from the least recently used, only replacing on a strictly better block so ties go to the oldest
+	for (SBlockHeader* pBlock = m_pPurgeableTail; pBlock; pBlock = GetPurgeableInfo(pBlock)->m_pLRUPrev)
+	{
+		//Queued on the remote free list, its payload holds the link to the next block and the drain will release it
+		if (pBlock->m_bIsRemoteFreed.load(std::memory_order_relaxed))
+		{
+			continue;
+		}
+
+		SBlockHeader* pPrev = GetPreviousHeader(pBlock);
+		SBlockHeader* pNext = pBlock->m_pSMemBlockNext;
+		bool bPrevFree = pPrev && pPrev->m_bIsFreeBlock;
+		bool bNextFree = pNext && pNext->m_bIsFreeBlock;
+
+		//Size of the block MergeWithNearbyBlocks would produce if this one was released
+		u8* pHoleStart = bPrevFree ? (u8*)pPrev - pPrev->m_LeftPadding : (u8*)pBlock - pBlock->m_LeftPadding;
+		u8* pHoleEnd = bNextFree ? (u8*)GetFooter(pNext) + sizeof(SFooterBlock) + pNext->m_RightPadding
+			: (u8*)GetFooter(pBlock) + sizeof(SFooterBlock) + pBlock->m_RightPadding;
+		u32 uHoleSize = (u32)(pHoleEnd - pHoleStart) - (sizeof(SBlockHeader) + sizeof(SFooterBlock));
+
+		u32 uRank = 0;
+		if (uHoleSize >= uNumBytes + uAlignment - _PLATFORM_MIN_ALIGN) //Large enough even with worst case alignment padding
+		{
+			uRank = 2;
+		}
+		else if (bPrevFree || bNextFree)
+		{
+			uRank = 1;
+		}
+
+		u32 uPriority = GetPurgeableInfo(pBlock)->m_uPriority;
+		if (!pBest || uRank > uBestRank || (uRank == uBestRank && uPriority < uBestPriority))
+		{
+			pBest = pBlock;
+			uBestRank = uRank;
+			uBestPriority = uPriority;
+		}
+	}
+
+	return pBest;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Notifies the owner of a purgeable block and releases it
+// Returns false, leaving the block alone, if it is nullptr or another thread has queued it as a remote free
+//////////////////////////////////////////////////////////////////////////
+bool CManagedHeap::PurgeBlock(SBlockHeader* pHeader)
+{
+	//Claimed the same way a remote free claims it, so a thread freeing it at the same time can't queue it while it is released
+	bool bExpected = false;
+	if (!pHeader || !pHeader->m_bIsRemoteFreed.compare_exchange_strong(bExpected, true, std::memory_order_relaxed))
+	{
+		return false;
+	}
+
+	SPurgeableInfo* pInfo = GetPurgeableInfo(pHeader);
+	PurgeCallback pfnPurge = pInfo->m_pfnPurge;
+	void* pUserData = pInfo->m_pUserData;
+
+	UnlinkPurgeable(pHeader);
+	pfnPurge((u8*)pHeader + sizeof(SBlockHeader), pUserData);
+
+	m_uNumPurged++;
+	ReleaseBlock(pHeader, false);
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Returns true if purging every purgeable block would leave enough free space for the allocation
+// Does not account for fragmentation, so purging may still not open a large enough hole
+//////////////////////////////////////////////////////////////////////////
+bool CManagedHeap::CouldPurgeFit(u32 uNumBytes)
+{
+	//Every purge gives back at most its payload and the header and footer it may merge away
+	unsigned long long uMostFree = (unsigned long long)m_uActualFreeSpace + m_uPurgeableBytes +
+		(unsigned long long)m_uNumPurgeable * (sizeof(SBlockHeader) + sizeof(SFooterBlock));
+	return (unsigned long long)uNumBytes + sizeof(SBlockHeader) + sizeof(SFooterBlock) <= m_uMemorySize && uNumBytes <= uMostFree;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Entry point for the maintenance thread
+// Releases queued blocks until the budget for this period is spent, then sleeps out the rest of the period
+// Each payload is tidied with the lock released, so the time callers wait doesn't depend on the block's size
+//////////////////////////////////////////////////////////////////////////
+void CManagedHeap::MaintenanceThreadMain()
+{
+	//Written before the thread started, so safe to read unlocked
+	DWORD_PTR uAffinityMask = m_sMaintenanceSettings.m_uAffinityMask;
+	bool bBound = uAffinityMask == 0 || SetThreadAffinityMask(GetCurrentThread(), uAffinityMask) != 0;
+
+	std::unique_lock<std::mutex> lock(m_HeapLock);
+	m_bMaintenanceStarting = false;
+	m_bStopMaintenance = m_bStopMaintenance || !bBound;
+	m_MaintenanceWake.notify_all(); //StartMaintenanceThread is waiting on the result
+
+	while (!m_bStopMaintenance)
+	{
+		std::chrono::steady_clock::time_point periodStart = std::chrono::steady_clock::now();
+		std::chrono::steady_clock::time_point budgetEnd = periodStart + std::chrono::microseconds(m_sMaintenanceSettings.m_uBudgetMicroseconds);
+		std::chrono::steady_clock::time_point periodEnd = periodStart + std::chrono::microseconds(m_sMaintenanceSettings.m_uPeriodMicroseconds);
+
+		while (m_pPendingReleaseHead && !m_bStopMaintenance && std::chrono::steady_clock::now() < budgetEnd)
+		{
+			//Once off the list the block is still counted as allocated and marked pending, so nothing else touches its payload
+			SBlockHeader* pHeader = PopPendingRelease();
+			lock.unlock();
+			TidyPayload(pHeader);
+			lock.lock();
+
+			ReleaseBlock(pHeader, true);
+
+			//Give callers waiting on the heap a chance between each block
+			lock.unlock();
+			std::this_thread::yield();
+			lock.lock();
+		}
+
+		m_MaintenanceWake.wait_until(lock, periodEnd, [this] { return m_bStopMaintenance; });
+	}
+}
@@ -1,7 +1,9 @@
 #ifndef _MANAGEDHEAP_H_
 #define _MANAGEDHEAP_H_
 
+#ifndef MANAGEDHEAP_NO_TIDYDATA
 #define TIDYDATA //If defined, dealocations will be overritted with blank data
+#endif
 
 ////////////////////////////////////
 //TypeDefs to show size in bits
@@ -20,6 +22,8 @@ typedef unsigned int		u32;
 //////////////////////////////////////////////////////////////////////////
 #define _PLATFORM_MIN_ALIGN	(sizeof(u32))
 
+class CHeapProfiler;
+
 
 class CManagedHeap
 {
@@ -43,11 +47,45 @@ public:
 		EHeapState_Alloc_ZeroSizeAlloc,			// Allocation of 0 bytes requested - invalid
 		EHeapState_Alloc_BadAlign,				// Alignment specified is not a power of 2, or smaller than the minimum allignment defined
 		EHeapState_Alloc_NoLargeEnoughBlocks,	// Either the allocation is larger than the remaining memory, or there isn't a large enough free block
+		EHeapState_Alloc_NoPurgeCallback,		// Purgeable allocation requested without a callback to notify the owner on eviction
+		EHeapState_Alloc_OverByteLimit,			// The allocation would take the allocated bytes past the limit set with SetByteLimit
+		EHeapState_Alloc_BadLifetime,			// Lifetime hint is not one of ELifetime
+		EHeapState_Alloc_TooLarge,				// The size, once rounded and aligned with its header and footer, does not fit in 32 bits
 
 		EHeapState_Dealloc_Nullptr,				// Tried to deallocate a nullptr
 		EHeapState_Dealloc_AlreadyDeallocated,	// Tried to deallocate a block that's already deallocated
 		EHeapState_Dealloc_OverwriteUnderrun,	// Memory overwrite detected before the deallocated block
 		EHeapState_Dealloc_OverwriteOverrun,	// Memory overwrite detected after the deallocated block 
+		EHeapState_Dealloc_NotOwned,			// Tried to deallocate a pointer from outside this heap
+		EHeapState_Dealloc_NotBlockStart,		// Tried to deallocate a pointer inside this heap which was not returned by Allocate
+		EHeapState_Dealloc_SizeMismatch,		// The size passed to a sized Deallocate does not match the allocation
+
+		EHeapState_Maint_AlreadyRunning,		// Tried to start the maintenance thread while it was already running
+		EHeapState_Maint_BadSettings,			// Maintenance period was 0, or the budget was larger than the period
+		EHeapState_Maint_BadAffinity,			// The maintenance thread could not be bound to the CPUs in its affinity mask
+
+		EHeapState_FreeTable_Dropped,			// The free block table could not grow and was dropped, allocations walk the blocks until it is enabled again
+
+		//Verify errors, GetVerifyErrorOffset gives the offset of the block at fault
+		EHeapState_Verify_BadBounds,			// A block, or its footer, lies outside the heap
+		EHeapState_Verify_FooterMismatch,		// A footer does not point back at its header, or disagrees on the size
+		EHeapState_Verify_PaddingMismatch,		// A block's right padding disagrees with the next block's left padding
+		EHeapState_Verify_BadLink,				// The next block is not directly after this block and its padding
+		EHeapState_Verify_BadFlags,				// A block is both free and queued for release, or free and purgeable
+		EHeapState_Verify_AdjacentFreeBlocks,	// Two free blocks are next to each other, they should have been merged
+		EHeapState_Verify_CounterMismatch,		// A full pass disagreed with the allocation counters
+		EHeapState_Verify_FreeTableMismatch,	// A free block is missing from the free block table, or its entry is out of date
+	};
+
+	//////////////////////////////////////////////////////////////////////////
+	// Settings for the optional background maintenance thread
+	// Each period the thread spends at most the budget releasing queued blocks
+	//////////////////////////////////////////////////////////////////////////
+	struct SMaintenanceSettings
+	{
+		DWORD_PTR m_uAffinityMask;		// CPU affinity mask for the thread, 0 leaves the OS default
+		u32 m_uPeriodMicroseconds;		// Length of one duty cycle
+		u32 m_uBudgetMicroseconds;		// Time the thread may spend working in each duty cycle
 	};
 
 
@@ -56,6 +94,8 @@ public:
 	void	Initialise(u32 uMemorySizeInBytes);
 
 	// Sets up the heap using memory already allocated to this program
+	// Every heap, however small, also takes a block start table from the OS, 4 bytes per 4KB page rounded up to a whole page,
+	// and registers in CPageMap, which never frees the 64KB leaf it creates for each 16MB of address space (8KB per 4MB on 32 bit)
 	void	Initialise(u8* pRawMemory, u32 uMemorySizeInBytes);
 
 	// Explicit shutdown - releases memory if it was claimed by this class, call before destructor
@@ -63,18 +103,141 @@ public:
 
 	// Allocates the specified size of memory, with the specified alignment
 	// and returns a pointer to it.
+	// Alignments of k_uMinOverAlignment and above search for the block wasting the least space to alignment
+	// If nothing fits, up to k_uMaxInlineReleases blocks queued for the maintenance thread are released first
 	void*	Allocate(u32 uNumBytes, u32 uAlignment = _PLATFORM_MIN_ALIGN);
 
+	static const u32 k_uMinOverAlignment = 64;
+
+	// Most queued blocks one allocation will release itself, in batches of k_uInlineReleaseBatch
+	static const u32 k_uMaxInlineReleases = 256;
+	static const u32 k_uInlineReleaseBatch = 32;
+
+	// Largest size plus alignment an allocation may ask for, so the block around it can't overflow a u32
+	static const u32 k_uMaxAllocationSize;
+
+	// How long an allocation is expected to live. Each is placed apart from the others, so the holes
+	// short lived allocations leave behind are not broken up by long lived ones
+	enum ELifetime
+	{
+		ELifetime_Transient,	// Request scoped, placed first fit from the bottom of the heap
+		ELifetime_Session,		// Placed from the top down, below the permanent allocations
+		ELifetime_Permanent,	// Lives until shutdown, placed from the very top of the heap
+		ELifetime_Count,
+	};
+
+	// Allocates with a lifetime hint. Allocate without a hint is the same as ELifetime_Transient
+	void*	Allocate(u32 uNumBytes, ELifetime eLifetime, u32 uAlignment = _PLATFORM_MIN_ALIGN);
+
+	struct SLifetimeStats
+	{
+		u32 m_uNumAllocations;
+		u32 m_uAllocatedBytes;			// Payload bytes held by allocations of this lifetime
+		u32 m_uSpanBytes;				// From the first header to the last footer of this lifetime's allocations
+		u32 m_uFreeBytesInSpan;			// Free blocks and padding inside the span, which these allocations fragment
+		u32 m_uNumHolesInSpan;			// Free blocks inside the span
+		u32 m_uOtherBytesInSpan;		// Payload bytes of other lifetimes' allocations inside the span
+	};
+
+	// Walks the heap to measure how tightly the allocations of one lifetime are packed
+	// Returns false if the heap is not initialised or the lifetime is not valid
+	bool	GetLifetimeStats(ELifetime eLifetime, SLifetimeStats& sStats);
+
+	// Keeps every free block's offset and size in a dense table outside the heap, so allocations scan
+	// the table rather than the header of every block. Falls back to walking the blocks if the table can't grow,
+	// setting EHeapState_FreeTable_Dropped
+	// Returns false if the heap is not initialised, or the memory for the table could not be found
+	bool	EnableFreeBlockTable(bool bEnable);
+
+	inline bool		IsFreeBlockTableEnabled() { return m_puFreeSegments != nullptr; };
+
+	// Called just before a purgeable allocation is evicted, with the heap locked
+	// Must not call back into the heap
+	typedef void (*PurgeCallback)(void* pMemory, void* pUserData);
+
+	// Allocates memory the heap may take back when an allocation would otherwise fail
+	// Lower priorities are purged first, then the least recently used. Deallocate as normal if not purged
+	void*	AllocatePurgeable(u32 uNumBytes, u32 uPriority, PurgeCallback pfnCallback, void* pUserData, u32 uAlignment = _PLATFORM_MIN_ALIGN);
+
+	// Marks a purgeable allocation as recently used, so it is purged later
+	void	TouchPurgeable(void* pMemory);
+
+	// Number of purgeable allocations currently held, and the number purged so far
+	inline u32		GetNumPurgeable() { return m_uNumPurgeable; };
+	inline u32		GetNumPurged() { return m_uNumPurged; };
+
 	// deallocates the memory pointed to by pMemory and returns it to the 
 	// free memory stored in the heap.
 	void 	Deallocate(void* pMemory);
 
+	// Deallocates with the size that was requested from Allocate. The footer is found from the size
+	// rather than the header, and a size which does not match the allocation is rejected
+	void 	Deallocate(void* pMemory, u32 uNumBytes);
+
+	// Returns true if the address is inside this heap's memory
+	inline bool		Owns(const void* pAddress) { return m_pMemory && (const u8*)pAddress >= m_pMemory && (const u8*)pAddress < m_pMemory + m_uMemorySize; };
+
+	// Returns the number of bytes usable in an allocation made by this heap
+	// 0 for pointers it does not own, pointers into the middle of an allocation, and freed allocations
+	u32		GetAllocationSize(void* pMemory);
+
+	// Returns the start of the allocation containing the address, nullptr if the address
+	// is not inside an allocation's bytes. Works for interior pointers
+	void*	FindBlockContaining(void* pAddress);
+
+	// Holds the heap lock across an outside operation, such as fork()
+	inline void		Lock() { m_HeapLock.lock(); };
+	inline void		Unlock() { m_HeapLock.unlock(); };
+
 	// get info about the current Heap state
 	inline u32		GetNumAllocs() { return m_uNumAllocations; };
 
+	// Bytes currently handed out, not counting headers, footers or padding
+	inline u32		GetAllocatedBytes() { return m_uMemorySize - m_uFreeSpace; };
+
+	// Caps the bytes which may be allocated at once, below the size of the heap. 0 removes the cap
+	inline void		SetByteLimit(u32 uByteLimit) { m_uByteLimit = uByteLimit; };
+
 	//Returns the freespace available, accounting for overheads
 	u32		GetFreeMemory();
 
+	// Starts a thread to coalesce and tidy deallocated blocks in the background
+	// While it is running, Deallocate only validates and queues the block
+	// Waits for the thread to apply its affinity mask, and stops it again if the mask can't be applied
+	void	StartMaintenanceThread(const SMaintenanceSettings& sSettings);
+
+	// Stops the maintenance thread, releasing anything still queued on the calling thread
+	void	StopMaintenanceThread();
+
+	// Releases every queued block on the calling thread
+	void	FlushMaintenance();
+
+	// Binds the heap to the calling thread. Deallocations from any other thread are then
+	// pushed to a lock free list, and released in a batch on the next Allocate
+	// Remote deallocations do not update GetLastError, unless the pointer fails validation and takes the lock
+	void	SetOwnerThread();
+
+	// Removes the owner, all deallocations take the heap lock again
+	void	ClearOwnerThread();
+
+	// Number of deallocated blocks waiting for the maintenance thread
+	// These are still counted as allocations until they have been released
+	inline u32		GetNumPendingReleases() { return m_uNumPendingReleases; };
+
+	// Checks up to uMaxBlocks blocks, carrying on from where the last call stopped
+	// Once a pass reaches the end of the heap, its totals are checked against the counters
+	// Returns false if corruption was found, the reason is in GetLastError, and the next call starts a new pass
+	bool	VerifyStep(u32 uMaxBlocks);
+
+	// Number of passes VerifyStep has completed without finding corruption
+	inline u32		GetNumVerifyPasses() { return m_uNumVerifyPasses; };
+
+	// Offset from the start of the heap of the block the last verify error was found at
+	inline u32		GetVerifyErrorOffset() { return m_uVerifyErrorOffset; };
+
+	// Attaches a sampling profiler, or detaches it if nullptr. Should be done before any allocations are made
+	inline void		SetProfiler(CHeapProfiler* pProfiler) { m_pProfiler = pProfiler; };
+
 	// Returns the outcome of the last operation
 	inline EHeapState GetLastError() { return m_ELastHeapError; };
 
@@ -82,6 +245,56 @@ public:
 	// Must be a power of two
 	u32 CalculateAlignmentDelta(void* pPointerToAlign, u32 uAlignment);
 
+	//////////////////////////////////////////////////////////////////////////
+	// Snapshot file layout: one SSnapshotHeader, then one SSnapshotBlock per block in address order
+	// Read by HeapSnapshotTool. Payloads are never written
+	//////////////////////////////////////////////////////////////////////////
+	static const u32 k_uSnapshotMagic = 0x4E53484D; //"MHSN"
+	static const u32 k_uSnapshotVersion = 1;
+
+	struct SSnapshotHeader
+	{
+		u32 m_uMagic;
+		u32 m_uVersion;
+		u32 m_uHeaderSize;				// sizeof(SBlockHeader) in the writing build
+		u32 m_uFooterSize;				// sizeof(SFooterBlock) in the writing build
+		u32 m_uHeapSize;
+		u32 m_uNumAllocations;
+		u32 m_uFreeSpace;
+		u32 m_uActualFreeSpace;
+	};
+
+	enum ESnapshotFlags
+	{
+		ESnapshotFlag_Free = 1 << 0,
+		ESnapshotFlag_PendingRelease = 1 << 1,
+		ESnapshotFlag_Purgeable = 1 << 2,
+		ESnapshotFlag_Sampled = 1 << 3,
+	};
+
+	struct SSnapshotBlock
+	{
+		u32 m_uOffset;					// Offset of the header from the start of the heap
+		u32 m_uBlockSize;				// Payload bytes
+		u32 m_uLeftPadding;
+		u32 m_uRightPadding;
+		u32 m_uFlags;					// ESnapshotFlags
+		u32 m_uAlignment;				// Largest power of two the payload address is a multiple of
+	};
+
+	// Receives a snapshot in chunks. Return false to abandon the snapshot
+	// Called with the heap locked, so must not call back into the heap
+	typedef bool (*SnapshotWriter)(const void* pData, u32 uNumBytes, void* pUserData);
+
+	// Streams the block layout through the writer from a fixed buffer on the stack, without allocating
+	// The heap stays locked until the last write returns, so a slow writer stalls every other thread using it
+	// Returns false if the heap is not initialised or the writer gave up
+	bool	Snapshot(SnapshotWriter pfnWrite, void* pUserData);
+
+	// Writes the block layout to a file with WriteFile, never allocating
+	// The heap is locked for the file writes. Returns false if the file could not be written
+	bool	Snapshot(const char* szFilename);
+
 	// Prints the current state of the managed memory in a friendly format
 	void Print();
 
@@ -94,7 +307,13 @@ private:
 	{
 		SBlockHeader* m_pSMemBlockNext;
 		u32 m_uBlockSize;
-		bool m_bIsFreeBlock;
+		//Bit fields keep the header at the size of its pointer, block size and paddings
+		bool m_bIsFreeBlock : 1;
+		bool m_bIsPendingRelease : 1; //Deallocated, but waiting on the maintenance thread to merge it
+		bool m_bIsPurgeable : 1; //Allocated with AllocatePurgeable, has an SPurgeableInfo at the end of the payload
+		bool m_bIsSampled : 1; //Tracked by the profiler, which must be told when it is released
+		u8 m_uLifetime : 2; //ELifetime the block was allocated with
+		std::atomic<bool> m_bIsRemoteFreed; //Claimed by a remote deallocation, any further deallocation is refused until it is reused
 		u32 m_LeftPadding;
 		u32 m_RightPadding;
 	};
@@ -105,21 +324,194 @@ private:
 		u32 m_uSizeOfBlock;
 	};
 
+	// Stored at the end of the payload of a purgeable block
+	struct SPurgeableInfo
+	{
+		SBlockHeader* m_pLRUPrev; //More recently used
+		SBlockHeader* m_pLRUNext; //Less recently used
+		PurgeCallback m_pfnPurge;
+		void* m_pUserData;
+		u32 m_uPriority;
+	};
+
+	// Smallest span which can hold a free block, gaps any smaller can only be padding
+	static const u32 k_uMinBlockSpan = sizeof(SBlockHeader) + sizeof(SFooterBlock) + _PLATFORM_MIN_ALIGN;
+
+	// One free hint per power of two alignment from k_uMinOverAlignment up
+	static const u32 k_uNumAlignmentHints = 26;
+
+	// Returned by the alignment calculations when an allocation does not fit a block, and by searches which find nothing
+	static const u32 k_uNoFit = 0xFFFFFFFF;
+
+	// Levels of the block start bitmap, each with a bit per 32 bit word of the one below
+	static const u32 k_uNumBlockStartBitLevels = 3;
+
+	// Entries in each segment of the free block table, whose offsets and capacities fill one page
+	static const u32 k_uFreeSegmentShift = 9;
+	static const u32 k_uFreeSegmentEntries = 1 << k_uFreeSegmentShift;
+
 	bool m_bSelfAllocatedMemory; //True if memory was allocated internally
 	u8* m_pMemory;
 	u32 m_uMemorySize;
 	u32 m_uFreeSpace;
 	u32 m_uActualFreeSpace;
 	u32 m_uNumAllocations;
+	u32 m_uByteLimit; //0 if there is no limit
 
 	SBlockHeader* m_pBlock; //First Block
 
 	EHeapState m_ELastHeapError;
 
+	std::mutex m_HeapLock; //Guards the blocks and counters against the maintenance thread
+
+	//Blocks waiting to be released, linked through their payload
+	SBlockHeader* m_pPendingReleaseHead;
+	SBlockHeader* m_pPendingReleaseTail;
+	u32 m_uNumPendingReleases;
+
+	std::thread m_MaintenanceThread;
+	std::condition_variable m_MaintenanceWake;
+	SMaintenanceSettings m_sMaintenanceSettings;
+	bool m_bMaintenanceRunning;
+	bool m_bMaintenanceStarting; //Set until the thread has applied its affinity mask
+	bool m_bStopMaintenance;
+
+	//Blocks deallocated by threads other than the owner, linked through their payload
+	std::atomic<SBlockHeader*> m_pRemoteFreeHead;
+	std::atomic<std::thread::id> m_OwnerThread; //Default id when the heap has no owner
+
+	//Purgeable blocks, most recently used first
+	SBlockHeader* m_pPurgeableHead;
+	SBlockHeader* m_pPurgeableTail;
+	u32 m_uNumPurgeable;
+	u32 m_uNumPurged;
+	u32 m_uPurgeableBytes; //Block sizes of the purgeable blocks, the most purging could give back
+
+	CHeapProfiler* m_pProfiler;
+
+	//Offset + 1 of the first header starting in each page of the heap, 0 if none does
+	//Lets an address be traced back to its block by walking from the start of its page
+	u32* m_puBlockStarts;
+	u32 m_uNumPages;
+
+	//A bit for each page with a block start, then a bit for each non zero word of the level below.
+	//Finds the closest earlier page with a block start in a few loads, however many pages a large block covers.
+	//Shares the block start table's allocation
+	u32* m_puBlockStartBits[k_uNumBlockStartBitLevels];
+
+	//Offset + 1 of a free block the last over-aligned allocation of each alignment left behind, 0 if none.
+	//May be stale, it is checked against the block start table before use
+	u32 m_uAlignedFreeHints[k_uNumAlignmentHints];
+
+	//Offset of the lowest permanent allocation still held, m_uMemorySize if none.
+	//Session allocations are placed below it
+	u32 m_uPermanentFloor;
+
+	//Free block table, sorted by offset and split into segments, so adding or removing an entry only moves
+	//the rest of its segment. Each segment holds its offsets, then their capacities: the block size plus
+	//right padding, which is what an allocation can use without the left padding.
+	//An entry's index is its segment's position in the order << k_uFreeSegmentShift, plus its slot.
+	//The segments, their order and their counts share one allocation of pages
+	u32* m_puFreeSegments;
+	u32* m_puFreeSegmentOrder; //Segments in address order. The first m_uNumUsedSegments hold entries, the rest are spare
+	u32* m_puFreeSegmentCounts; //Entries in each segment
+	u32 m_uNumUsedSegments;
+	u32 m_uNumTableSegments;
+	u32 m_uNumFreeEntries;
+
+	//Incremental verification. Blocks with headers before the cursor have been checked this pass,
+	//and the totals for them are kept up to date as blocks are allocated, released, split and merged
+	u32 m_uVerifyCursor;
+	u32 m_uVerifyNumBlocks;
+	u32 m_uVerifyNumAllocations;
+	u32 m_uVerifyAllocatedBytes;
+	u32 m_uNumVerifyPasses;
+	u32 m_uVerifyErrorOffset;
+
 	/////////////////////////////////////////////////
 	//  PRIVATE FUNCTIONS                         //
 	/////////////////////////////////////////////////
 
+	// Finds, positions and marks a block for the allocation, purging if required. Lock must already be held
+	// Returns the header of the allocated block, nullptr on failure
+	SBlockHeader* AllocateBlock(u32 uNumBytes, u32 uAlignment, ELifetime eLifetime);
+
+	// Rounds an allocation size up to the size of the block which will hold it
+	u32 RoundAllocationSize(u32 uNumBytes);
+
+	// Validates, then releases or queues a block being deallocated. Lock must already be held
+	void DeallocateBlock(SBlockHeader* pHeader);
+
+	// Checks a header found from a caller's pointer really starts a block, before anything is written to it
+	bool IsBlockStart(SBlockHeader* pHeader);
+
+	// Checks the header's size keeps its footer inside the heap, and the footer points back at it
+	// Neither changes while a block is allocated, so this is safe without the lock
+	bool HasMatchingFooter(SBlockHeader* pHeader);
+
+	// Records a header in the block start table
+	void AddBlockStart(SBlockHeader* pHeader);
+
+	// Removes a header which no longer exists from the block start table
+	// pNextHeader is the first header after it which still exists
+	void RemoveBlockStart(SBlockHeader* pOldHeader, SBlockHeader* pNextHeader);
+
+	// Finds the header of the block whose header, payload, footer or trailing padding holds the address
+	SBlockHeader* FindBlockHeader(u8* pAddress);
+
+	// Sets or clears a page's bit in the block start bitmap, and the bits above it which summarise it
+	void SetBlockStartBit(u32 uPage, bool bHasBlockStart);
+
+	// Returns the closest page at or before uPage with a block start, k_uNoFit if there is none
+	u32 FindBlockStartPage(u32 uPage);
+
+	// Checks one block against its footer and the next block, returns EHeapError_Ok if consistent
+	EHeapState VerifyBlock(SBlockHeader* pBlock);
+
+	// Discards the totals of the current verify pass, the next step starts from the first block
+	void ResetVerifyPass();
+
+	// Adds a free block to the free block table, if enabled. Drops the table if it can't grow
+	void AddFreeBlock(SBlockHeader* pHeader);
+
+	// Removes a block which is no longer free from the free block table, if enabled
+	// Merges sparse segments, and gives pages back once most segments are spare
+	void RemoveFreeBlock(SBlockHeader* pHeader);
+
+	// Moves the free block table to a new allocation of uNumSegments, returns false if it could not be found
+	// The entries are kept, and the table is freed if uNumSegments is 0
+	bool ResizeFreeBlockTable(u32 uNumSegments);
+
+	// Moves the top half of a full segment into a spare segment placed after it
+	void SplitFreeSegment(u32 uPosition);
+
+	// Moves the entries of the segment after uPosition onto the end of it, and makes the emptied segment spare
+	void MergeFreeSegments(u32 uPosition);
+
+	// Makes the empty segment at a position spare
+	void ReleaseFreeSegment(u32 uPosition);
+
+	// Returns the offsets of the segment at a position in the order, its capacities follow k_uFreeSegmentEntries later
+	u32* GetFreeSegment(u32 uPosition);
+
+	// Returns the position of the segment an offset belongs in: the last which starts at or before it, else the first
+	u32 FindFreeSegment(u32 uOffset);
+
+	// Returns the index of the first free table entry at or after the offset, k_uNoFit if none
+	u32 FindFreeTableIndex(u32 uOffset);
+
+	// Returns the index of the entry before uIndex, the last entry if uIndex is k_uNoFit, k_uNoFit if there is none
+	u32 GetPreviousFreeTableIndex(u32 uIndex);
+
+	// Returns the offset of the free block at an index
+	u32 GetFreeTableOffset(u32 uIndex);
+
+	// Returns the capacity of the free block at an index
+	u32 GetFreeTableCapacity(u32 uIndex);
+
+	// Returns the index of the first free table entry from uFirst with at least the capacity, k_uNoFit if none
+	u32 ScanFreeTable(u32 uFirst, u32 uMinCapacity);
+
 	// Validates if a pointer is alligned to min platform alignment
 	bool IsAligned(u8* pRawMemory);
 
@@ -142,7 +534,25 @@ private:
 	// Itterate through the blocks, checking for a block which is free,matches our allignment, and could be large enough to allocate to
 	// The block may not currently be of the corect size, but reclaiming padding will meet the requirements
 	// Returns pointer to first block which satisfies the criteria, nullptr otherwise
-	SBlockHeader* FindFreeBlock(u32 uSizeOfBlockToFind, u32 uAlignment);
+	SBlockHeader* FindFreeBlock(u32 uSizeOfBlockToFind, u32 uAlignment, ELifetime eLifetime);
+
+	// Walks back from pStartBlock for the first free block an allocation fits at the top of, nullptr if none
+	SBlockHeader* FindFreeBlockFromTop(u32 uSizeOfBlockToFind, u32 uAlignment, SBlockHeader* pStartBlock);
+
+	// Finds the free block an over-aligned allocation would waste the least space in, trying the alignment's hint first
+	// Stops at the first block which wastes nothing, returns nullptr if no block is large enough
+	SBlockHeader* FindAlignedFreeBlock(u32 uSizeOfBlockToFind, u32 uAlignment);
+
+	// Returns the gap between the start of a free block's memory and the header of an allocation placed in it,
+	// or k_uNoFit if it does not fit. The block's padding on both sides counts towards the space available
+	// Placed as low as alignment allows, or as high if bFromTop
+	u32 CalculateLeadingGap(SBlockHeader* pBlock, u32 uSizeOfBlockToFind, u32 uAlignment, bool bFromTop);
+
+	// Returns the bytes an allocation placed in a free block would leave as padding, or k_uNoFit if it does not fit
+	u32 CalculateAlignmentWaste(SBlockHeader* pBlock, u32 uSizeOfBlockToFind, u32 uAlignment);
+
+	// Returns the free hint slot for an alignment of k_uMinOverAlignment or more
+	u32& GetAlignedFreeHint(u32 uAlignment);
 
 	// Validates if a given unsigned interger is a power of two
 	bool IsPowerOfTwo(u32 uNumberToTest);
@@ -152,8 +562,9 @@ private:
 	bool IsBlockViable(SBlockHeader* pBlockToCheck, u32 uSizeOfBlockToFind, u32 uAlignment);
 
 	// Moves the position of the header to correct allignment, reclaiming or adding padding if required
+	// A leading gap large enough to hold a block is split off as a free block instead of becoming padding
 	// WILL CHANGE THE ADDRESS OF THE POINTER, therefore the varible itself is passed by reference
-	void AdjustBlockPositionForPadding(u32 uAlignment, SBlockHeader*& pBlockToAllocateTo);
+	void AdjustBlockPositionForPadding(u32 uNumBytes, u32 uAlignment, bool bFromTop, SBlockHeader*& pBlockToAllocateTo);
 
 	// Evaluates the free space after our allocation, and if the space is large enough,
 	// encapsulating it with a header and footer. If not, the data is marked as padding to be reclaimed later
@@ -161,6 +572,65 @@ private:
 
 	// Given a start and endpoint of a block, merge with neighbouring blocks and padding
 // Pointer addresses will be changed to point at the start and end of the coalesced block
+	// The block's payload must already be tidied, only the headers, footers and padding taken in are overwritten
 	void MergeWithNearbyBlocks(u8*& pMergeStartPoint, u8*& pMergeEndPoint);
+
+	// Compares the padding and footer of a block being deallocated against its neighbours
+	// Sets the last error if an overwrite is detected
+	void CheckBlockIntegrity(SBlockHeader* pHeader);
+
+	// Marks a block as free, updates the counters and coalesces it with its neighbours
+	// bPayloadTidied skips overwriting the payload, for blocks tidied before the lock was taken
+	void ReleaseBlock(SBlockHeader* pHeader, bool bPayloadTidied);
+
+	// Moves the permanent floor up to the first permanent allocation from pStartBlock, or the end of the heap
+	void RaisePermanentFloor(SBlockHeader* pStartBlock);
+
+	// Overwrites the payload of a block being released, if TIDYDATA is defined
+	void TidyPayload(SBlockHeader* pHeader);
+
+	// Adds a deallocated block to the end of the pending release list
+	void PushPendingRelease(SBlockHeader* pHeader);
+
+	// Removes the first block from the pending release list, nullptr if empty
+	SBlockHeader* PopPendingRelease();
+
+	// Releases every block on the pending release list. Lock must already be held
+	void ReleaseAllPending();
+
+	// Releases up to uMaxBlocks from the front of the pending release list. Lock must already be held
+	void ReleasePending(u32 uMaxBlocks);
+
+	// Pushes a block deallocated by a non owner thread to the remote free list, without locking
+	// Returns false if the block could not be validated without the lock, so the caller must take the locked path
+	bool PushRemoteFree(SBlockHeader* pHeader);
+
+	// Takes every block from the remote free list and releases or queues it. Lock must already be held
+	void DrainRemoteFrees();
+
+	// Gets the purgeable info stored at the end of a purgeable block
+	SPurgeableInfo* GetPurgeableInfo(SBlockHeader* pHeader);
+
+	// Adds a purgeable block as the most recently used
+	void LinkPurgeable(SBlockHeader* pHeader);
+
+	// Removes a block from the purgeable list, it is then an ordinary allocation
+	void UnlinkPurgeable(SBlockHeader* pHeader);
+
+	// Picks the purgeable block to evict for an allocation. Blocks whose release would open a large enough hole come first,
+	// then blocks next to free space, then the rest. Within each, lowest priority then least recently used
+	// Blocks another thread has already freed are skipped. Returns nullptr if there is nothing to purge
+	SBlockHeader* ChoosePurgeVictim(u32 uNumBytes, u32 uAlignment);
+
+	// Notifies the owner of a purgeable block and releases it
+	// Returns false, leaving the block alone, if it is nullptr or another thread has queued it as a remote free
+	bool PurgeBlock(SBlockHeader* pHeader);
+
+	// Returns true if purging every purgeable block would leave enough free space for the allocation
+	// Does not account for fragmentation, so purging may still not open a large enough hole
+	bool CouldPurgeFit(u32 uNumBytes);
+
+	// Entry point for the maintenance thread
+	void MaintenanceThreadMain();
 };
 #endif // #ifndef _MANAGEDHEAP_H_
\ No newline at end of file
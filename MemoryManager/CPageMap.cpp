@@ -0,0 +1,186 @@
+#include "pch.h"
+#include "CPageMap.h"
+
+std::atomic<CPageMap::SMidNode*> CPageMap::s_pRoot[1 << CPageMap::k_uRootBits];
+std::mutex CPageMap::s_MapLock;
+
+
+//////////////////////////////////////////////////////////////////////////
+// Maps every page of a heap's memory to the heap
+// Every page is checked before any are written, so a failed registration leaves the map unchanged
+//////////////////////////////////////////////////////////////////////////
+bool CPageMap::Register(CManagedHeap* pHeap, u8* pMemory, u32 uSizeInBytes)
+{
+	uintptr_t uStart = (uintptr_t)pMemory;
+	uintptr_t uLast = uStart + uSizeInBytes - 1;
+	if (uSizeInBytes == 0 || uLast < uStart || (uLast >> (k_uAddressBits - 1)) >> 1)
+	{
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(s_MapLock);
+
+	uintptr_t uFirstPage = uStart >> k_uPageShift;
+	uintptr_t uLastPage = uLast >> k_uPageShift;
+	bool bStartsInsidePage = (uStart & (k_uPageSize - 1)) != 0;
+
+	for (uintptr_t uPage = uFirstPage; uPage <= uLastPage; uPage++)
+	{
+		SPageEntry* pEntry = FindOrCreateEntry(uPage);
+		if (!pEntry)
+		{
+			return false;
+		}
+
+		std::atomic<CManagedHeap*>& pSlot = (uPage == uFirstPage && bStartsInsidePage) ? pEntry->m_pNextHeap : pEntry->m_pHeap;
+		if (pSlot.load(std::memory_order_relaxed))
+		{
+			return false;
+		}
+	}
+
+	for (uintptr_t uPage = uFirstPage; uPage <= uLastPage; uPage++)
+	{
+		SPageEntry* pEntry = FindEntry(uPage);
+		std::atomic<CManagedHeap*>& pSlot = (uPage == uFirstPage && bStartsInsidePage) ? pEntry->m_pNextHeap : pEntry->m_pHeap;
+		pSlot.store(pHeap, std::memory_order_release);
+	}
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Removes a heap's pages from the map
+// The nodes are kept, heaps are usually recreated over the same addresses
+//////////////////////////////////////////////////////////////////////////
+void CPageMap::Unregister(CManagedHeap* pHeap, u8* pMemory, u32 uSizeInBytes)
+{
+	if (uSizeInBytes == 0)
+	{
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(s_MapLock);
+
+	uintptr_t uFirstPage = (uintptr_t)pMemory >> k_uPageShift;
+	uintptr_t uLastPage = ((uintptr_t)pMemory + uSizeInBytes - 1) >> k_uPageShift;
+
+	for (uintptr_t uPage = uFirstPage; uPage <= uLastPage; uPage++)
+	{
+		SPageEntry* pEntry = FindEntry(uPage);
+		if (!pEntry)
+		{
+			continue;
+		}
+		if (pEntry->m_pHeap.load(std::memory_order_relaxed) == pHeap)
+		{
+			pEntry->m_pHeap.store(nullptr, std::memory_order_release);
+		}
+		if (pEntry->m_pNextHeap.load(std::memory_order_relaxed) == pHeap)
+		{
+			pEntry->m_pNextHeap.store(nullptr, std::memory_order_release);
+		}
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Returns the heap whose memory contains the address, nullptr if no registered heap does
+//////////////////////////////////////////////////////////////////////////
+CManagedHeap* CPageMap::FindHeap(const void* pAddress)
+{
+	uintptr_t uAddress = (uintptr_t)pAddress;
+	if ((uAddress >> (k_uAddressBits - 1)) >> 1)
+	{
+		return nullptr;
+	}
+
+	SPageEntry* pEntry = FindEntry(uAddress >> k_uPageShift);
+	if (!pEntry)
+	{
+		return nullptr;
+	}
+
+	//Either heap may end or start part way through the page, so the range is checked as well
+	CManagedHeap* pHeap = pEntry->m_pNextHeap.load(std::memory_order_acquire);
+	if (pHeap && pHeap->Owns(pAddress))
+	{
+		return pHeap;
+	}
+	pHeap = pEntry->m_pHeap.load(std::memory_order_acquire);
+	if (pHeap && pHeap->Owns(pAddress))
+	{
+		return pHeap;
+	}
+	return nullptr;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Reserves zeroed memory straight from the OS, for tables which must not come from malloc
+//////////////////////////////////////////////////////////////////////////
+void* CPageMap::AllocatePages(size_t uSizeInBytes)
+{
+	return VirtualAlloc(nullptr, uSizeInBytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Returns memory from AllocatePages to the OS
+//////////////////////////////////////////////////////////////////////////
+void CPageMap::FreePages(void* pPages)
+{
+	if (pPages)
+	{
+		VirtualFree(pPages, 0, MEM_RELEASE);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Returns the entry for a page, nullptr if it has never been mapped
+//////////////////////////////////////////////////////////////////////////
+CPageMap::SPageEntry* CPageMap::FindEntry(uintptr_t uPage)
+{
+	SMidNode* pMid = s_pRoot[uPage >> (k_uMidBits + k_uLeafBits)].load(std::memory_order_acquire);
+	if (!pMid)
+	{
+		return nullptr;
+	}
+
+	SLeafNode* pLeaf = pMid->m_pLeaves[(uPage >> k_uLeafBits) & ((1 << k_uMidBits) - 1)].load(std::memory_order_acquire);
+	if (!pLeaf)
+	{
+		return nullptr;
+	}
+
+	return &pLeaf->m_sEntries[uPage & ((1 << k_uLeafBits) - 1)];
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Returns the entry for a page, creating the nodes leading to it if required. Map lock must be held
+// Nodes come zeroed from the OS, which is a valid empty node, and are published after they are ready
+//////////////////////////////////////////////////////////////////////////
+CPageMap::SPageEntry* CPageMap::FindOrCreateEntry(uintptr_t uPage)
+{
+	std::atomic<SMidNode*>& pMidSlot = s_pRoot[uPage >> (k_uMidBits + k_uLeafBits)];
+	SMidNode* pMid = pMidSlot.load(std::memory_order_relaxed);
+	if (!pMid)
+	{
+		pMid = (SMidNode*)AllocatePages(sizeof(SMidNode));
+		if (!pMid)
+		{
+			return nullptr;
+		}
+		pMidSlot.store(pMid, std::memory_order_release);
+	}
+
+	std::atomic<SLeafNode*>& pLeafSlot = pMid->m_pLeaves[(uPage >> k_uLeafBits) & ((1 << k_uMidBits) - 1)];
+	SLeafNode* pLeaf = pLeafSlot.load(std::memory_order_relaxed);
+	if (!pLeaf)
+	{
+		pLeaf = (SLeafNode*)AllocatePages(sizeof(SLeafNode));
+		if (!pLeaf)
+		{
+			return nullptr;
+		}
+		pLeafSlot.store(pLeaf, std::memory_order_release);
+	}
+
+	return &pLeaf->m_sEntries[uPage & ((1 << k_uLeafBits) - 1)];
+}
@@ -0,0 +1,78 @@
+#ifndef _PAGEMAP_H_
+#define _PAGEMAP_H_
+
+#include "CManagedHeap.h"
+
+//////////////////////////////////////////////////////////////////////////
+// Process wide radix map from page number to the heap which owns the page
+// Every CManagedHeap registers its memory when initialised, so any address can be
+// traced back to its heap in three loads, whichever of several heaps it came from.
+// A page may be shared by two heaps: one covering its start, one starting inside it.
+//////////////////////////////////////////////////////////////////////////
+class CPageMap
+{
+public:
+	static const u32 k_uPageShift = 12;
+	static const u32 k_uPageSize = 1 << k_uPageShift;
+
+	// Maps every page of a heap's memory to the heap
+	// Returns false if the memory is outside the mapped address range, or shares a page with two other heaps
+	static bool		Register(CManagedHeap* pHeap, u8* pMemory, u32 uSizeInBytes);
+
+	// Removes a heap's pages from the map
+	static void		Unregister(CManagedHeap* pHeap, u8* pMemory, u32 uSizeInBytes);
+
+	// Returns the heap whose memory contains the address, nullptr if no registered heap does
+	static CManagedHeap*	FindHeap(const void* pAddress);
+
+	// Reserves zeroed memory straight from the OS, for tables which must not come from malloc
+	static void*	AllocatePages(size_t uSizeInBytes);
+
+	// Returns memory from AllocatePages to the OS
+	static void		FreePages(void* pPages);
+
+private:
+
+	// Bits of the page number resolved by each level, the root takes whatever is left
+#if INTPTR_MAX > 0xFFFFFFFF
+	static const u32 k_uAddressBits = 48;
+	static const u32 k_uLeafBits = 12;
+	static const u32 k_uMidBits = 12;
+#else
+	static const u32 k_uAddressBits = 32;
+	static const u32 k_uLeafBits = 10;
+	static const u32 k_uMidBits = 10;
+#endif
+	static const u32 k_uRootBits = k_uAddressBits - k_uPageShift - k_uLeafBits - k_uMidBits;
+
+	struct SPageEntry
+	{
+		std::atomic<CManagedHeap*> m_pHeap; //Heap covering the first byte of the page
+		std::atomic<CManagedHeap*> m_pNextHeap; //Heap starting part way through the page
+	};
+
+	struct SLeafNode
+	{
+		SPageEntry m_sEntries[1 << k_uLeafBits];
+	};
+
+	struct SMidNode
+	{
+		std::atomic<SLeafNode*> m_pLeaves[1 << k_uMidBits];
+	};
+
+	static std::atomic<SMidNode*> s_pRoot[1 << k_uRootBits];
+	static std::mutex s_MapLock; //Serialises registration, lookups never lock
+
+	/////////////////////////////////////////////////
+	//  PRIVATE FUNCTIONS                         //
+	/////////////////////////////////////////////////
+
+	// Returns the entry for a page, nullptr if it has never been mapped
+	static SPageEntry* FindEntry(uintptr_t uPage);
+
+	// Returns the entry for a page, creating the nodes leading to it if required. Map lock must be held
+	static SPageEntry* FindOrCreateEntry(uintptr_t uPage);
+};
+
+#endif // #ifndef _PAGEMAP_H_
@@ -4,7 +4,26 @@
 #include <stdio.h>
 #include <tchar.h>
 #include <windows.h>
+#include <psapi.h>
+#include <intrin.h>
 #include <iostream>
 #include <iomanip>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <atomic>
+#include <vector>
+#include <unordered_map>
+#include <fstream>
+#include <cmath>
+#include <cstdarg>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define MANAGEDHEAP_SSE2 1
+#else
+#define MANAGEDHEAP_SSE2 0
+#endif
 
 #endif //PCH_H
@@ -0,0 +1,91 @@
+#include "pch.h"
+#include <string.h>
+#include "TestHarness.h"
+
+//////////////////////////////////////////////////////////////////////////
+// Runs the heap's regression tests
+//
+//   MemoryManagerTests              Runs every suite
+//   MemoryManagerTests <suite>      Runs the suites whose name contains the argument
+//
+// Returns the number of failed checks, so 0 means everything passed
+//////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+	struct STestSuite
+	{
+		const char* m_szName;
+		void (*m_pfnRun)();
+	};
+
+	const STestSuite k_sSuites[] =
+	{
+		{ "Maintenance", TestMaintenance },
+		{ "RemoteFree", TestRemoteFree },
+		{ "PurgePolicy", TestPurgePolicy },
+		{ "SizeLimits", TestSizeLimits },
+		{ "PageMap", TestPageMap },
+		{ "VerifyStep", TestVerifyStep },
+		{ "Lifetimes", TestLifetimes },
+		{ "FreeBlockTable", TestFreeBlockTable },
+		{ "EpochReclaimer", TestEpochReclaimer },
+		{ "HeapProfiler", TestHeapProfiler },
+		{ "MallocShim", TestMallocShim },
+		{ "HeapRegistry", TestHeapRegistry },
+		{ "Snapshot", TestSnapshot },
+		{ "AlignedPlacement", TestAlignedPlacement },
+	};
+
+	u32 s_uNumFailures = 0;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Counts and prints a failed check
+//////////////////////////////////////////////////////////////////////////
+void TestCheck(bool bCondition, const char* szCondition, const char* szFile, int iLine)
+{
+	if (!bCondition)
+	{
+		s_uNumFailures++;
+		printf("    FAILED %s(%d): %s\n", szFile, iLine, szCondition);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Runs VerifyStep until a whole pass of the heap completes. Returns false if it finds corruption
+//////////////////////////////////////////////////////////////////////////
+bool VerifyWholeHeap(CManagedHeap& heap)
+{
+	u32 uPasses = heap.GetNumVerifyPasses();
+	while (heap.GetNumVerifyPasses() == uPasses)
+	{
+		if (!heap.VerifyStep(4096))
+		{
+			printf("    verify failed with error %d at offset %u\n", heap.GetLastError(), heap.GetVerifyErrorOffset());
+			return false;
+		}
+	}
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	const char* szFilter = argc > 1 ? argv[1] : nullptr;
+
+	for (const STestSuite& sSuite : k_sSuites)
+	{
+		if (szFilter && !strstr(sSuite.m_szName, szFilter))
+		{
+			continue;
+		}
+
+		u32 uFailuresBefore = s_uNumFailures;
+		printf("%s\n", sSuite.m_szName);
+		sSuite.m_pfnRun();
+		printf("    %s\n", s_uNumFailures == uFailuresBefore ? "passed" : "FAILED");
+	}
+
+	printf("%u failed checks\n", s_uNumFailures);
+	return (int)s_uNumFailures;
+}
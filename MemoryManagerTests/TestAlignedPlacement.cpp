@@ -0,0 +1,213 @@
+#include "pch.h"
+#include <random>
+#include <string>
+#include "TestHarness.h"
+#include "SnapshotAnalysis.h"
+
+//////////////////////////////////////////////////////////////////////////
+// Where over-aligned allocations are placed, and the padding they leave
+//////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+	bool AppendToString(const void* pData, u32 uNumBytes, void* pUserData)
+	{
+		((std::string*)pUserData)->append((const char*)pData, uNumBytes);
+		return true;
+	}
+
+	// Takes a snapshot of the heap straight into memory
+	SSnapshot TakeSnapshot(CManagedHeap& heap)
+	{
+		std::string streamed;
+		TEST_CHECK(heap.Snapshot(AppendToString, &streamed));
+
+		SSnapshot sSnapshot = {};
+		memcpy(&sSnapshot.m_sHeader, streamed.data(), sizeof(SSnapshotHeader));
+		sSnapshot.m_Blocks.resize((streamed.size() - sizeof(SSnapshotHeader)) / sizeof(SSnapshotBlock));
+		memcpy(sSnapshot.m_Blocks.data(), streamed.data() + sizeof(SSnapshotHeader), sSnapshot.m_Blocks.size() * sizeof(SSnapshotBlock));
+		return sSnapshot;
+	}
+
+	// Smallest gap which could have been a free block of its own
+	u32 GetMinBlockSpan(const SSnapshot& sSnapshot)
+	{
+		return sSnapshot.m_sHeader.m_uHeaderSize + sSnapshot.m_sHeader.m_uFooterSize + _PLATFORM_MIN_ALIGN;
+	}
+
+	// No gap between two blocks is large enough to have held a free block
+	bool IsPaddingMinimal(const SSnapshot& sSnapshot)
+	{
+		u32 uMinBlockSpan = GetMinBlockSpan(sSnapshot);
+		for (const SSnapshotBlock& sBlock : sSnapshot.m_Blocks)
+		{
+			if (sBlock.m_uLeftPadding >= uMinBlockSpan)
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// A large alignment after a small allocation leaves a leading gap, which becomes a free block rather than padding
+	// and is used by the next allocation small enough to fit in it
+	void TestLeadingGapSplit()
+	{
+		CManagedHeap heap;
+		heap.Initialise(1 << 20);
+
+		void* pSmall = heap.Allocate(40);
+		void* pAligned = heap.Allocate(1000, 4096);
+		TEST_CHECK(pAligned != nullptr && ((uintptr_t)pAligned & 4095) == 0);
+
+		SSnapshot sSnapshot = TakeSnapshot(heap);
+		TEST_CHECK(IsPaddingMinimal(sSnapshot));
+		TEST_CHECK(sSnapshot.m_Blocks.size() >= 3);
+		TEST_CHECK(IsFreeBlock(sSnapshot.m_Blocks[1]));
+
+		//Fits in the gap, so goes before the aligned block rather than after it
+		void* pFiller = heap.Allocate(100);
+		TEST_CHECK(pFiller > pSmall && pFiller < pAligned);
+
+		heap.Deallocate(pSmall);
+		heap.Deallocate(pAligned);
+		heap.Deallocate(pFiller);
+		TEST_CHECK(VerifyWholeHeap(heap));
+		heap.Shutdown();
+	}
+
+	// Runs of cache line and page aligned buffers pack together, losing less than a block's overhead to each
+	void TestPacking()
+	{
+		const u32 k_uNumBlocks = 200;
+
+		u32 uAlignments[] = { 64, 256, 4096 };
+		for (u32 uAlignment : uAlignments)
+		{
+			CManagedHeap heap;
+			heap.Initialise(1 << 22);
+
+			std::vector<void*> blocks;
+			for (u32 i = 0; i < k_uNumBlocks; i++)
+			{
+				void* pMemory = heap.Allocate(uAlignment, uAlignment);
+				TEST_CHECK(pMemory != nullptr && ((uintptr_t)pMemory & (uAlignment - 1)) == 0);
+				blocks.push_back(pMemory);
+			}
+
+			SSnapshot sSnapshot = TakeSnapshot(heap);
+			SSnapshotSummary sSummary = Summarise(sSnapshot);
+			TEST_CHECK(IsPaddingMinimal(sSnapshot));
+			TEST_CHECK(sSummary.m_uPaddingBytes < (unsigned long long)k_uNumBlocks * GetMinBlockSpan(sSnapshot));
+
+			//Each buffer takes one aligned slot, plus one more when its header doesn't fit in the slack of the one before
+			unsigned long long uSpan = (unsigned long long)((u8*)blocks.back() - (u8*)blocks.front()) / (k_uNumBlocks - 1);
+			TEST_CHECK(uSpan <= 2ull * uAlignment);
+
+			for (void* pMemory : blocks)
+			{
+				heap.Deallocate(pMemory);
+			}
+			TEST_CHECK(VerifyWholeHeap(heap));
+			heap.Shutdown();
+		}
+	}
+
+	// Holes left behind by blocks of other sizes are taken only where alignment wastes nothing,
+	// so refilling them adds no padding to the heap
+	void TestLeastWaste()
+	{
+		const u32 k_uAlignment = 256;
+		const u32 k_uNumBlocks = 64;
+
+		CManagedHeap heap;
+		heap.Initialise(1 << 20);
+
+		std::vector<void*> unaligned;
+		std::vector<void*> aligned;
+		for (u32 i = 0; i < k_uNumBlocks; i++)
+		{
+			unaligned.push_back(heap.Allocate(k_uAlignment + 100 + i * 4));
+			aligned.push_back(heap.Allocate(k_uAlignment, k_uAlignment));
+		}
+		unsigned long long uPaddingBefore = Summarise(TakeSnapshot(heap)).m_uPaddingBytes;
+
+		for (u32 i = 0; i < k_uNumBlocks; i += 2)
+		{
+			heap.Deallocate(unaligned[i]);
+			heap.Deallocate(aligned[i]);
+			unaligned[i] = nullptr;
+			aligned[i] = nullptr;
+		}
+
+		std::vector<void*> refilled;
+		for (u32 i = 0; i < k_uNumBlocks / 2; i++)
+		{
+			void* pMemory = heap.Allocate(k_uAlignment, k_uAlignment);
+			TEST_CHECK(pMemory != nullptr);
+			refilled.push_back(pMemory);
+		}
+		SSnapshot sSnapshot = TakeSnapshot(heap);
+		TEST_CHECK(IsPaddingMinimal(sSnapshot));
+		TEST_CHECK(Summarise(sSnapshot).m_uPaddingBytes <= uPaddingBefore);
+		TEST_CHECK(VerifyWholeHeap(heap));
+
+		for (void* pMemory : refilled)
+		{
+			heap.Deallocate(pMemory);
+		}
+		for (u32 i = 0; i < k_uNumBlocks; i++)
+		{
+			heap.Deallocate(unaligned[i]);
+			heap.Deallocate(aligned[i]);
+		}
+
+		SSnapshotSummary sSummary = Summarise(TakeSnapshot(heap));
+		TEST_CHECK(sSummary.m_uNumBlocks == 1 && sSummary.m_uPaddingBytes == 0);
+		heap.Shutdown();
+	}
+
+	// Mixed alignments and sizes, released at random, never leave a gap which could have been a block
+	void TestMixedAlignments()
+	{
+		CManagedHeap heap;
+		heap.Initialise(1 << 22);
+
+		std::mt19937 random(5);
+		std::vector<void*> blocks;
+		for (u32 i = 0; i < 20000; i++)
+		{
+			if (blocks.size() < 1000 && random() % 3)
+			{
+				u32 uAlignment = 4u << (random() % 11);
+				void* pMemory = heap.Allocate(8 + random() % 2000, uAlignment);
+				TEST_CHECK(pMemory != nullptr && ((uintptr_t)pMemory & (uAlignment - 1)) == 0);
+				blocks.push_back(pMemory);
+			}
+			else if (!blocks.empty())
+			{
+				u32 uIndex = random() % blocks.size();
+				heap.Deallocate(blocks[uIndex]);
+				blocks[uIndex] = blocks.back();
+				blocks.pop_back();
+			}
+		}
+
+		TEST_CHECK(IsPaddingMinimal(TakeSnapshot(heap)));
+		TEST_CHECK(VerifyWholeHeap(heap));
+		for (void* pMemory : blocks)
+		{
+			heap.Deallocate(pMemory);
+		}
+		TEST_CHECK(heap.GetNumAllocs() == 0);
+		heap.Shutdown();
+	}
+}
+
+void TestAlignedPlacement()
+{
+	TestLeadingGapSplit();
+	TestPacking();
+	TestLeastWaste();
+	TestMixedAlignments();
+}
@@ -0,0 +1,276 @@
+#include "pch.h"
+#include "TestHarness.h"
+#include "CEpochReclaimer.h"
+
+//////////////////////////////////////////////////////////////////////////
+// Deferred reclamation with CEpochReclaimer
+//////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+	// Retires from one slot until the epoch has moved at least two past uEpoch, or can't move any further
+	void AdvancePast(CEpochReclaimer& reclaimer, CManagedHeap& heap, u32 uThread, u32 uEpoch)
+	{
+		for (u32 i = 0; i < 16 && reclaimer.GetEpoch() - uEpoch < 2; i++)
+		{
+			reclaimer.Enter(uThread);
+			for (u32 j = 0; j < CEpochReclaimer::k_uAdvanceThreshold; j++)
+			{
+				reclaimer.Retire(uThread, heap.Allocate(16));
+			}
+			reclaimer.Leave(uThread);
+		}
+		reclaimer.Enter(uThread);
+		reclaimer.Leave(uThread);
+	}
+
+	void TestInitialise()
+	{
+		CManagedHeap heap;
+		heap.Initialise(1 << 20);
+		CEpochReclaimer reclaimer;
+
+		TEST_CHECK(reclaimer.RegisterThread() == CEpochReclaimer::k_uInvalidThread);
+		TEST_CHECK(reclaimer.GetLastError() == CEpochReclaimer::EEpochState_Init_NotInitialised);
+
+		reclaimer.Initialise(nullptr);
+		TEST_CHECK(reclaimer.GetLastError() == CEpochReclaimer::EEpochState_Init_NullHeap);
+
+		reclaimer.Initialise(&heap, 0);
+		TEST_CHECK(reclaimer.GetLastError() == CEpochReclaimer::EEpochState_Init_UnableToAquireMemory);
+
+		reclaimer.Initialise(&heap);
+		TEST_CHECK(reclaimer.GetLastError() == CEpochReclaimer::EEpochError_Ok);
+		TEST_CHECK(reclaimer.GetNumFreeRetireBatches() == CEpochReclaimer::k_uDefaultNumRetireBatches);
+		reclaimer.Initialise(&heap);
+		TEST_CHECK(reclaimer.GetLastError() == CEpochReclaimer::EEpochState_Init_AlreadyInitialised);
+
+		u32 uThreads[CEpochReclaimer::k_uMaxThreads];
+		for (u32 i = 0; i < CEpochReclaimer::k_uMaxThreads; i++)
+		{
+			uThreads[i] = reclaimer.RegisterThread();
+			TEST_CHECK(uThreads[i] != CEpochReclaimer::k_uInvalidThread);
+		}
+		TEST_CHECK(reclaimer.RegisterThread() == CEpochReclaimer::k_uInvalidThread);
+		TEST_CHECK(reclaimer.GetLastError() == CEpochReclaimer::EEpochState_Register_NoFreeSlots);
+
+		reclaimer.UnregisterThread(uThreads[5]);
+		TEST_CHECK(reclaimer.RegisterThread() == uThreads[5]);
+
+		reclaimer.Shutdown();
+		heap.Shutdown();
+	}
+
+	// A pointer is only deallocated once every reader active when it was retired has left
+	void TestReadersHoldPointers()
+	{
+		CManagedHeap heap;
+		heap.Initialise(1 << 22);
+		CEpochReclaimer reclaimer;
+		reclaimer.Initialise(&heap);
+
+		u32 uReader = reclaimer.RegisterThread();
+		u32 uWriter = reclaimer.RegisterThread();
+
+		void* pMemory = heap.Allocate(64);
+		u32 uEpoch = reclaimer.GetEpoch();
+
+		reclaimer.Enter(uReader);
+		reclaimer.Enter(uWriter);
+		TEST_CHECK(reclaimer.Retire(uWriter, pMemory));
+		reclaimer.Leave(uWriter);
+
+		//The reader is stuck in the old epoch, so it can move on once but not twice
+		AdvancePast(reclaimer, heap, uWriter, uEpoch);
+		TEST_CHECK(reclaimer.GetEpoch() - uEpoch < 2);
+		TEST_CHECK(heap.GetAllocationSize(pMemory) != 0);
+
+		reclaimer.Leave(uReader);
+		AdvancePast(reclaimer, heap, uWriter, uEpoch);
+		TEST_CHECK(reclaimer.GetEpoch() - uEpoch >= 2);
+		TEST_CHECK(heap.GetAllocationSize(pMemory) == 0);
+
+		reclaimer.Shutdown();
+		TEST_CHECK(heap.GetNumAllocs() == 0);
+		heap.Shutdown();
+	}
+
+	// Retiring never needs the heap, so works with it locked or full
+	void TestRetireWithoutHeap()
+	{
+		CManagedHeap heap;
+		heap.Initialise(1 << 20);
+		CEpochReclaimer reclaimer;
+		reclaimer.Initialise(&heap);
+		u32 uThread = reclaimer.RegisterThread();
+
+		void* pLocked = heap.Allocate(64);
+		heap.Lock();
+		bool bRetired = reclaimer.Retire(uThread, pLocked);
+		heap.Unlock();
+		TEST_CHECK(bRetired);
+
+		std::vector<void*> blocks;
+		while (void* pMemory = heap.Allocate(256))
+		{
+			blocks.push_back(pMemory);
+		}
+		for (u32 i = 0; i < CEpochReclaimer::k_uRetireBatchSize * 2; i++)
+		{
+			TEST_CHECK(reclaimer.Retire(uThread, blocks.back()));
+			blocks.pop_back();
+		}
+
+		reclaimer.Shutdown();
+		for (void* pMemory : blocks)
+		{
+			heap.Deallocate(pMemory);
+		}
+		TEST_CHECK(heap.GetNumAllocs() == 0);
+		TEST_CHECK(VerifyWholeHeap(heap));
+		heap.Shutdown();
+	}
+
+	// Retire fails once the pool is empty, and the batches come back once their pointers are freed
+	void TestPoolExhausted()
+	{
+		CManagedHeap heap;
+		heap.Initialise(1 << 20);
+		CEpochReclaimer reclaimer;
+		reclaimer.Initialise(&heap, 1);
+		u32 uThread = reclaimer.RegisterThread();
+
+		for (u32 i = 0; i < CEpochReclaimer::k_uRetireBatchSize; i++)
+		{
+			TEST_CHECK(reclaimer.Retire(uThread, heap.Allocate(16)));
+		}
+		TEST_CHECK(reclaimer.GetNumFreeRetireBatches() == 0);
+
+		void* pRefused = heap.Allocate(16);
+		TEST_CHECK(!reclaimer.Retire(uThread, pRefused));
+		heap.Deallocate(pRefused); //Still ours to free
+
+		reclaimer.Shutdown();
+		TEST_CHECK(heap.GetNumAllocs() == 0);
+		heap.Shutdown();
+	}
+
+	// A thread which unregisters hands its retired pointers on rather than leaving them in its slot
+	void TestUnregisterHandsOn()
+	{
+		CManagedHeap heap;
+		heap.Initialise(1 << 22);
+		CEpochReclaimer reclaimer;
+		reclaimer.Initialise(&heap);
+
+		u32 uReader = reclaimer.RegisterThread();
+		u32 uSurvivor = reclaimer.RegisterThread();
+		u32 uLeaving = reclaimer.RegisterThread();
+
+		void* pMemory = heap.Allocate(64);
+		u32 uEpoch = reclaimer.GetEpoch();
+
+		reclaimer.Enter(uReader);
+		reclaimer.Enter(uLeaving);
+		reclaimer.Retire(uLeaving, pMemory);
+		reclaimer.Leave(uLeaving);
+		reclaimer.UnregisterThread(uLeaving);
+		TEST_CHECK(heap.GetAllocationSize(pMemory) != 0); //A reader could still hold it
+
+		reclaimer.Leave(uReader);
+		AdvancePast(reclaimer, heap, uSurvivor, uEpoch);
+		TEST_CHECK(heap.GetAllocationSize(pMemory) == 0);
+
+		reclaimer.Shutdown();
+		TEST_CHECK(heap.GetNumAllocs() == 0);
+		heap.Shutdown();
+	}
+
+	// A lock free stack popped and pushed from several threads. Popped nodes are read after being unlinked,
+	// which is only safe if none is deallocated while another thread may still be reading it
+	void TestLockFreeStack()
+	{
+		const u32 k_uNumThreads = 4;
+		const u32 k_uNumOperations = 20000;
+
+		struct SNode
+		{
+			std::atomic<SNode*> m_pNext;
+			u32 m_uValue;
+		};
+
+		CManagedHeap heap;
+		heap.Initialise(1 << 24);
+		CEpochReclaimer reclaimer;
+		reclaimer.Initialise(&heap);
+
+		std::atomic<SNode*> pTop(nullptr);
+		std::atomic<u32> uNumRefused(0);
+
+		auto work = [&]()
+		{
+			u32 uThread = reclaimer.RegisterThread();
+			for (u32 i = 0; i < k_uNumOperations; i++)
+			{
+				reclaimer.Enter(uThread);
+				if (i % 2 == 0)
+				{
+					SNode* pNode = (SNode*)heap.Allocate(sizeof(SNode));
+					if (pNode)
+					{
+						pNode->m_uValue = i;
+						SNode* pOld = pTop.load();
+						do
+						{
+							pNode->m_pNext.store(pOld);
+						} while (!pTop.compare_exchange_weak(pOld, pNode));
+					}
+				}
+				else
+				{
+					SNode* pOld = pTop.load();
+					while (pOld && !pTop.compare_exchange_weak(pOld, pOld->m_pNext.load()))
+					{
+					}
+					if (pOld && !reclaimer.Retire(uThread, pOld))
+					{
+						uNumRefused++;
+					}
+				}
+				reclaimer.Leave(uThread);
+			}
+			reclaimer.UnregisterThread(uThread);
+		};
+
+		std::vector<std::thread> threads;
+		for (u32 i = 0; i < k_uNumThreads; i++)
+		{
+			threads.emplace_back(work);
+		}
+		for (std::thread& thread : threads)
+		{
+			thread.join();
+		}
+		TEST_CHECK(uNumRefused == 0);
+
+		reclaimer.Shutdown();
+		while (SNode* pNode = pTop.load())
+		{
+			pTop.store(pNode->m_pNext.load());
+			heap.Deallocate(pNode);
+		}
+		TEST_CHECK(heap.GetNumAllocs() == 0);
+		TEST_CHECK(VerifyWholeHeap(heap));
+		heap.Shutdown();
+	}
+}
+
+void TestEpochReclaimer()
+{
+	TestInitialise();
+	TestReadersHoldPointers();
+	TestRetireWithoutHeap();
+	TestPoolExhausted();
+	TestUnregisterHandsOn();
+	TestLockFreeStack();
+}
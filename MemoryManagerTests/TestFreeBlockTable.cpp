@@ -0,0 +1,151 @@
+#include "pch.h"
+#include <algorithm>
+#include <random>
+#include "TestHarness.h"
+
+//////////////////////////////////////////////////////////////////////////
+// The free block table must choose exactly the blocks walking the heap would
+//////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+	// Runs a random mix of lifetimes and alignments, returning each allocation's offset from the first
+	// The table is rebuilt part way through when enabled, and the heap verified as it goes
+	std::vector<long long> RunAllocationSequence(bool bUseTable, u32 uSeed)
+	{
+		CManagedHeap heap;
+		heap.Initialise(16 << 20);
+		if (bUseTable)
+		{
+			TEST_CHECK(heap.EnableFreeBlockTable(true));
+		}
+
+		std::mt19937 random(uSeed);
+		std::vector<void*> live;
+		std::vector<long long> offsets;
+		u8* pFirst = nullptr;
+
+		for (u32 i = 0; i < 40000; i++)
+		{
+			if (live.empty() || random() % 100 < 52)
+			{
+				u32 uAlignment = 4u << (random() % 8);
+				u32 uLifetime = random() % 10;
+				CManagedHeap::ELifetime eLifetime = uLifetime < 7 ? CManagedHeap::ELifetime_Transient :
+					uLifetime < 9 ? CManagedHeap::ELifetime_Session : CManagedHeap::ELifetime_Permanent;
+
+				u8* pMemory = (u8*)heap.Allocate(1 + random() % 3000, eLifetime, uAlignment);
+				if (pMemory && !pFirst)
+				{
+					pFirst = pMemory;
+				}
+				offsets.push_back(pMemory ? pMemory - pFirst : -1);
+				if (pMemory)
+				{
+					live.push_back(pMemory);
+				}
+			}
+			else
+			{
+				size_t uIndex = random() % live.size();
+				heap.Deallocate(live[uIndex]);
+				live[uIndex] = live.back();
+				live.pop_back();
+			}
+
+			if (bUseTable && i == 20000)
+			{
+				heap.EnableFreeBlockTable(false);
+				TEST_CHECK(heap.EnableFreeBlockTable(true));
+			}
+
+			if (i % 5000 == 0)
+			{
+				TEST_CHECK(VerifyWholeHeap(heap));
+			}
+		}
+
+		for (void* pMemory : live)
+		{
+			heap.Deallocate(pMemory);
+		}
+		TEST_CHECK(heap.GetNumAllocs() == 0);
+		TEST_CHECK(VerifyWholeHeap(heap));
+		TEST_CHECK(heap.IsFreeBlockTableEnabled() == bUseTable);
+		heap.Shutdown();
+		return offsets;
+	}
+
+	void TestMatchesWalk()
+	{
+		for (u32 uSeed = 1; uSeed <= 2; uSeed++)
+		{
+			std::vector<long long> walked = RunAllocationSequence(false, uSeed);
+			std::vector<long long> tabled = RunAllocationSequence(true, uSeed);
+			TEST_CHECK(walked == tabled);
+		}
+	}
+
+	// Enough holes to fill many segments of the table, so they split as it fills,
+	// then merge and give pages back as it empties, without the table disagreeing with the heap
+	void TestManySegments()
+	{
+		const u32 k_uNumBlocks = 40000;
+
+		CManagedHeap heap;
+		heap.Initialise(16 << 20);
+		TEST_CHECK(heap.EnableFreeBlockTable(true));
+
+		std::vector<void*> blocks;
+		for (u32 i = 0; i < k_uNumBlocks; i++)
+		{
+			blocks.push_back(heap.Allocate(64));
+			TEST_CHECK(blocks.back() != nullptr);
+		}
+
+		//Every other block, so none of the holes can merge
+		for (u32 i = 0; i < k_uNumBlocks; i += 2)
+		{
+			heap.Deallocate(blocks[i]);
+		}
+		TEST_CHECK(VerifyWholeHeap(heap));
+
+		//First fit refills the holes lowest first
+		u32 uNumMisplaced = 0;
+		for (u32 i = 0; i < k_uNumBlocks; i += 2)
+		{
+			void* pMemory = heap.Allocate(64);
+			uNumMisplaced += pMemory != blocks[i] ? 1 : 0;
+			blocks[i] = pMemory;
+		}
+		TEST_CHECK(uNumMisplaced == 0);
+		TEST_CHECK(VerifyWholeHeap(heap));
+
+		std::mt19937 random(11);
+		std::shuffle(blocks.begin(), blocks.end(), random);
+		for (u32 i = 0; i < k_uNumBlocks; i++)
+		{
+			heap.Deallocate(blocks[i]);
+			if (i % 10000 == 0)
+			{
+				TEST_CHECK(VerifyWholeHeap(heap));
+			}
+		}
+
+		TEST_CHECK(heap.GetNumAllocs() == 0);
+		TEST_CHECK(heap.IsFreeBlockTableEnabled());
+		TEST_CHECK(VerifyWholeHeap(heap));
+
+		//The table still works once it has shrunk back down
+		void* pMemory = heap.Allocate(1000);
+		TEST_CHECK(pMemory != nullptr);
+		heap.Deallocate(pMemory);
+		heap.Shutdown();
+	}
+}
+
+void TestFreeBlockTable()
+{
+	TestMatchesWalk();
+	TestManySegments();
+}
@@ -0,0 +1,36 @@
+#ifndef _TESTHARNESS_H_
+#define _TESTHARNESS_H_
+
+#include "CManagedHeap.h"
+
+//////////////////////////////////////////////////////////////////////////
+// Minimal harness for the MemoryManagerTests console project
+// A failed check is printed with its location and counted, and the test carries on,
+// so one run reports every failure. The process exits with the number of failures.
+//////////////////////////////////////////////////////////////////////////
+
+#define TEST_CHECK(bCondition) TestCheck((bCondition), #bCondition, __FILE__, __LINE__)
+
+// Counts and prints a failed check
+void	TestCheck(bool bCondition, const char* szCondition, const char* szFile, int iLine);
+
+// Runs VerifyStep until a whole pass of the heap completes. Returns false if it finds corruption
+bool	VerifyWholeHeap(CManagedHeap& heap);
+
+// Each suite lives in its own file
+void	TestMaintenance();
+void	TestRemoteFree();
+void	TestPurgePolicy();
+void	TestSizeLimits();
+void	TestPageMap();
+void	TestVerifyStep();
+void	TestLifetimes();
+void	TestFreeBlockTable();
+void	TestEpochReclaimer();
+void	TestHeapProfiler();
+void	TestMallocShim();
+void	TestHeapRegistry();
+void	TestSnapshot();
+void	TestAlignedPlacement();
+
+#endif // #ifndef _TESTHARNESS_H_
@@ -0,0 +1,218 @@
+#include "pch.h"
+#include "TestHarness.h"
+#include "CHeapProfiler.h"
+#include <string>
+
+//////////////////////////////////////////////////////////////////////////
+// Allocation sampling with CHeapProfiler, and the heap_v2 profile it writes
+//////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+	const char* k_szProfileFile = "MemoryManagerTests.heap";
+
+	// The four counts at the start of a header or stack line: live count, live bytes, total count, total bytes
+	struct SProfileCounts
+	{
+		unsigned long long m_uCounts[4];
+	};
+
+	// Reads "%llu: %llu [%llu: %llu] @" from the start of szLine, returning the text after the @ or nullptr
+	const char* ParseCounts(const char* szLine, SProfileCounts& sCounts)
+	{
+		const char* szSeparators[4] = { ": ", " [", ": ", "] @" };
+		for (u32 i = 0; i < 4; i++)
+		{
+			if (*szLine < '0' || *szLine > '9')
+			{
+				return nullptr;
+			}
+			char* szEnd = nullptr;
+			sCounts.m_uCounts[i] = strtoull(szLine, &szEnd, 10);
+
+			size_t uSeparatorLength = strlen(szSeparators[i]);
+			if (strncmp(szEnd, szSeparators[i], uSeparatorLength) != 0)
+			{
+				return nullptr;
+			}
+			szLine = szEnd + uSeparatorLength;
+		}
+		return szLine;
+	}
+
+	// Attaches the profiler and allocates uNumBlocks of uBlockSize, adding them to blocks
+	void SampleBlocks(CManagedHeap& heap, CHeapProfiler& profiler, u32 uNumBlocks, u32 uBlockSize, std::vector<void*>& blocks)
+	{
+		heap.SetProfiler(&profiler);
+		for (u32 i = 0; i < uNumBlocks; i++)
+		{
+			void* pMemory = heap.Allocate(uBlockSize);
+			TEST_CHECK(pMemory != nullptr);
+			blocks.push_back(pMemory);
+		}
+	}
+
+	// Each byte is sampled with probability 1 / interval, so the count lands near the bytes allocated over the interval,
+	// and every sample is dropped again when its block is released
+	void TestSampleRate()
+	{
+		const u32 k_uInterval = 4096;
+		const u32 k_uNumBlocks = 20000;
+		const u32 k_uBlockSize = 64;
+
+		CManagedHeap heap;
+		heap.Initialise(1 << 23);
+		CHeapProfiler profiler;
+		TEST_CHECK(profiler.Initialise(k_uInterval));
+
+		std::vector<void*> blocks;
+		SampleBlocks(heap, profiler, k_uNumBlocks, k_uBlockSize, blocks);
+
+		//312 expected, with a standard deviation of about 18
+		u32 uExpected = k_uNumBlocks * k_uBlockSize / k_uInterval;
+		u32 uNumSamples = profiler.GetNumLiveSamples();
+		TEST_CHECK(uNumSamples > uExpected * 3 / 4);
+		TEST_CHECK(uNumSamples < uExpected * 5 / 4);
+		TEST_CHECK(profiler.GetNumDroppedSamples() == 0);
+
+		for (void* pMemory : blocks)
+		{
+			heap.Deallocate(pMemory);
+		}
+		TEST_CHECK(profiler.GetNumLiveSamples() == 0);
+
+		heap.SetProfiler(nullptr);
+		profiler.Shutdown();
+		heap.Shutdown();
+	}
+
+	// Samples beyond the live sample table are counted as dropped, and sampling carries on once there is room
+	void TestDroppedSamples()
+	{
+		const u32 k_uNumExtra = 100;
+
+		CManagedHeap heap;
+		heap.Initialise(1 << 23);
+		CHeapProfiler profiler;
+		profiler.Initialise(1); //Every allocation is sampled
+
+		std::vector<void*> blocks;
+		SampleBlocks(heap, profiler, CHeapProfiler::k_uMaxLiveSamples + k_uNumExtra, 16, blocks);
+		TEST_CHECK(profiler.GetNumLiveSamples() == CHeapProfiler::k_uMaxLiveSamples);
+		TEST_CHECK(profiler.GetNumDroppedSamples() == k_uNumExtra);
+
+		heap.Deallocate(blocks[0]);
+		blocks[0] = heap.Allocate(16);
+		TEST_CHECK(profiler.GetNumLiveSamples() == CHeapProfiler::k_uMaxLiveSamples);
+		TEST_CHECK(profiler.GetNumDroppedSamples() == k_uNumExtra);
+
+		for (void* pMemory : blocks)
+		{
+			heap.Deallocate(pMemory);
+		}
+		TEST_CHECK(profiler.GetNumLiveSamples() == 0);
+		TEST_CHECK(heap.GetNumAllocs() == 0);
+		TEST_CHECK(VerifyWholeHeap(heap));
+
+		heap.SetProfiler(nullptr);
+		profiler.Shutdown();
+		heap.Shutdown();
+	}
+
+	// The written profile has a heap_v2 header carrying the interval, stack lines which add up to it,
+	// and the module list pprof needs to resolve the frames
+	void TestWriteProfile()
+	{
+		const u32 k_uInterval = 1024;
+		const u32 k_uNumBlocks = 4000;
+		const u32 k_uBlockSize = 100;
+
+		CManagedHeap heap;
+		heap.Initialise(1 << 22);
+		CHeapProfiler profiler;
+		profiler.Initialise(k_uInterval);
+
+		std::vector<void*> blocks;
+		SampleBlocks(heap, profiler, k_uNumBlocks, k_uBlockSize, blocks);
+		for (u32 i = 0; i < k_uNumBlocks; i += 2)
+		{
+			heap.Deallocate(blocks[i]);
+		}
+		u32 uNumLive = profiler.GetNumLiveSamples();
+
+		TEST_CHECK(profiler.WriteProfile(k_szProfileFile));
+
+		std::ifstream file(k_szProfileFile);
+		std::string line;
+		TEST_CHECK((bool)std::getline(file, line));
+
+		//heap profile: <live count>: <live bytes> [<total count>: <total bytes>] @ heap_v2/<interval>
+		const char* k_szHeaderStart = "heap profile: ";
+		const char* k_szHeaderTag = " heap_v2/";
+		SProfileCounts sHeader = {};
+		TEST_CHECK(line.compare(0, strlen(k_szHeaderStart), k_szHeaderStart) == 0);
+		const char* szTag = ParseCounts(line.c_str() + strlen(k_szHeaderStart), sHeader);
+		TEST_CHECK(szTag && strncmp(szTag, k_szHeaderTag, strlen(k_szHeaderTag)) == 0);
+		if (szTag)
+		{
+			TEST_CHECK(strtoul(szTag + strlen(k_szHeaderTag), nullptr, 10) == k_uInterval);
+		}
+		TEST_CHECK(sHeader.m_uCounts[0] == uNumLive);
+		TEST_CHECK(sHeader.m_uCounts[1] == (unsigned long long)uNumLive * k_uBlockSize);
+		TEST_CHECK(sHeader.m_uCounts[2] >= sHeader.m_uCounts[0]);
+		TEST_CHECK(sHeader.m_uCounts[3] == sHeader.m_uCounts[2] * k_uBlockSize);
+
+		//One line per stack, each with at least one frame, until the blank line before the module list
+		SProfileCounts sSums = {};
+		u32 uNumStacks = 0;
+		while (std::getline(file, line) && !line.empty())
+		{
+			SProfileCounts sStack = {};
+			const char* szFrames = ParseCounts(line.c_str(), sStack);
+			TEST_CHECK(szFrames && strncmp(szFrames, " 0x", 3) == 0);
+			for (u32 i = 0; i < 4; i++)
+			{
+				sSums.m_uCounts[i] += sStack.m_uCounts[i];
+			}
+			uNumStacks++;
+		}
+		TEST_CHECK(uNumStacks > 0);
+		for (u32 i = 0; i < 4; i++)
+		{
+			TEST_CHECK(sSums.m_uCounts[i] == sHeader.m_uCounts[i]);
+		}
+
+		//<start>-<end> r-xp 00000000 00:00 0 <path>
+		TEST_CHECK((bool)std::getline(file, line) && line == "MAPPED_LIBRARIES:");
+		u32 uNumModules = 0;
+		while (std::getline(file, line))
+		{
+			char* szEnd = nullptr;
+			unsigned long long uStart = strtoull(line.c_str(), &szEnd, 16);
+			TEST_CHECK(*szEnd == '-');
+			unsigned long long uEnd = strtoull(szEnd + 1, &szEnd, 16);
+			TEST_CHECK(uEnd > uStart);
+			TEST_CHECK(strncmp(szEnd, " r-xp ", 6) == 0);
+			uNumModules++;
+		}
+		TEST_CHECK(uNumModules > 0);
+
+		file.close();
+		remove(k_szProfileFile);
+
+		for (u32 i = 1; i < k_uNumBlocks; i += 2)
+		{
+			heap.Deallocate(blocks[i]);
+		}
+		heap.SetProfiler(nullptr);
+		profiler.Shutdown();
+		heap.Shutdown();
+	}
+}
+
+void TestHeapProfiler()
+{
+	TestSampleRate();
+	TestDroppedSamples();
+	TestWriteProfile();
+}
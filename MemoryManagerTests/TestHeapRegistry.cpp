@@ -0,0 +1,310 @@
+#include "pch.h"
+#include "TestHarness.h"
+#include "CHeapRegistry.h"
+
+//////////////////////////////////////////////////////////////////////////
+// Named heaps from CHeapRegistry, their budgets and failure policies
+//////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+	const u32 k_uRegionSize = 1 << 23;
+	const u32 k_uHeapSize = 1 << 20;
+	const u32 k_uBlockSize = 1000;
+
+	// Lets the failure handler free memory the test is holding
+	struct SHandlerLog
+	{
+		CHeapRegistry* m_pRegistry;
+		std::vector<void*>* m_pHeld;
+		u32 m_uNumCalls;
+		u32 m_uLastTag;
+		CManagedHeap::EHeapState m_ELastError;
+		u32 m_uLastNumBytes;
+	};
+
+	// Records the call, then frees one held block and retries, or gives up once there are none left
+	bool OnFailure(u32 uTag, CManagedHeap::EHeapState eError, u32 uNumBytes, void* pUserData)
+	{
+		SHandlerLog& sLog = *(SHandlerLog*)pUserData;
+		sLog.m_uNumCalls++;
+		sLog.m_uLastTag = uTag;
+		sLog.m_ELastError = eError;
+		sLog.m_uLastNumBytes = uNumBytes;
+
+		if (sLog.m_pHeld->empty())
+		{
+			return false;
+		}
+		sLog.m_pRegistry->Deallocate(uTag, sLog.m_pHeld->back());
+		sLog.m_pHeld->pop_back();
+		return true;
+	}
+
+	// Allocates k_uBlockSize blocks until the heap refuses one
+	void FillHeap(CHeapRegistry& registry, u32 uTag, std::vector<void*>& blocks)
+	{
+		while (void* pMemory = registry.Allocate(uTag, k_uBlockSize))
+		{
+			blocks.push_back(pMemory);
+		}
+	}
+
+	void FreeAll(CHeapRegistry& registry, u32 uTag, std::vector<void*>& blocks)
+	{
+		for (void* pMemory : blocks)
+		{
+			registry.Deallocate(uTag, pMemory);
+		}
+		blocks.clear();
+	}
+
+	void TestCreateHeaps()
+	{
+		CHeapRegistry registry;
+		TEST_CHECK(registry.CreateHeap("Early", k_uHeapSize) == CHeapRegistry::k_uInvalidTag);
+		TEST_CHECK(registry.GetLastError() == CHeapRegistry::ERegistryState_Init_NotInitialised);
+
+		registry.Initialise(k_uRegionSize);
+		TEST_CHECK(registry.GetLastError() == CHeapRegistry::ERegistryError_Ok);
+
+		TEST_CHECK(registry.CreateHeap("Bad", k_uHeapSize, 0, k_uHeapSize + 1) == CHeapRegistry::k_uInvalidTag);
+		TEST_CHECK(registry.GetLastError() == CHeapRegistry::ERegistryState_Create_BadBudget);
+		TEST_CHECK(registry.CreateHeap("Bad", k_uHeapSize, 2000, 1000) == CHeapRegistry::k_uInvalidTag);
+		TEST_CHECK(registry.GetLastError() == CHeapRegistry::ERegistryState_Create_BadBudget);
+		TEST_CHECK(registry.CreateHeap("Bad", k_uRegionSize * 2) == CHeapRegistry::k_uInvalidTag);
+		TEST_CHECK(registry.GetLastError() == CHeapRegistry::ERegistryState_Create_OutOfMemory);
+		TEST_CHECK(registry.GetNumHeaps() == 0);
+
+		u32 uAudio = registry.CreateHeap("Audio", k_uHeapSize);
+		u32 uPhysics = registry.CreateHeap("Physics", k_uHeapSize);
+		TEST_CHECK(uAudio != CHeapRegistry::k_uInvalidTag && uPhysics != CHeapRegistry::k_uInvalidTag && uAudio != uPhysics);
+		TEST_CHECK(registry.FindHeap("Physics") == uPhysics);
+		TEST_CHECK(registry.FindHeap("Render") == CHeapRegistry::k_uInvalidTag);
+
+		//Each allocation maps back to the heap it came from
+		void* pAudio = registry.Allocate(uAudio, 64);
+		void* pPhysics = registry.Allocate(uPhysics, 64);
+		TEST_CHECK(registry.FindTag(pAudio) == uAudio);
+		TEST_CHECK(registry.FindTag(pPhysics) == uPhysics);
+		TEST_CHECK(registry.FindTag(&registry) == CHeapRegistry::k_uInvalidTag);
+
+		TEST_CHECK(registry.Allocate(CHeapRegistry::k_uMaxHeaps, 64) == nullptr);
+		TEST_CHECK(registry.GetLastError() == CHeapRegistry::ERegistryState_BadTag);
+		CHeapRegistry::SHeapStats sStats;
+		TEST_CHECK(!registry.GetStats(CHeapRegistry::k_uMaxHeaps, sStats));
+
+		registry.Deallocate(uAudio, pAudio);
+		registry.Deallocate(uPhysics, pPhysics);
+
+		//Small heaps until the table is full
+		for (u32 i = registry.GetNumHeaps(); i < CHeapRegistry::k_uMaxHeaps; i++)
+		{
+			TEST_CHECK(registry.CreateHeap("Small", 64 * 1024) != CHeapRegistry::k_uInvalidTag);
+		}
+		TEST_CHECK(registry.CreateHeap("OneTooMany", 64 * 1024) == CHeapRegistry::k_uInvalidTag);
+		TEST_CHECK(registry.GetLastError() == CHeapRegistry::ERegistryState_Create_TooManyHeaps);
+
+		registry.Shutdown();
+	}
+
+	// The hard budget refuses allocations, the soft budget only counts them, and one heap filling up
+	// leaves the others alone
+	void TestBudgets()
+	{
+		const u32 k_uSoftBudget = 50000;
+		const u32 k_uHardBudget = 100000;
+
+		CHeapRegistry registry;
+		registry.Initialise(k_uRegionSize);
+		u32 uBudgeted = registry.CreateHeap("Budgeted", k_uHeapSize, k_uSoftBudget, k_uHardBudget);
+		u32 uOther = registry.CreateHeap("Other", k_uHeapSize);
+
+		std::vector<void*> blocks;
+		FillHeap(registry, uBudgeted, blocks);
+		TEST_CHECK(registry.GetLastError(uBudgeted) == CManagedHeap::EHeapState_Alloc_OverByteLimit);
+
+		CHeapRegistry::SHeapStats sStats;
+		TEST_CHECK(registry.GetStats(uBudgeted, sStats));
+		TEST_CHECK(strcmp(sStats.m_szName, "Budgeted") == 0);
+		TEST_CHECK(sStats.m_uSoftBudget == k_uSoftBudget && sStats.m_uHardBudget == k_uHardBudget);
+		TEST_CHECK(sStats.m_uAllocatedBytes <= k_uHardBudget);
+		TEST_CHECK(sStats.m_uAllocatedBytes + k_uBlockSize > k_uHardBudget);
+		TEST_CHECK(sStats.m_uNumAllocs == blocks.size());
+		TEST_CHECK(sStats.m_uPeakBytes == sStats.m_uAllocatedBytes);
+		TEST_CHECK(sStats.m_uNumFailures == 1);
+
+		//Only the allocations past the soft budget, roughly the second half, are counted
+		TEST_CHECK(sStats.m_uNumSoftOverruns > blocks.size() / 4);
+		TEST_CHECK(sStats.m_uNumSoftOverruns < blocks.size() * 3 / 4);
+
+		void* pOther = registry.Allocate(uOther, k_uHardBudget * 2);
+		TEST_CHECK(pOther != nullptr);
+		registry.Deallocate(uOther, pOther);
+
+		//The peak stays where it was once the memory is released
+		u32 uPeak = sStats.m_uPeakBytes;
+		FreeAll(registry, uBudgeted, blocks);
+		registry.GetStats(uBudgeted, sStats);
+		TEST_CHECK(sStats.m_uAllocatedBytes == 0 && sStats.m_uNumAllocs == 0);
+		TEST_CHECK(sStats.m_uPeakBytes == uPeak);
+
+		registry.Shutdown();
+	}
+
+	// ReturnNull is the default, and CallHandler without a handler falls back to it
+	void TestReturnNullPolicy()
+	{
+		CHeapRegistry registry;
+		registry.Initialise(k_uRegionSize);
+		u32 uTag = registry.CreateHeap("Heap", k_uHeapSize);
+
+		TEST_CHECK(registry.Allocate(uTag, k_uHeapSize * 2) == nullptr);
+		TEST_CHECK(registry.GetLastError(uTag) == CManagedHeap::EHeapState_Alloc_NoLargeEnoughBlocks);
+
+		registry.SetFailurePolicy(uTag, CHeapRegistry::EFailurePolicy_CallHandler, nullptr);
+		TEST_CHECK(registry.Allocate(uTag, k_uHeapSize * 2) == nullptr);
+
+		CHeapRegistry::SHeapStats sStats;
+		registry.GetStats(uTag, sStats);
+		TEST_CHECK(sStats.m_uNumFailures == 2);
+
+		registry.Shutdown();
+	}
+
+	// A failing heap with the assert policy asserts in debug, and returns nullptr once asserts are compiled out
+	void TestAssertPolicy()
+	{
+		CHeapRegistry registry;
+		registry.Initialise(k_uRegionSize);
+		u32 uTag = registry.CreateHeap("Heap", k_uHeapSize);
+		registry.SetFailurePolicy(uTag, CHeapRegistry::EFailurePolicy_Assert);
+
+		void* pMemory = registry.Allocate(uTag, k_uBlockSize);
+		TEST_CHECK(pMemory != nullptr);
+		registry.Deallocate(uTag, pMemory);
+
+#ifndef _DEBUG
+		TEST_CHECK(registry.Allocate(uTag, k_uHeapSize * 2) == nullptr);
+		CHeapRegistry::SHeapStats sStats;
+		registry.GetStats(uTag, sStats);
+		TEST_CHECK(sStats.m_uNumFailures == 1);
+#endif
+
+		registry.Shutdown();
+	}
+
+	// The handler is told why the allocation failed, and the allocation is retried for as long as it frees memory
+	void TestCallHandlerPolicy()
+	{
+		const u32 k_uHardBudget = 100000;
+		const u32 k_uNumHeld = 3;
+
+		CHeapRegistry registry;
+		registry.Initialise(k_uRegionSize);
+		u32 uTag = registry.CreateHeap("Heap", k_uHeapSize, 0, k_uHardBudget);
+
+		std::vector<void*> blocks;
+		FillHeap(registry, uTag, blocks);
+		std::vector<void*> held(blocks.end() - k_uNumHeld, blocks.end());
+		blocks.resize(blocks.size() - k_uNumHeld);
+
+		SHandlerLog sLog = {};
+		sLog.m_pRegistry = &registry;
+		sLog.m_pHeld = &held;
+		registry.SetFailurePolicy(uTag, CHeapRegistry::EFailurePolicy_CallHandler, OnFailure, &sLog);
+
+		//One freed block makes room for one more
+		void* pMemory = registry.Allocate(uTag, k_uBlockSize);
+		TEST_CHECK(pMemory != nullptr);
+		TEST_CHECK(sLog.m_uNumCalls == 1);
+		TEST_CHECK(sLog.m_uLastTag == uTag);
+		TEST_CHECK(sLog.m_ELastError == CManagedHeap::EHeapState_Alloc_OverByteLimit);
+		TEST_CHECK(sLog.m_uLastNumBytes == k_uBlockSize);
+		blocks.push_back(pMemory);
+
+		//Needs more than the handler can free, so it is called until it gives up
+		TEST_CHECK(registry.Allocate(uTag, k_uBlockSize * 10) == nullptr);
+		TEST_CHECK(held.empty());
+		TEST_CHECK(sLog.m_uNumCalls == 1 + k_uNumHeld);
+
+		CHeapRegistry::SHeapStats sStats;
+		registry.GetStats(uTag, sStats);
+		TEST_CHECK(sStats.m_uNumFailures == 1 + 1 + k_uNumHeld);
+
+		FreeAll(registry, uTag, blocks);
+		registry.Shutdown();
+	}
+
+	// Stats read while other threads allocate, which must not race with the heaps' counters
+	void TestStatsWhileAllocating()
+	{
+		const u32 k_uNumThreads = 4;
+		const u32 k_uNumOperations = 20000;
+
+		CHeapRegistry registry;
+		registry.Initialise(k_uRegionSize);
+		u32 uTag = registry.CreateHeap("Shared", k_uHeapSize * 4, k_uHeapSize);
+
+		std::atomic<bool> bDone(false);
+		std::vector<std::thread> threads;
+		for (u32 i = 0; i < k_uNumThreads; i++)
+		{
+			threads.emplace_back([&registry, uTag]()
+			{
+				void* pBlocks[16] = {};
+				for (u32 j = 0; j < k_uNumOperations; j++)
+				{
+					void*& pBlock = pBlocks[j % 16];
+					if (pBlock)
+					{
+						registry.Deallocate(uTag, pBlock);
+					}
+					pBlock = registry.Allocate(uTag, 64 + j % 512);
+				}
+				for (void* pBlock : pBlocks)
+				{
+					registry.Deallocate(uTag, pBlock);
+				}
+			});
+		}
+
+		bool bSane = true;
+		std::thread reader([&]()
+		{
+			CHeapRegistry::SHeapStats sStats;
+			while (!bDone.load())
+			{
+				registry.GetStats(uTag, sStats);
+				bSane &= sStats.m_uAllocatedBytes <= sStats.m_uHeapSize;
+				std::this_thread::yield();
+			}
+		});
+
+		for (std::thread& thread : threads)
+		{
+			thread.join();
+		}
+		bDone.store(true);
+		reader.join();
+		TEST_CHECK(bSane);
+
+		CHeapRegistry::SHeapStats sStats;
+		registry.GetStats(uTag, sStats);
+		TEST_CHECK(sStats.m_uNumAllocs == 0 && sStats.m_uAllocatedBytes == 0);
+		TEST_CHECK(sStats.m_uPeakBytes > 0);
+		TEST_CHECK(sStats.m_uNumFailures == 0);
+
+		registry.Shutdown();
+	}
+}
+
+void TestHeapRegistry()
+{
+	TestCreateHeaps();
+	TestBudgets();
+	TestReturnNullPolicy();
+	TestAssertPolicy();
+	TestCallHandlerPolicy();
+	TestStatsWhileAllocating();
+}
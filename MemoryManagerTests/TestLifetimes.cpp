@@ -0,0 +1,69 @@
+#include "pch.h"
+#include "TestHarness.h"
+
+//////////////////////////////////////////////////////////////////////////
+// Placement of session and permanent allocations
+//////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+	// Permanent allocations stack down from the top, sessions beneath them
+	void TestPlacement()
+	{
+		CManagedHeap heap;
+		heap.Initialise(1 << 20);
+
+		u8* pTransient = (u8*)heap.Allocate(256, CManagedHeap::ELifetime_Transient);
+		u8* pPermanent = (u8*)heap.Allocate(256, CManagedHeap::ELifetime_Permanent);
+		u8* pSession = (u8*)heap.Allocate(256, CManagedHeap::ELifetime_Session);
+		TEST_CHECK(pTransient < pSession);
+		TEST_CHECK(pSession < pPermanent);
+
+		CManagedHeap::SLifetimeStats sStats;
+		TEST_CHECK(heap.GetLifetimeStats(CManagedHeap::ELifetime_Permanent, sStats));
+		TEST_CHECK(sStats.m_uNumAllocations == 1);
+		TEST_CHECK(sStats.m_uNumHolesInSpan == 0);
+
+		heap.Deallocate(pTransient);
+		heap.Deallocate(pPermanent);
+		heap.Deallocate(pSession);
+		TEST_CHECK(VerifyWholeHeap(heap));
+		heap.Shutdown();
+	}
+
+	// Releasing the lowest permanent allocation raises the floor sessions are placed under,
+	// so the hole it leaves is reused rather than stranded above the sessions
+	void TestPermanentFloorRises()
+	{
+		CManagedHeap heap;
+		heap.Initialise(1 << 20);
+
+		void* pHigh = heap.Allocate(256, CManagedHeap::ELifetime_Permanent, 16);
+		void* pLow = heap.Allocate(256, CManagedHeap::ELifetime_Permanent, 16);
+		void* pSessionA = heap.Allocate(256, CManagedHeap::ELifetime_Session, 16);
+		void* pSessionB = heap.Allocate(256, CManagedHeap::ELifetime_Session, 16);
+
+		heap.Deallocate(pLow);
+		void* pSessionC = heap.Allocate(256, CManagedHeap::ELifetime_Session, 16);
+		TEST_CHECK(pSessionC == pLow);
+
+		//With no permanent allocations left, sessions start from the very top
+		heap.Deallocate(pSessionC);
+		heap.Deallocate(pHigh);
+		void* pSessionD = heap.Allocate(256, CManagedHeap::ELifetime_Session, 16);
+		TEST_CHECK(pSessionD == pHigh);
+
+		heap.Deallocate(pSessionA);
+		heap.Deallocate(pSessionB);
+		heap.Deallocate(pSessionD);
+		TEST_CHECK(heap.GetNumAllocs() == 0);
+		TEST_CHECK(VerifyWholeHeap(heap));
+		heap.Shutdown();
+	}
+}
+
+void TestLifetimes()
+{
+	TestPlacement();
+	TestPermanentFloorRises();
+}
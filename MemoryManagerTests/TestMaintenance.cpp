@@ -0,0 +1,237 @@
+#include "pch.h"
+#include "TestHarness.h"
+
+//////////////////////////////////////////////////////////////////////////
+// The background maintenance thread and the pending release list
+//////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+	const u32 k_uNumBlocks = 1000;
+
+	// A thread which never gets any work done, so queued blocks stay queued until released some other way
+	CManagedHeap::SMaintenanceSettings IdleSettings()
+	{
+		CManagedHeap::SMaintenanceSettings sSettings = {};
+		sSettings.m_uPeriodMicroseconds = 1000000;
+		sSettings.m_uBudgetMicroseconds = 0;
+		return sSettings;
+	}
+
+	u32 GetNumPendingLocked(CManagedHeap& heap)
+	{
+		heap.Lock();
+		u32 uNumPending = heap.GetNumPendingReleases();
+		heap.Unlock();
+		return uNumPending;
+	}
+
+	void TestSettingsValidated()
+	{
+		CManagedHeap heap;
+		CManagedHeap::SMaintenanceSettings sSettings = IdleSettings();
+
+		heap.StartMaintenanceThread(sSettings);
+		TEST_CHECK(heap.GetLastError() == CManagedHeap::EHeapState_Init_NotInitialised);
+
+		heap.Initialise(1 << 20);
+
+		sSettings.m_uPeriodMicroseconds = 0;
+		heap.StartMaintenanceThread(sSettings);
+		TEST_CHECK(heap.GetLastError() == CManagedHeap::EHeapState_Maint_BadSettings);
+
+		sSettings.m_uPeriodMicroseconds = 100;
+		sSettings.m_uBudgetMicroseconds = 200;
+		heap.StartMaintenanceThread(sSettings);
+		TEST_CHECK(heap.GetLastError() == CManagedHeap::EHeapState_Maint_BadSettings);
+
+		heap.StartMaintenanceThread(IdleSettings());
+		TEST_CHECK(heap.GetLastError() == CManagedHeap::EHeapError_Ok);
+		heap.StartMaintenanceThread(IdleSettings());
+		TEST_CHECK(heap.GetLastError() == CManagedHeap::EHeapState_Maint_AlreadyRunning);
+
+		heap.StopMaintenanceThread();
+		heap.StopMaintenanceThread(); //Stopping a thread which isn't running does nothing
+		heap.Shutdown();
+	}
+
+	// The thread is bound to the mask before it runs, and a mask with none of the process's CPUs
+	// is reported and leaves the heap releasing inline
+	void TestAffinity()
+	{
+		CManagedHeap heap;
+		heap.Initialise(1 << 20);
+
+		DWORD_PTR uProcessMask = 0;
+		DWORD_PTR uSystemMask = 0;
+		TEST_CHECK(GetProcessAffinityMask(GetCurrentProcess(), &uProcessMask, &uSystemMask) != 0);
+
+		CManagedHeap::SMaintenanceSettings sSettings = IdleSettings();
+		sSettings.m_uAffinityMask = uProcessMask;
+		heap.StartMaintenanceThread(sSettings);
+		TEST_CHECK(heap.GetLastError() == CManagedHeap::EHeapError_Ok);
+		heap.StopMaintenanceThread();
+
+		if (~uProcessMask != 0)
+		{
+			sSettings.m_uAffinityMask = ~uProcessMask;
+			heap.StartMaintenanceThread(sSettings);
+			TEST_CHECK(heap.GetLastError() == CManagedHeap::EHeapState_Maint_BadAffinity);
+
+			heap.Deallocate(heap.Allocate(100));
+			TEST_CHECK(GetNumPendingLocked(heap) == 0);
+			TEST_CHECK(heap.GetNumAllocs() == 0);
+		}
+
+		heap.StartMaintenanceThread(IdleSettings());
+		TEST_CHECK(heap.GetLastError() == CManagedHeap::EHeapError_Ok);
+		heap.StopMaintenanceThread();
+		heap.Shutdown();
+	}
+
+	// Deallocations are queued and still counted until they are released
+	void TestPendingRelease()
+	{
+		CManagedHeap heap;
+		heap.Initialise(1 << 20);
+		heap.StartMaintenanceThread(IdleSettings());
+
+		void* pBlocks[k_uNumBlocks];
+		for (u32 i = 0; i < k_uNumBlocks; i++)
+		{
+			pBlocks[i] = heap.Allocate(64 + i % 32);
+		}
+		for (u32 i = 0; i < k_uNumBlocks; i += 2)
+		{
+			heap.Deallocate(pBlocks[i]);
+		}
+
+		TEST_CHECK(GetNumPendingLocked(heap) == k_uNumBlocks / 2);
+		TEST_CHECK(heap.GetNumAllocs() == k_uNumBlocks);
+
+		//Freeing a queued block again is still caught
+		heap.Deallocate(pBlocks[0]);
+		TEST_CHECK(heap.GetLastError() == CManagedHeap::EHeapState_Dealloc_AlreadyDeallocated);
+
+		heap.FlushMaintenance();
+		TEST_CHECK(GetNumPendingLocked(heap) == 0);
+		TEST_CHECK(heap.GetNumAllocs() == k_uNumBlocks / 2);
+		TEST_CHECK(VerifyWholeHeap(heap));
+
+		for (u32 i = 1; i < k_uNumBlocks; i += 2)
+		{
+			heap.Deallocate(pBlocks[i]);
+		}
+		heap.StopMaintenanceThread(); //Releases whatever is still queued
+		TEST_CHECK(heap.GetNumAllocs() == 0);
+		TEST_CHECK(heap.GetNumPendingReleases() == 0);
+		TEST_CHECK(VerifyWholeHeap(heap));
+		heap.Shutdown();
+	}
+
+	// An allocation which doesn't fit releases a bounded number of queued blocks itself
+	void TestInlineRelease()
+	{
+		const u32 k_uBlockSize = 1024;
+
+		CManagedHeap heap;
+		heap.Initialise(1 << 20);
+		heap.StartMaintenanceThread(IdleSettings());
+
+		std::vector<void*> blocks;
+		while (void* pMemory = heap.Allocate(k_uBlockSize))
+		{
+			blocks.push_back(pMemory);
+		}
+		for (void* pMemory : blocks)
+		{
+			heap.Deallocate(pMemory);
+		}
+		u32 uNumQueued = GetNumPendingLocked(heap);
+		TEST_CHECK(uNumQueued == blocks.size());
+
+		void* pMemory = heap.Allocate(k_uBlockSize * 4);
+		TEST_CHECK(pMemory != nullptr);
+		u32 uNumReleased = uNumQueued - GetNumPendingLocked(heap);
+		TEST_CHECK(uNumReleased > 0);
+		TEST_CHECK(uNumReleased <= CManagedHeap::k_uMaxInlineReleases);
+
+		heap.Deallocate(pMemory);
+		heap.FlushMaintenance();
+		TEST_CHECK(heap.GetNumAllocs() == 0);
+		TEST_CHECK(VerifyWholeHeap(heap));
+		heap.StopMaintenanceThread();
+		heap.Shutdown();
+	}
+
+	// A working thread empties the queue by itself
+	void TestThreadReleases()
+	{
+		CManagedHeap heap;
+		heap.Initialise(1 << 20);
+
+		CManagedHeap::SMaintenanceSettings sSettings = {};
+		sSettings.m_uPeriodMicroseconds = 1000;
+		sSettings.m_uBudgetMicroseconds = 500;
+		heap.StartMaintenanceThread(sSettings);
+
+		void* pBlocks[k_uNumBlocks];
+		for (u32 i = 0; i < k_uNumBlocks; i++)
+		{
+			pBlocks[i] = heap.Allocate(64);
+		}
+		for (u32 i = 0; i < k_uNumBlocks; i++)
+		{
+			heap.Deallocate(pBlocks[i]);
+		}
+
+		std::chrono::steady_clock::time_point giveUp = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+		while (GetNumPendingLocked(heap) != 0 && std::chrono::steady_clock::now() < giveUp)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		TEST_CHECK(GetNumPendingLocked(heap) == 0);
+
+		heap.Lock();
+		u32 uNumAllocs = heap.GetNumAllocs();
+		heap.Unlock();
+		TEST_CHECK(uNumAllocs == 0);
+
+		heap.StopMaintenanceThread();
+		TEST_CHECK(VerifyWholeHeap(heap));
+		heap.Shutdown();
+	}
+
+	// Shutting down with blocks still queued stops the thread first
+	void TestShutdownWhileQueued()
+	{
+		CManagedHeap heap;
+		heap.Initialise(1 << 20);
+		heap.StartMaintenanceThread(IdleSettings());
+
+		for (u32 i = 0; i < k_uNumBlocks; i++)
+		{
+			heap.Deallocate(heap.Allocate(128));
+		}
+		TEST_CHECK(GetNumPendingLocked(heap) == k_uNumBlocks);
+
+		heap.Shutdown();
+		TEST_CHECK(heap.GetNumPendingReleases() == 0);
+
+		//The heap can be set up again, and the thread started again, afterwards
+		heap.Initialise(1 << 20);
+		heap.StartMaintenanceThread(IdleSettings());
+		TEST_CHECK(heap.GetLastError() == CManagedHeap::EHeapError_Ok);
+		heap.Shutdown();
+	}
+}
+
+void TestMaintenance()
+{
+	TestSettingsValidated();
+	TestAffinity();
+	TestPendingRelease();
+	TestInlineRelease();
+	TestThreadReleases();
+	TestShutdownWhileQueued();
+}
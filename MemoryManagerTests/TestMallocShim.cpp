@@ -0,0 +1,248 @@
+#include "pch.h"
+#include "TestHarness.h"
+#include <cerrno>
+
+//////////////////////////////////////////////////////////////////////////
+// The MallocShim entry points, called directly
+// MallocShim.cpp is built into the test program, so nothing is patched and malloc here is the real CRT's
+//////////////////////////////////////////////////////////////////////////
+
+extern "C" void* ShimMalloc(size_t uSize);
+extern "C" void ShimFreeC(void* pMemory);
+extern "C" void* ShimCalloc(size_t uCount, size_t uSize);
+extern "C" void* ShimRealloc(void* pMemory, size_t uSize);
+extern "C" int ShimPosixMemalign(void** ppMemory, size_t uAlignment, size_t uSize);
+extern "C" void* ShimAlignedAlloc(size_t uAlignment, size_t uSize);
+extern "C" size_t ShimMallocUsableSize(void* pMemory);
+extern "C" void* ShimRecalloc(void* pMemory, size_t uCount, size_t uSize);
+extern "C" void* ShimExpand(void* pMemory, size_t uSize);
+
+namespace
+{
+	const u32 k_uShimHeapMB = 8;
+
+	inline bool IsAligned(void* pMemory, size_t uAlignment)
+	{
+		return ((uintptr_t)pMemory & (uAlignment - 1)) == 0;
+	}
+
+	// Fills a block with a pattern which depends on the offset, so moved data can be checked
+	void FillPattern(void* pMemory, size_t uSize)
+	{
+		for (size_t i = 0; i < uSize; i++)
+		{
+			((u8*)pMemory)[i] = (u8)(i * 7 + 3);
+		}
+	}
+
+	bool CheckPattern(void* pMemory, size_t uSize)
+	{
+		for (size_t i = 0; i < uSize; i++)
+		{
+			if (((u8*)pMemory)[i] != (u8)(i * 7 + 3))
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	bool IsZeroed(void* pMemory, size_t uStart, size_t uEnd)
+	{
+		for (size_t i = uStart; i < uEnd; i++)
+		{
+			if (((u8*)pMemory)[i] != 0)
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Every block is aligned as the CRT's would be, and the heap size comes from the environment
+	void TestMalloc()
+	{
+		std::vector<void*> blocks;
+		for (size_t uSize = 0; uSize < 300; uSize++)
+		{
+			void* pMemory = ShimMalloc(uSize);
+			TEST_CHECK(pMemory != nullptr);
+			TEST_CHECK(IsAligned(pMemory, MEMORY_ALLOCATION_ALIGNMENT));
+			TEST_CHECK(ShimMallocUsableSize(pMemory) >= uSize);
+			blocks.push_back(pMemory);
+		}
+		for (void* pMemory : blocks)
+		{
+			ShimFreeC(pMemory);
+		}
+		ShimFreeC(nullptr);
+		TEST_CHECK(ShimMallocUsableSize(nullptr) == 0);
+
+		//No single heap can hold this, and it isn't passed on to the CRT
+		errno = 0;
+		TEST_CHECK(ShimMalloc((k_uShimHeapMB + 1) * 1024 * 1024) == nullptr);
+		TEST_CHECK(errno == ENOMEM);
+	}
+
+	void TestCalloc()
+	{
+		const size_t k_uSize = 1000;
+
+		//Dirty a block first, so a calloc reusing it has something to clear
+		void* pDirty = ShimMalloc(k_uSize);
+		memset(pDirty, 0xCD, k_uSize);
+		ShimFreeC(pDirty);
+
+		void* pMemory = ShimCalloc(k_uSize / 4, 4);
+		TEST_CHECK(pMemory != nullptr);
+		TEST_CHECK(IsZeroed(pMemory, 0, k_uSize));
+		ShimFreeC(pMemory);
+
+		errno = 0;
+		TEST_CHECK(ShimCalloc((size_t)-1 / 2, 4) == nullptr);
+		TEST_CHECK(errno == ENOMEM);
+	}
+
+	// Growing moves the data, shrinking keeps the block where it is, and _recalloc clears the new part
+	void TestRealloc()
+	{
+		void* pMemory = ShimRealloc(nullptr, 100);
+		TEST_CHECK(pMemory != nullptr);
+		FillPattern(pMemory, 100);
+
+		pMemory = ShimRealloc(pMemory, 5000);
+		TEST_CHECK(pMemory != nullptr);
+		TEST_CHECK(IsAligned(pMemory, MEMORY_ALLOCATION_ALIGNMENT));
+		TEST_CHECK(CheckPattern(pMemory, 100));
+		FillPattern(pMemory, 5000);
+
+		void* pShrunk = ShimRealloc(pMemory, 50);
+		TEST_CHECK(pShrunk == pMemory);
+		TEST_CHECK(CheckPattern(pShrunk, 50));
+
+		TEST_CHECK(ShimExpand(pShrunk, 40) == pShrunk);
+		errno = 0;
+		TEST_CHECK(ShimExpand(pShrunk, 100000) == nullptr);
+		TEST_CHECK(errno == ENOMEM);
+
+		TEST_CHECK(ShimRealloc(pShrunk, 0) == nullptr); //Frees it
+
+		void* pArray = ShimRecalloc(nullptr, 10, 8);
+		TEST_CHECK(pArray != nullptr);
+		TEST_CHECK(IsZeroed(pArray, 0, 80));
+		FillPattern(pArray, 80);
+		pArray = ShimRecalloc(pArray, 1000, 8);
+		TEST_CHECK(pArray != nullptr);
+		TEST_CHECK(CheckPattern(pArray, 80));
+		TEST_CHECK(IsZeroed(pArray, 80, 8000));
+
+		//Shrinking and growing again clears what was cut off
+		pArray = ShimRecalloc(pArray, 2, 8);
+		pArray = ShimRecalloc(pArray, 10, 8);
+		TEST_CHECK(CheckPattern(pArray, 16));
+		TEST_CHECK(IsZeroed(pArray, 16, 80));
+		ShimFreeC(pArray);
+	}
+
+	void TestAlignedAllocation()
+	{
+		for (size_t uAlignment = sizeof(void*); uAlignment <= 4096; uAlignment *= 2)
+		{
+			void* pMemory = nullptr;
+			TEST_CHECK(ShimPosixMemalign(&pMemory, uAlignment, 100) == 0);
+			TEST_CHECK(pMemory != nullptr && IsAligned(pMemory, uAlignment));
+			ShimFreeC(pMemory);
+
+			pMemory = ShimAlignedAlloc(uAlignment, 100);
+			TEST_CHECK(pMemory != nullptr && IsAligned(pMemory, uAlignment));
+			ShimFreeC(pMemory);
+		}
+
+		void* pUntouched = nullptr;
+		TEST_CHECK(ShimPosixMemalign(&pUntouched, 24, 100) == EINVAL);
+		TEST_CHECK(ShimPosixMemalign(&pUntouched, sizeof(void*) / 2, 100) == EINVAL);
+		TEST_CHECK(pUntouched == nullptr);
+
+		errno = 0;
+		TEST_CHECK(ShimAlignedAlloc(0, 100) == nullptr);
+		TEST_CHECK(errno == EINVAL);
+		errno = 0;
+		TEST_CHECK(ShimAlignedAlloc(48, 100) == nullptr);
+		TEST_CHECK(errno == EINVAL);
+	}
+
+	// Blocks the CRT handed out before the shim took over, or while it was setting up, go back to the CRT
+	void TestForeignPointers()
+	{
+		void* pCrt = malloc(100);
+		FillPattern(pCrt, 100);
+		TEST_CHECK(ShimMallocUsableSize(pCrt) == _msize(pCrt));
+
+		pCrt = ShimRealloc(pCrt, 4000);
+		TEST_CHECK(pCrt != nullptr);
+		TEST_CHECK(CheckPattern(pCrt, 100));
+		TEST_CHECK(ShimMallocUsableSize(pCrt) == _msize(pCrt)); //Still the CRT's
+
+		pCrt = ShimRecalloc(pCrt, 100, 80);
+		TEST_CHECK(pCrt != nullptr);
+		TEST_CHECK(CheckPattern(pCrt, 100));
+		TEST_CHECK(IsZeroed(pCrt, 4000, 8000));
+
+		TEST_CHECK(ShimExpand(pCrt, 50) == _expand(pCrt, 50));
+		ShimFreeC(pCrt);
+
+		TEST_CHECK(ShimRealloc(malloc(10), 0) == nullptr);
+	}
+
+	// Blocks freed on a thread other than the one which allocated them, and by threads which have exited
+	void TestThreads()
+	{
+		const u32 k_uNumThreads = 8;
+		const u32 k_uNumBlocks = 2000;
+
+		std::vector<void*> blocks[k_uNumThreads];
+		std::vector<std::thread> threads;
+		for (u32 i = 0; i < k_uNumThreads; i++)
+		{
+			threads.emplace_back([&blocks, i]()
+			{
+				for (u32 j = 0; j < k_uNumBlocks; j++)
+				{
+					void* pMemory = ShimMalloc(16 + j % 200);
+					*(u32*)pMemory = i;
+					blocks[i].push_back(pMemory);
+				}
+			});
+		}
+		for (std::thread& thread : threads)
+		{
+			thread.join();
+		}
+
+		bool bIntact = true;
+		for (u32 i = 0; i < k_uNumThreads; i++)
+		{
+			for (void* pMemory : blocks[i])
+			{
+				bIntact &= *(u32*)pMemory == i;
+				ShimFreeC(pMemory);
+			}
+		}
+		TEST_CHECK(bIntact);
+	}
+}
+
+void TestMallocShim()
+{
+	//Read when the heaps are set up by the first call
+	char szHeapMB[16];
+	snprintf(szHeapMB, sizeof(szHeapMB), "%u", k_uShimHeapMB);
+	SetEnvironmentVariableA("MEMORYMANAGER_SHIM_HEAP_MB", szHeapMB);
+
+	TestMalloc();
+	TestCalloc();
+	TestRealloc();
+	TestAlignedAllocation();
+	TestForeignPointers();
+	TestThreads();
+}
@@ -0,0 +1,151 @@
+#include "pch.h"
+#include <map>
+#include <random>
+#include "TestHarness.h"
+#include "CPageMap.h"
+
+//////////////////////////////////////////////////////////////////////////
+// Tracing addresses back to their heap and their allocation
+//////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+	// Returns the allocation the address falls in according to our own records, nullptr if none
+	void* FindExpectedBlock(const std::map<u8*, u32>& allocations, u8* pAddress)
+	{
+		std::map<u8*, u32>::const_iterator it = allocations.upper_bound(pAddress);
+		if (it == allocations.begin())
+		{
+			return nullptr;
+		}
+		--it;
+		return pAddress < it->first + it->second ? it->first : nullptr;
+	}
+
+	// FindBlockContaining agrees with a brute force search, for addresses in payloads, headers,
+	// footers and padding, including deep inside blocks which cover many pages
+	void TestFindBlockContaining()
+	{
+		const u32 k_uHeapSize = 8 << 20;
+
+		CManagedHeap heap;
+		heap.Initialise(k_uHeapSize);
+
+		std::mt19937 random(7);
+		std::map<u8*, u32> allocations;
+		u32 uNumMismatches = 0;
+
+		for (u32 i = 0; i < 20000; i++)
+		{
+			if (allocations.size() < 2000 && random() % 3)
+			{
+				bool bLarge = random() % 10 == 0;
+				u32 uSize = 8 + random() % (bLarge ? 200000 : 300);
+				u8* pMemory = (u8*)heap.Allocate(uSize, bLarge ? 4096 : 4);
+				if (pMemory)
+				{
+					allocations[pMemory] = heap.GetAllocationSize(pMemory);
+				}
+			}
+			else if (!allocations.empty())
+			{
+				std::map<u8*, u32>::iterator it = allocations.begin();
+				std::advance(it, random() % allocations.size());
+				heap.Deallocate(it->first);
+				allocations.erase(it);
+			}
+
+			if (i % 1000 == 0 && !allocations.empty())
+			{
+				for (u32 j = 0; j < 500; j++)
+				{
+					std::map<u8*, u32>::iterator it = allocations.begin();
+					std::advance(it, random() % allocations.size());
+					u8* pAddress = it->first - 64 + random() % (it->second + 128);
+					if (heap.FindBlockContaining(pAddress) != FindExpectedBlock(allocations, pAddress))
+					{
+						uNumMismatches++;
+					}
+				}
+			}
+		}
+		TEST_CHECK(uNumMismatches == 0);
+
+		//Interior pointers have no size of their own, and neither do freed blocks
+		u8* pMemory = (u8*)heap.Allocate(64);
+		TEST_CHECK(heap.GetAllocationSize(pMemory) >= 64);
+		TEST_CHECK(heap.GetAllocationSize(pMemory + 32) == 0);
+		heap.Deallocate(pMemory);
+		TEST_CHECK(heap.GetAllocationSize(pMemory) == 0);
+
+		for (const std::pair<u8* const, u32>& allocation : allocations)
+		{
+			heap.Deallocate(allocation.first);
+		}
+		TEST_CHECK(heap.GetNumAllocs() == 0);
+		TEST_CHECK(VerifyWholeHeap(heap));
+		heap.Shutdown();
+	}
+
+	// Each heap's addresses map back to it, and nothing else maps to either
+	void TestFindHeap()
+	{
+		CManagedHeap heapA;
+		CManagedHeap heapB;
+		heapA.Initialise(1 << 20);
+		heapB.Initialise(1 << 20);
+
+		void* pA = heapA.Allocate(1000);
+		void* pB = heapB.Allocate(1000);
+		TEST_CHECK(CPageMap::FindHeap(pA) == &heapA);
+		TEST_CHECK(CPageMap::FindHeap(pB) == &heapB);
+
+		int iOnStack = 0;
+		TEST_CHECK(CPageMap::FindHeap(&iOnStack) == nullptr);
+
+		heapA.Deallocate(pA);
+		heapB.Deallocate(pB);
+		heapA.Shutdown();
+		TEST_CHECK(CPageMap::FindHeap(pA) == nullptr);
+		heapB.Shutdown();
+	}
+
+	// A heap owns nothing and reports nothing allocated before Initialise and after Shutdown,
+	// and can be initialised again once shut down
+	void TestUninitialisedHeap()
+	{
+		CManagedHeap heap;
+		u8 uOnStack = 0;
+		TEST_CHECK(!heap.Owns(&uOnStack));
+		TEST_CHECK(!heap.Owns(nullptr));
+		TEST_CHECK(heap.GetAllocatedBytes() == 0);
+		TEST_CHECK(heap.GetNumAllocs() == 0);
+
+		heap.Initialise(1 << 20);
+		void* pMemory = heap.Allocate(1000);
+		TEST_CHECK(heap.Owns(pMemory));
+		heap.Deallocate(pMemory);
+		heap.Shutdown();
+
+		TEST_CHECK(!heap.Owns(pMemory));
+		TEST_CHECK(!heap.Owns(nullptr));
+		TEST_CHECK(heap.GetAllocatedBytes() == 0);
+		TEST_CHECK(heap.GetNumAllocs() == 0);
+
+		heap.Initialise(1 << 20);
+		TEST_CHECK(heap.GetLastError() == CManagedHeap::EHeapError_Ok);
+		pMemory = heap.Allocate(1000);
+		TEST_CHECK(pMemory != nullptr && heap.Owns(pMemory));
+		TEST_CHECK(CPageMap::FindHeap(pMemory) == &heap);
+		heap.Deallocate(pMemory);
+		TEST_CHECK(VerifyWholeHeap(heap));
+		heap.Shutdown();
+	}
+}
+
+void TestPageMap()
+{
+	TestFindBlockContaining();
+	TestFindHeap();
+	TestUninitialisedHeap();
+}
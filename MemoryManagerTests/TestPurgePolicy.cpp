@@ -0,0 +1,151 @@
+#include "pch.h"
+#include "TestHarness.h"
+
+//////////////////////////////////////////////////////////////////////////
+// When purgeable allocations are evicted, and in what order
+//////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+	const u32 k_uNumPurgeable = 100;
+	const u32 k_uPurgeableSize = 4000;
+	const u32 k_uNumPriorities = 5;
+
+	struct SPurgeLog
+	{
+		u32 m_uPriorities[k_uNumPurgeable];
+		u32 m_uNumPurged;
+	};
+
+	// Runs with the heap locked, so only records into storage which already exists
+	void OnPurge(void* pMemory, void* pUserData)
+	{
+		(void)pMemory;
+		SPurgeLog& sLog = *(SPurgeLog*)pUserData;
+		sLog.m_uNumPurged++;
+	}
+
+	// As OnPurge, also recording the priority held at the start of the allocation
+	void OnPurgeRecordPriority(void* pMemory, void* pUserData)
+	{
+		SPurgeLog& sLog = *(SPurgeLog*)pUserData;
+		sLog.m_uPriorities[sLog.m_uNumPurged++] = *(u32*)pMemory;
+	}
+
+	// Nothing is evicted for a request purging could never satisfy, or which fits without purging
+	void TestPurgeOnlyWhenItHelps()
+	{
+		CManagedHeap heap;
+		heap.Initialise(1 << 20);
+
+		SPurgeLog sLog = {};
+		for (u32 i = 0; i < k_uNumPurgeable; i++)
+		{
+			TEST_CHECK(heap.AllocatePurgeable(k_uPurgeableSize, i, OnPurge, &sLog) != nullptr);
+		}
+
+		TEST_CHECK(heap.Allocate(2 << 20) == nullptr);
+		TEST_CHECK(sLog.m_uNumPurged == 0);
+
+		void* pFits = heap.Allocate(10000);
+		TEST_CHECK(pFits != nullptr);
+		TEST_CHECK(sLog.m_uNumPurged == 0);
+		heap.Deallocate(pFits);
+
+		//Only fits once some of the purgeable memory is gone
+		void* pLarge = heap.Allocate(700000);
+		TEST_CHECK(pLarge != nullptr);
+		TEST_CHECK(sLog.m_uNumPurged > 0);
+		TEST_CHECK(heap.GetNumPurgeable() == k_uNumPurgeable - sLog.m_uNumPurged);
+		TEST_CHECK(VerifyWholeHeap(heap));
+
+		heap.Deallocate(pLarge);
+		heap.Shutdown();
+	}
+
+	// Under a byte limit, purging stops as soon as the allocation fits beneath it,
+	// and an allocation which would be over the limit anyway purges nothing
+	void TestPurgeToByteLimit()
+	{
+		const u32 k_uByteLimit = 300000;
+
+		CManagedHeap heap;
+		heap.Initialise(1 << 20);
+
+		SPurgeLog sLog = {};
+		for (u32 i = 0; i < k_uNumPurgeable; i++)
+		{
+			heap.AllocatePurgeable(k_uPurgeableSize, i, OnPurge, &sLog);
+		}
+		heap.SetByteLimit(k_uByteLimit);
+
+		void* pMemory = heap.Allocate(50000);
+		TEST_CHECK(pMemory != nullptr);
+		TEST_CHECK(heap.GetAllocatedBytes() <= k_uByteLimit);
+		TEST_CHECK(heap.GetAllocatedBytes() + k_uPurgeableSize > k_uByteLimit); //Not one more purged than needed
+
+		u32 uNumPurged = sLog.m_uNumPurged;
+		TEST_CHECK(heap.Allocate(k_uByteLimit + 1) == nullptr);
+		TEST_CHECK(heap.GetLastError() == CManagedHeap::EHeapState_Alloc_OverByteLimit);
+		TEST_CHECK(sLog.m_uNumPurged == uNumPurged);
+
+		heap.Deallocate(pMemory);
+		TEST_CHECK(VerifyWholeHeap(heap));
+		heap.Shutdown();
+	}
+
+	// Lower priorities go first when no victim would open a hole next to free space, and touching
+	// only accepts live purgeable allocations
+	void TestPurgeOrder()
+	{
+		CManagedHeap heap;
+		heap.Initialise(1 << 20);
+
+		//A spacer either side of every purgeable allocation, so purging never merges with free space
+		void* pSpacers[k_uNumPurgeable + 1];
+		SPurgeLog sLog = {};
+		for (u32 i = 0; i < k_uNumPurgeable; i++)
+		{
+			pSpacers[i] = heap.Allocate(64);
+
+			u32 uPriority = (i * 3) % k_uNumPriorities;
+			u32* pMemory = (u32*)heap.AllocatePurgeable(k_uPurgeableSize, uPriority, OnPurgeRecordPriority, &sLog);
+			TEST_CHECK(pMemory != nullptr);
+			*pMemory = uPriority;
+
+			heap.TouchPurgeable((u8*)pMemory + 16); //Interior pointers are ignored
+		}
+		pSpacers[k_uNumPurgeable] = heap.Allocate(64);
+
+		void* pNotPurgeable = heap.Allocate(64);
+		heap.TouchPurgeable(pNotPurgeable);
+		heap.Deallocate(pNotPurgeable);
+		heap.TouchPurgeable(pNotPurgeable);
+		TEST_CHECK(heap.GetNumPurgeable() == k_uNumPurgeable);
+
+		//Larger than the free space at the top of the heap, and than any hole purging can open
+		void* pLarge = heap.Allocate(700000);
+		TEST_CHECK(sLog.m_uNumPurged > k_uNumPurgeable / k_uNumPriorities);
+		TEST_CHECK(sLog.m_uPriorities[0] == 0);
+		for (u32 i = 1; i < sLog.m_uNumPurged; i++)
+		{
+			TEST_CHECK(sLog.m_uPriorities[i - 1] <= sLog.m_uPriorities[i]);
+		}
+
+		heap.Deallocate(pLarge);
+		for (u32 i = 0; i <= k_uNumPurgeable; i++)
+		{
+			heap.Deallocate(pSpacers[i]);
+		}
+		TEST_CHECK(heap.GetNumAllocs() == 0);
+		TEST_CHECK(VerifyWholeHeap(heap));
+		heap.Shutdown();
+	}
+}
+
+void TestPurgePolicy()
+{
+	TestPurgeOnlyWhenItHelps();
+	TestPurgeToByteLimit();
+	TestPurgeOrder();
+}
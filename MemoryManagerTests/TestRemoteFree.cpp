@@ -0,0 +1,214 @@
+#include "pch.h"
+#include "TestHarness.h"
+
+//////////////////////////////////////////////////////////////////////////
+// Deallocations from threads other than the owner
+//////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+	// Pointers which are not the start of a live block must never be queued, and a block freed twice
+	// from other threads must only be released once
+	void TestRemoteValidation()
+	{
+		CManagedHeap heap;
+		heap.Initialise(1 << 20);
+		heap.SetOwnerThread();
+
+		void* pA = heap.Allocate(64);
+		void* pB = heap.Allocate(64);
+		void* pC = heap.Allocate(64);
+
+		std::thread remote([&]()
+		{
+			heap.Deallocate(pA);
+			heap.Deallocate(pA);
+			heap.Deallocate(pB);
+			heap.Deallocate((u8*)pC + 8);
+		});
+		remote.join();
+
+		//The interior pointer was refused on the locked path, which sets the error
+		TEST_CHECK(heap.GetLastError() == CManagedHeap::EHeapState_Dealloc_NotBlockStart);
+
+		//The next allocation releases the queue, A only once
+		void* pD = heap.Allocate(16);
+		TEST_CHECK(pD != nullptr);
+		TEST_CHECK(heap.GetNumAllocs() == 2);
+		TEST_CHECK(heap.GetAllocationSize(pC) != 0);
+
+		heap.Deallocate(pC);
+		std::thread remoteAgain([&]()
+		{
+			heap.Deallocate(pC);
+			heap.Deallocate(pD);
+			heap.Deallocate(pD);
+		});
+		remoteAgain.join();
+
+		heap.FlushMaintenance();
+		TEST_CHECK(heap.GetNumAllocs() == 0);
+		TEST_CHECK(VerifyWholeHeap(heap));
+		heap.Shutdown();
+	}
+
+	// One thread allocates while another frees everything it is handed
+	void TestRemoteProducerConsumer()
+	{
+		const u32 k_uNumAllocations = 50000;
+
+		CManagedHeap heap;
+		heap.Initialise(1 << 22);
+		heap.SetOwnerThread();
+
+		std::mutex queueLock;
+		std::vector<void*> queue;
+		bool bDone = false;
+
+		std::thread consumer([&]()
+		{
+			for (;;)
+			{
+				std::vector<void*> work;
+				{
+					std::lock_guard<std::mutex> lock(queueLock);
+					work.swap(queue);
+					if (work.empty() && bDone)
+					{
+						break;
+					}
+				}
+				for (void* pMemory : work)
+				{
+					heap.Deallocate(pMemory);
+				}
+			}
+		});
+
+		u32 uNumFailed = 0;
+		for (u32 i = 0; i < k_uNumAllocations; i++)
+		{
+			void* pMemory = heap.Allocate(8 + i % 64);
+			if (!pMemory)
+			{
+				uNumFailed++;
+				std::this_thread::yield();
+				continue;
+			}
+			std::lock_guard<std::mutex> lock(queueLock);
+			queue.push_back(pMemory);
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(queueLock);
+			bDone = true;
+		}
+		consumer.join();
+
+		heap.FlushMaintenance();
+		TEST_CHECK(uNumFailed < k_uNumAllocations);
+		TEST_CHECK(heap.GetNumAllocs() == 0);
+		TEST_CHECK(VerifyWholeHeap(heap));
+		heap.Shutdown();
+	}
+
+	const u32 k_uNumPurgeable = 200;
+
+	struct SRemotePurgeState
+	{
+		CManagedHeap* m_pHeap;
+		void* m_pBlocks[k_uNumPurgeable];
+		bool m_bRemoteFreed[k_uNumPurgeable];
+		bool m_bPurged[k_uNumPurgeable];
+		u32 m_uNumPurged;
+	};
+
+	u32 FindBlockIndex(SRemotePurgeState& sState, void* pMemory)
+	{
+		for (u32 i = 0; i < k_uNumPurgeable; i++)
+		{
+			if (sState.m_pBlocks[i] == pMemory)
+			{
+				return i;
+			}
+		}
+		return k_uNumPurgeable;
+	}
+
+	// On the first purge, another thread frees every other purgeable block while the owner is still purging
+	// Those frees take the lock free path, so they don't wait on the lock the owner holds
+	void OnPurgeFreeOthers(void* pMemory, void* pUserData)
+	{
+		SRemotePurgeState& sState = *(SRemotePurgeState*)pUserData;
+		u32 uIndex = FindBlockIndex(sState, pMemory);
+		if (uIndex < k_uNumPurgeable)
+		{
+			sState.m_bPurged[uIndex] = true;
+		}
+
+		if (sState.m_uNumPurged++ == 0)
+		{
+			std::thread remote([&sState, uIndex]()
+			{
+				for (u32 i = 0; i < k_uNumPurgeable; i += 2)
+				{
+					if (i != uIndex)
+					{
+						sState.m_pHeap->Deallocate(sState.m_pBlocks[i]);
+						sState.m_bRemoteFreed[i] = true;
+					}
+				}
+			});
+			remote.join();
+		}
+	}
+
+	// A purgeable block freed by another thread is waiting on the remote free list, and must not be purged
+	// from under it while the owner is making room for an allocation
+	void TestRemoteFreeDuringPurge()
+	{
+		CManagedHeap heap;
+		heap.Initialise(1 << 20);
+		heap.SetOwnerThread();
+
+		SRemotePurgeState sState = {};
+		sState.m_pHeap = &heap;
+		for (u32 i = 0; i < k_uNumPurgeable; i++)
+		{
+			sState.m_pBlocks[i] = heap.AllocatePurgeable(4000, 0, OnPurgeFreeOthers, &sState);
+			TEST_CHECK(sState.m_pBlocks[i] != nullptr);
+		}
+
+		void* pLarge = heap.Allocate(600000);
+		TEST_CHECK(pLarge != nullptr);
+		TEST_CHECK(sState.m_uNumPurged > 1);
+
+		for (u32 i = 0; i < k_uNumPurgeable; i++)
+		{
+			TEST_CHECK(!(sState.m_bPurged[i] && sState.m_bRemoteFreed[i]));
+		}
+
+		heap.FlushMaintenance();
+		TEST_CHECK(VerifyWholeHeap(heap));
+		TEST_CHECK(heap.GetNumAllocs() == heap.GetNumPurgeable() + 1);
+
+		heap.Deallocate(pLarge);
+		for (u32 i = 0; i < k_uNumPurgeable; i++)
+		{
+			if (!sState.m_bPurged[i] && !sState.m_bRemoteFreed[i])
+			{
+				heap.Deallocate(sState.m_pBlocks[i]);
+			}
+		}
+		TEST_CHECK(heap.GetNumAllocs() == 0);
+		TEST_CHECK(VerifyWholeHeap(heap));
+		heap.Shutdown();
+	}
+}
+
+void TestRemoteFree()
+{
+	TestRemoteValidation();
+	TestRemoteProducerConsumer();
+	TestRemoteFreeDuringPurge();
+}
@@ -0,0 +1,83 @@
+#include "pch.h"
+#include "TestHarness.h"
+
+//////////////////////////////////////////////////////////////////////////
+// Requests whose size, once rounded and padded, would not fit in 32 bits
+//////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+	void OnPurge(void* pMemory, void* pUserData)
+	{
+		(void)pMemory;
+		(void)pUserData;
+	}
+
+	void TestRejectsOverflow()
+	{
+		CManagedHeap heap;
+		heap.Initialise(1 << 20);
+
+		TEST_CHECK(heap.Allocate(0) == nullptr);
+		TEST_CHECK(heap.GetLastError() == CManagedHeap::EHeapState_Alloc_ZeroSizeAlloc);
+
+		TEST_CHECK(heap.Allocate(0xFFFFFFFD) == nullptr);
+		TEST_CHECK(heap.GetLastError() == CManagedHeap::EHeapState_Alloc_TooLarge);
+
+		TEST_CHECK(heap.Allocate(CManagedHeap::k_uMaxAllocationSize) == nullptr);
+		TEST_CHECK(heap.GetLastError() == CManagedHeap::EHeapState_Alloc_TooLarge);
+
+		//Small enough alone, but not once the alignment is added
+		TEST_CHECK(heap.Allocate(0xFFFFFFF0u - 64, 64) == nullptr);
+		TEST_CHECK(heap.GetLastError() == CManagedHeap::EHeapState_Alloc_TooLarge);
+
+		TEST_CHECK(heap.Allocate(0xFFFFFFF0u, CManagedHeap::ELifetime_Permanent) == nullptr);
+		TEST_CHECK(heap.GetLastError() == CManagedHeap::EHeapState_Alloc_TooLarge);
+
+		TEST_CHECK(heap.AllocatePurgeable(0xFFFFFFF0u, 0, OnPurge, nullptr) == nullptr);
+		TEST_CHECK(heap.GetLastError() == CManagedHeap::EHeapState_Alloc_TooLarge);
+
+		//Must not wrap around the byte limit check either
+		heap.SetByteLimit(1000);
+		TEST_CHECK(heap.Allocate(0xFFFFF000u) == nullptr);
+		heap.SetByteLimit(0);
+
+		//Larger than the heap, but representable, is just a failed allocation
+		TEST_CHECK(heap.Allocate(2 << 20) == nullptr);
+		TEST_CHECK(heap.GetLastError() == CManagedHeap::EHeapState_Alloc_NoLargeEnoughBlocks);
+
+		TEST_CHECK(heap.GetNumAllocs() == 0);
+		TEST_CHECK(VerifyWholeHeap(heap));
+		heap.Shutdown();
+	}
+
+	void TestSizedDeallocate()
+	{
+		CManagedHeap heap;
+		heap.Initialise(1 << 20);
+
+		void* pMemory = heap.Allocate(100);
+		TEST_CHECK(pMemory != nullptr);
+
+		heap.Deallocate(pMemory, 0xFFFFFFFF);
+		TEST_CHECK(heap.GetLastError() == CManagedHeap::EHeapState_Dealloc_SizeMismatch);
+		TEST_CHECK(heap.GetNumAllocs() == 1);
+
+		heap.Deallocate(pMemory, 60);
+		TEST_CHECK(heap.GetLastError() == CManagedHeap::EHeapState_Dealloc_SizeMismatch);
+		TEST_CHECK(heap.GetNumAllocs() == 1);
+
+		heap.Deallocate(pMemory, 100);
+		TEST_CHECK(heap.GetLastError() == CManagedHeap::EHeapError_Ok);
+		TEST_CHECK(heap.GetNumAllocs() == 0);
+
+		TEST_CHECK(VerifyWholeHeap(heap));
+		heap.Shutdown();
+	}
+}
+
+void TestSizeLimits()
+{
+	TestRejectsOverflow();
+	TestSizedDeallocate();
+}
@@ -0,0 +1,228 @@
+#include "pch.h"
+#include <random>
+#include <string>
+#include "TestHarness.h"
+#include "SnapshotAnalysis.h"
+
+//////////////////////////////////////////////////////////////////////////
+// Heap snapshots written by CManagedHeap::Snapshot and read back by HeapSnapshotTool
+//////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+	const char* k_szSnapshotFile = "MemoryManagerTests.snapshot";
+
+	bool AppendToString(const void* pData, u32 uNumBytes, void* pUserData)
+	{
+		((std::string*)pUserData)->append((const char*)pData, uNumBytes);
+		return true;
+	}
+
+	std::string ReadFile(const char* szFilename)
+	{
+		std::ifstream file(szFilename, std::ios::in | std::ios::binary);
+		return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+	}
+
+	void WriteFile(const char* szFilename, const std::string& contents)
+	{
+		std::ofstream file(szFilename, std::ios::out | std::ios::binary | std::ios::trunc);
+		file.write(contents.data(), contents.size());
+	}
+
+	// Fills a heap with blocks of mixed sizes and alignments, then releases some to leave holes
+	void MakeHoles(CManagedHeap& heap, std::vector<void*>& blocks, std::vector<u32>& alignments)
+	{
+		std::mt19937 random(11);
+		for (u32 i = 0; i < 2000; i++)
+		{
+			u32 uAlignment = 4u << (random() % 8);
+			void* pMemory = heap.Allocate(8 + random() % 600, uAlignment);
+			TEST_CHECK(pMemory != nullptr);
+			if (i % 3 == 0)
+			{
+				heap.Deallocate(pMemory);
+				continue;
+			}
+			blocks.push_back(pMemory);
+			alignments.push_back(uAlignment);
+		}
+	}
+
+	// Loading the file gives back every block where the heap has it, with the heap's own counters,
+	// and the records tile the heap exactly
+	void TestRoundTrip()
+	{
+		const u32 k_uHeapSize = 1 << 21;
+
+		//Given the memory, so offsets in the snapshot can be turned back into addresses
+		u8* pRawMemory = (u8*)malloc(k_uHeapSize);
+		CManagedHeap heap;
+		heap.Initialise(pRawMemory, k_uHeapSize);
+		std::vector<void*> blocks;
+		std::vector<u32> alignments;
+		MakeHoles(heap, blocks, alignments);
+
+		TEST_CHECK(heap.Snapshot(k_szSnapshotFile));
+		SSnapshot sSnapshot;
+		TEST_CHECK(LoadSnapshot(k_szSnapshotFile, sSnapshot));
+
+		//The file holds exactly what the writer is given
+		std::string streamed;
+		TEST_CHECK(heap.Snapshot(AppendToString, &streamed));
+		TEST_CHECK(streamed == ReadFile(k_szSnapshotFile));
+		remove(k_szSnapshotFile);
+
+		const SSnapshotHeader& sHeader = sSnapshot.m_sHeader;
+		TEST_CHECK(sHeader.m_uHeapSize == k_uHeapSize);
+		TEST_CHECK(sHeader.m_uNumAllocations == heap.GetNumAllocs());
+		TEST_CHECK(sHeader.m_uHeapSize - sHeader.m_uFreeSpace == heap.GetAllocatedBytes());
+
+		//Each record starts where the one before it ends, sharing the padding between them
+		u32 uNextOffset = sSnapshot.m_Blocks.empty() ? 0 : sSnapshot.m_Blocks[0].m_uLeftPadding;
+		std::unordered_map<u32, const SSnapshotBlock*> byPayload;
+		for (const SSnapshotBlock& sBlock : sSnapshot.m_Blocks)
+		{
+			TEST_CHECK(sBlock.m_uOffset == uNextOffset);
+			uNextOffset = sBlock.m_uOffset + sHeader.m_uHeaderSize + sBlock.m_uBlockSize + sHeader.m_uFooterSize + sBlock.m_uRightPadding;
+			byPayload[sBlock.m_uOffset + sHeader.m_uHeaderSize] = &sBlock;
+		}
+		TEST_CHECK(uNextOffset == sHeader.m_uHeapSize);
+
+		//Every live allocation is recorded at its own offset, with at least the alignment asked for
+		for (size_t i = 0; i < blocks.size(); i++)
+		{
+			std::unordered_map<u32, const SSnapshotBlock*>::const_iterator it = byPayload.find((u32)((u8*)blocks[i] - pRawMemory));
+			TEST_CHECK(it != byPayload.end());
+			if (it != byPayload.end())
+			{
+				TEST_CHECK(!IsFreeBlock(*it->second));
+				TEST_CHECK(it->second->m_uBlockSize == heap.GetAllocationSize(blocks[i]));
+				TEST_CHECK(it->second->m_uAlignment >= alignments[i]);
+			}
+		}
+
+		SSnapshotSummary sSummary = Summarise(sSnapshot);
+		TEST_CHECK(sSummary.m_uNumBlocks - sSummary.m_uNumFreeBlocks == heap.GetNumAllocs());
+		TEST_CHECK(sSummary.m_uAllocatedBytes + sSummary.m_uFreeBytes + sSummary.m_uPaddingBytes + sSummary.m_uOverheadBytes == sHeader.m_uHeapSize);
+		TEST_CHECK(GetFragmentation(sSummary) > 0.0);
+
+		for (void* pMemory : blocks)
+		{
+			heap.Deallocate(pMemory);
+		}
+		heap.Shutdown();
+		free(pRawMemory);
+	}
+
+	void OnPurge(void* pMemory, void* pUserData)
+	{
+	}
+
+	// An empty heap is one unfragmented free block, and blocks land in the histogram bucket of their size
+	// with purgeable blocks flagged but counted as allocated
+	void TestSummary()
+	{
+		const u32 k_uNumBlocks = 100;
+		const u32 k_uBlockSize = 100;
+
+		CManagedHeap heap;
+		heap.Initialise(1 << 20);
+
+		std::string streamed;
+		TEST_CHECK(heap.Snapshot(AppendToString, &streamed));
+		WriteFile(k_szSnapshotFile, streamed);
+		SSnapshot sEmpty;
+		TEST_CHECK(LoadSnapshot(k_szSnapshotFile, sEmpty));
+		SSnapshotSummary sSummary = Summarise(sEmpty);
+		TEST_CHECK(sSummary.m_uNumBlocks == 1 && sSummary.m_uNumFreeBlocks == 1);
+		TEST_CHECK(sSummary.m_uLargestFreeBlock == sSummary.m_uFreeBytes);
+		TEST_CHECK(GetFragmentation(sSummary) == 0.0);
+
+		std::vector<void*> blocks;
+		for (u32 i = 0; i < k_uNumBlocks; i++)
+		{
+			blocks.push_back(heap.Allocate(k_uBlockSize));
+		}
+		void* pPurgeable = heap.AllocatePurgeable(k_uBlockSize, 0, OnPurge, nullptr);
+		TEST_CHECK(pPurgeable != nullptr);
+
+		TEST_CHECK(heap.Snapshot(k_szSnapshotFile));
+		SSnapshot sFull;
+		TEST_CHECK(LoadSnapshot(k_szSnapshotFile, sFull));
+		remove(k_szSnapshotFile);
+		sSummary = Summarise(sFull);
+		TEST_CHECK(sSummary.m_uNumBlocks - sSummary.m_uNumFreeBlocks == k_uNumBlocks + 1);
+		TEST_CHECK(sSummary.m_uAllocatedCounts[GetSnapshotBucket(k_uBlockSize)] >= k_uNumBlocks);
+		TEST_CHECK(GetSnapshotBucket(k_uBlockSize) == 6 && GetSnapshotBucket(1) == 0 && GetSnapshotBucket(0xFFFFFFFF) == 31);
+
+		u32 uNumPurgeable = 0;
+		for (const SSnapshotBlock& sBlock : sFull.m_Blocks)
+		{
+			if (sBlock.m_uFlags & CManagedHeap::ESnapshotFlag_Purgeable)
+			{
+				TEST_CHECK(!IsFreeBlock(sBlock));
+				uNumPurgeable++;
+			}
+		}
+		TEST_CHECK(uNumPurgeable == 1);
+
+		for (void* pMemory : blocks)
+		{
+			heap.Deallocate(pMemory);
+		}
+		heap.Deallocate(pPurgeable);
+		heap.Shutdown();
+	}
+
+	// Files which aren't whole snapshots of this version are refused rather than misread
+	void TestBadFiles()
+	{
+		CManagedHeap heap;
+		std::string streamed;
+		TEST_CHECK(!heap.Snapshot(AppendToString, &streamed)); //Not initialised
+		TEST_CHECK(heap.GetLastError() == CManagedHeap::EHeapState_Init_NotInitialised);
+
+		heap.Initialise(1 << 20);
+		void* pMemory = heap.Allocate(1000);
+		TEST_CHECK(heap.Snapshot(AppendToString, &streamed));
+		heap.Deallocate(pMemory);
+		heap.Shutdown();
+
+		SSnapshot sSnapshot;
+		remove(k_szSnapshotFile);
+		TEST_CHECK(!LoadSnapshot(k_szSnapshotFile, sSnapshot));
+
+		WriteFile(k_szSnapshotFile, streamed.substr(0, sizeof(SSnapshotHeader) / 2));
+		TEST_CHECK(!LoadSnapshot(k_szSnapshotFile, sSnapshot));
+
+		std::string badMagic = streamed;
+		badMagic[0] ^= 0xFF;
+		WriteFile(k_szSnapshotFile, badMagic);
+		TEST_CHECK(!LoadSnapshot(k_szSnapshotFile, sSnapshot));
+
+		std::string newerVersion = streamed;
+		SSnapshotHeader sHeader;
+		memcpy(&sHeader, newerVersion.data(), sizeof(sHeader));
+		sHeader.m_uVersion++;
+		memcpy(&newerVersion[0], &sHeader, sizeof(sHeader));
+		WriteFile(k_szSnapshotFile, newerVersion);
+		TEST_CHECK(!LoadSnapshot(k_szSnapshotFile, sSnapshot));
+
+		WriteFile(k_szSnapshotFile, streamed.substr(0, streamed.size() - 1));
+		TEST_CHECK(!LoadSnapshot(k_szSnapshotFile, sSnapshot));
+
+		SSnapshot sWhole;
+		WriteFile(k_szSnapshotFile, streamed);
+		TEST_CHECK(LoadSnapshot(k_szSnapshotFile, sWhole));
+		TEST_CHECK(sWhole.m_Blocks.size() == (streamed.size() - sizeof(SSnapshotHeader)) / sizeof(SSnapshotBlock));
+		remove(k_szSnapshotFile);
+	}
+}
+
+void TestSnapshot()
+{
+	TestRoundTrip();
+	TestSummary();
+	TestBadFiles();
+}
@@ -0,0 +1,129 @@
+#include "pch.h"
+#include <random>
+#include "TestHarness.h"
+
+//////////////////////////////////////////////////////////////////////////
+// Incremental verification while the heap changes under it, and catching corruption
+//////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+	// Finds the offset of the first block of a given size in a snapshot
+	struct SFindHeaderOffset
+	{
+		u32 m_uBlockSize;
+		u32 m_uOffset;
+		bool m_bReadHeader;
+	};
+
+	bool FindFirstBlockOfSize(const void* pData, u32 uNumBytes, void* pUserData)
+	{
+		SFindHeaderOffset& sFind = *(SFindHeaderOffset*)pUserData;
+		if (!sFind.m_bReadHeader)
+		{
+			sFind.m_bReadHeader = true; //The first write is the SSnapshotHeader
+			return true;
+		}
+
+		const CManagedHeap::SSnapshotBlock* pBlocks = (const CManagedHeap::SSnapshotBlock*)pData;
+		for (u32 i = 0; i < uNumBytes / sizeof(CManagedHeap::SSnapshotBlock); i++)
+		{
+			if (sFind.m_uOffset == 0xFFFFFFFF && pBlocks[i].m_uBlockSize == sFind.m_uBlockSize)
+			{
+				sFind.m_uOffset = pBlocks[i].m_uOffset;
+			}
+		}
+		return true;
+	}
+
+	// Tiny steps interleaved with allocations and releases on both sides of the cursor never report an error
+	void TestVerifyWhileChanging()
+	{
+		CManagedHeap heap;
+		heap.Initialise(1 << 20);
+
+		std::mt19937 random(3);
+		std::vector<void*> live;
+		u32 uNumFailedSteps = 0;
+
+		for (u32 i = 0; i < 100000; i++)
+		{
+			if (live.empty() || random() % 2)
+			{
+				void* pMemory = heap.Allocate(1 + random() % 600, 4u << (random() % 5));
+				if (pMemory)
+				{
+					live.push_back(pMemory);
+				}
+			}
+			else
+			{
+				size_t uIndex = random() % live.size();
+				heap.Deallocate(live[uIndex]);
+				live[uIndex] = live.back();
+				live.pop_back();
+			}
+
+			if (i % 3 == 0 && !heap.VerifyStep(1 + random() % 8))
+			{
+				uNumFailedSteps++;
+			}
+		}
+		TEST_CHECK(uNumFailedSteps == 0);
+		TEST_CHECK(heap.GetNumVerifyPasses() > 0);
+
+		for (void* pMemory : live)
+		{
+			heap.Deallocate(pMemory);
+		}
+		TEST_CHECK(VerifyWholeHeap(heap));
+		heap.Shutdown();
+	}
+
+	// An overrun into a footer is found, at the block it belongs to, and the next pass starts clean
+	void TestVerifyFindsCorruption()
+	{
+		CManagedHeap heap;
+		heap.Initialise(1 << 20);
+
+		std::vector<u8*> blocks;
+		for (u32 i = 0; i < 100; i++)
+		{
+			blocks.push_back((u8*)heap.Allocate(i == 50 ? 200 : 100));
+		}
+		TEST_CHECK(VerifyWholeHeap(heap));
+
+		u8* pVictim = blocks[50];
+		u32 uSize = heap.GetAllocationSize(pVictim);
+
+		SFindHeaderOffset sFind = { uSize, 0xFFFFFFFF, false };
+		TEST_CHECK(heap.Snapshot(FindFirstBlockOfSize, &sFind));
+
+		pVictim[uSize] ^= 0xFF;
+
+		bool bCaught = false;
+		u32 uPasses = heap.GetNumVerifyPasses();
+		while (!bCaught && heap.GetNumVerifyPasses() == uPasses)
+		{
+			bCaught = !heap.VerifyStep(16);
+		}
+		TEST_CHECK(bCaught);
+		TEST_CHECK(heap.GetLastError() == CManagedHeap::EHeapState_Verify_FooterMismatch);
+		TEST_CHECK(heap.GetVerifyErrorOffset() == sFind.m_uOffset);
+
+		pVictim[uSize] ^= 0xFF;
+		TEST_CHECK(VerifyWholeHeap(heap));
+
+		for (u8* pMemory : blocks)
+		{
+			heap.Deallocate(pMemory);
+		}
+		heap.Shutdown();
+	}
+}
+
+void TestVerifyStep()
+{
+	TestVerifyWhileChanging();
+	TestVerifyFindsCorruption();
+}
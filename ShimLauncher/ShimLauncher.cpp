@@ -0,0 +1,147 @@
+#include "pch.h"
+#include <string>
+
+//////////////////////////////////////////////////////////////////////////
+// Runs an unchanged program with MallocShim loaded
+//
+//   ShimLauncher <MallocShim.dll> <program> [arguments]
+//
+// The program is created suspended, the shim is loaded into it by a remote LoadLibraryA,
+// and only then is it resumed, so the program's own code never allocates from the CRT heap.
+// Exits with the program's exit code, or 1 if it could not be started.
+//////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+	void PrintUsage()
+	{
+		std::cerr << "Usage:" << std::endl;
+		std::cerr << "  ShimLauncher <MallocShim.dll> <program> [arguments]" << std::endl;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// Quotes an argument for the command line, if it needs it
+	//////////////////////////////////////////////////////////////////////////
+	std::string QuoteArgument(const char* szArgument)
+	{
+		std::string argument = szArgument;
+		if (!argument.empty() && argument.find_first_of(" \t\"") == std::string::npos)
+		{
+			return argument;
+		}
+
+		//Backslashes only need doubling when they end up in front of a quote
+		std::string quoted = "\"";
+		size_t uNumBackslashes = 0;
+		for (char c : argument)
+		{
+			if (c == '\\')
+			{
+				uNumBackslashes++;
+				continue;
+			}
+			quoted.append(c == '"' ? uNumBackslashes * 2 + 1 : uNumBackslashes, '\\');
+			quoted += c;
+			uNumBackslashes = 0;
+		}
+		quoted.append(uNumBackslashes * 2, '\\');
+		quoted += '"';
+		return quoted;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// Loads a DLL into a suspended process. Returns false with a message if it could not be loaded
+	// kernel32 is at the same address in every process of the same bitness, so our LoadLibraryA is theirs
+	//////////////////////////////////////////////////////////////////////////
+	bool InjectLibrary(HANDLE hProcess, const char* szLibraryPath)
+	{
+		size_t uPathSize = strlen(szLibraryPath) + 1;
+		void* pRemotePath = VirtualAllocEx(hProcess, nullptr, uPathSize, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+		if (!pRemotePath)
+		{
+			std::cerr << "Could not allocate in the target process, error " << GetLastError() << std::endl;
+			return false;
+		}
+
+		bool bLoaded = false;
+		if (WriteProcessMemory(hProcess, pRemotePath, szLibraryPath, uPathSize, nullptr))
+		{
+			LPTHREAD_START_ROUTINE pfnLoadLibrary = (LPTHREAD_START_ROUTINE)GetProcAddress(GetModuleHandleA("kernel32.dll"), "LoadLibraryA");
+			HANDLE hThread = CreateRemoteThread(hProcess, nullptr, 0, pfnLoadLibrary, pRemotePath, 0, nullptr);
+			if (hThread)
+			{
+				//The thread's exit code is the low half of the module handle, 0 if the load failed
+				DWORD uExitCode = 0;
+				WaitForSingleObject(hThread, INFINITE);
+				bLoaded = GetExitCodeThread(hThread, &uExitCode) && uExitCode != 0;
+				CloseHandle(hThread);
+				if (!bLoaded)
+				{
+					std::cerr << "The target process could not load " << szLibraryPath << std::endl;
+				}
+			}
+			else
+			{
+				std::cerr << "Could not start a thread in the target process, error " << GetLastError() << std::endl;
+			}
+		}
+		else
+		{
+			std::cerr << "Could not write to the target process, error " << GetLastError() << std::endl;
+		}
+
+		VirtualFreeEx(hProcess, pRemotePath, 0, MEM_RELEASE);
+		return bLoaded;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc < 3)
+	{
+		PrintUsage();
+		return 1;
+	}
+
+	//The target resolves the path from its own working directory, so give it the full one
+	char szShimPath[MAX_PATH];
+	DWORD uPathLength = GetFullPathNameA(argv[1], MAX_PATH, szShimPath, nullptr);
+	if (uPathLength == 0 || uPathLength >= MAX_PATH || GetFileAttributesA(szShimPath) == INVALID_FILE_ATTRIBUTES)
+	{
+		std::cerr << "Could not find " << argv[1] << std::endl;
+		return 1;
+	}
+
+	std::string commandLine = QuoteArgument(argv[2]);
+	for (int i = 3; i < argc; i++)
+	{
+		commandLine += ' ';
+		commandLine += QuoteArgument(argv[i]);
+	}
+
+	STARTUPINFOA sStartupInfo = {};
+	sStartupInfo.cb = sizeof(sStartupInfo);
+	PROCESS_INFORMATION sProcessInfo = {};
+	if (!CreateProcessA(nullptr, &commandLine[0], nullptr, nullptr, FALSE, CREATE_SUSPENDED, nullptr, nullptr, &sStartupInfo, &sProcessInfo))
+	{
+		std::cerr << "Could not start " << argv[2] << ", error " << GetLastError() << std::endl;
+		return 1;
+	}
+
+	if (!InjectLibrary(sProcessInfo.hProcess, szShimPath))
+	{
+		TerminateProcess(sProcessInfo.hProcess, 1);
+		CloseHandle(sProcessInfo.hThread);
+		CloseHandle(sProcessInfo.hProcess);
+		return 1;
+	}
+
+	ResumeThread(sProcessInfo.hThread);
+	WaitForSingleObject(sProcessInfo.hProcess, INFINITE);
+
+	DWORD uExitCode = 1;
+	GetExitCodeProcess(sProcessInfo.hProcess, &uExitCode);
+	CloseHandle(sProcessInfo.hThread);
+	CloseHandle(sProcessInfo.hProcess);
+	return (int)uExitCode;
+}